@@ -5,38 +5,36 @@
 
 // Get first child with id >= min_id
 std::optional<message> get_message(uint64_t parent, uint64_t min_id, const eosio::database_status& status) {
-    auto s = query_database(eosio::query_contract_index64_range_code_table_scope_sk_pk{
-        .snapshot_block = status.head,
-        .first =
-            {
-                .code          = "talk"_n,
-                .table         = "message"_n,
-                .scope         = ""_n,
-                .secondary_key = parent,
-                .primary_key   = min_id,
-            },
-        .last =
-            {
-                .code          = "talk"_n,
-                .table         = "message"_n,
-                .scope         = ""_n,
-                .secondary_key = parent,
-                .primary_key   = 0xffff'ffff'ffff'ffffull,
-            },
-        .max_results = 10,
-    });
-
     std::optional<message> result;
-
-    // todo: handle case where all results are !present, but more results follow.
-    eosio::for_each_query_result<eosio::contract_secondary_index_with_row<uint64_t>>(s, [&](auto& r) {
-        if (r.present && r.row_present) {
-            result.emplace();
-            *r.row_value >> *result;
-            return false;
-        }
-        return true;
-    });
+    eosio::for_each_query_result_paged<eosio::contract_secondary_index_with_row<uint64_t>>(
+        eosio::query_contract_index64_range_code_table_scope_sk_pk{
+            .snapshot_block = status.head,
+            .first =
+                {
+                    .code          = "talk"_n,
+                    .table         = "message"_n,
+                    .scope         = ""_n,
+                    .secondary_key = parent,
+                    .primary_key   = min_id,
+                },
+            .last =
+                {
+                    .code          = "talk"_n,
+                    .table         = "message"_n,
+                    .scope         = ""_n,
+                    .secondary_key = parent,
+                    .primary_key   = 0xffff'ffff'ffff'ffffull,
+                },
+            .max_results = 10,
+        },
+        [&](auto& r) {
+            if (r.present && r.row_present) {
+                result.emplace();
+                *r.row_value >> *result;
+                return false;
+            }
+            return true;
+        });
 
     return result;
 }
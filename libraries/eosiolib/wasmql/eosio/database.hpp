@@ -68,6 +68,11 @@ __attribute__((noinline)) inline eosio::rope to_json(transaction_status value) {
     return eosio::int_to_json(std::underlying_type_t<transaction_status>(value));
 }
 
+/// \group write_json_explicit
+__attribute__((noinline)) inline void write_json(json_writer& w, transaction_status value) {
+    eosio::int_to_json(w, std::underlying_type_t<transaction_status>(value));
+}
+
 /// Information extracted from a block
 struct block_info {
     uint32_t        block_num             = {};
@@ -840,6 +845,8 @@ inline database_status get_database_status() {
 /// The serialized form is the same as `vector<vector<char>>`'s serialized form. Each inner vector contains the
 /// serialized form of a record. The record type varies with query.
 ///
+/// The records may be followed by a resume cursor; see `for_each_query_result_paged`.
+///
 /// Use `for_each_query_result` or `for_each_contract_row` to iterate through the result.
 template <typename T>
 inline std::vector<char> query_database(const T& request) {
@@ -888,6 +895,60 @@ bool for_each_contract_row(const std::vector<char>& bytes, F f) {
     });
 }
 
+/// \exclude
+template <typename Q>
+auto set_snapshot_block(Q& request, uint32_t block, int) -> decltype(void(request.snapshot_block = block)) {
+    request.snapshot_block = block;
+}
+
+/// \exclude
+template <typename Q>
+void set_snapshot_block(Q&, uint32_t, long) {}
+
+/// Query the range [`request.first`, `request.last`] a page of `request.max_results` records at a time
+/// and call `f(record)` for each record until `f` returns false. `T` is the record type. `Q` must be
+/// one of the `query_*` structs which has a `key`.
+///
+/// Each page resumes at the cursor the wasm-ql server appended to the previous result, so skipped
+/// records (e.g. rows which aren't present) don't stop the iteration early and deep pages cost the same
+/// as the first. Later pages use the first page's snapshot block.
+template <typename T, typename Q, typename F>
+bool for_each_query_result_paged(Q request, F f) {
+    while (true) {
+        auto                    bytes = query_database(request);
+        datastream<const char*> ds(bytes.data(), bytes.size());
+        unsigned_int            size;
+        ds >> size;
+        typename Q::key last = {};
+        for (uint32_t i = 0; i < size.value; ++i) {
+            shared_memory<datastream<const char*>> record{};
+            ds >> record;
+            T r;
+            *record >> r;
+            last = Q::key::from_data(r);
+            if (!f(r))
+                return false;
+        }
+        if (ds.remaining()) {
+            uint8_t more;
+            ds >> more;
+            if (!more)
+                return true;
+            uint32_t snapshot_block;
+            ds >> snapshot_block;
+            ds >> request.first;
+            set_snapshot_block(request, snapshot_block, 0);
+        } else {
+            // Server didn't send a cursor; a full page may have more after it
+            if (!size.value || size.value < request.max_results)
+                return true;
+            request.first = last;
+        }
+        if (increment_key(request.first))
+            return true;
+    }
+}
+
 /// \exclude
 extern "C" void query_database(void* req_begin, void* req_end, void* cb_alloc_data, void* (*cb_alloc)(void* cb_alloc_data, size_t size));
 
@@ -9,10 +9,12 @@
 #include <eosio/fixed_bytes.hpp>
 #include <eosio/rope.hpp>
 #include <eosio/shared_memory.hpp>
+#include <eosio/struct_reflection.hpp>
 #include <eosio/tagged_variant.hpp>
 #include <eosio/temp_placeholders.hpp>
 #include <eosio/time.hpp>
 #include <eosio/varint.hpp>
+#include <cstring>
 #include <limits>
 #include <type_traits>
 #include <vector>
@@ -43,12 +45,117 @@ struct rope_buffer {
 
 inline constexpr char hex_digits[] = "0123456789ABCDEF";
 
+inline constexpr char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                                      "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                                      "8081828384858687888990919293949596979899";
+
+// Characters which to_json(std::string_view) escapes
+struct json_escape_table {
+    bool escape[256] = {};
+
+    constexpr json_escape_table() {
+        for (int i = 0; i < 32; ++i)
+            escape[i] = true;
+        escape[(unsigned char)'"']  = true;
+        escape[(unsigned char)'\\'] = true;
+        escape[127]                 = true;
+    }
+};
+
+inline constexpr json_escape_table json_escape = {};
+
+// Writes value's decimal digits so they end just before `end`. Returns the position of the first digit.
+inline char* write_decimal(char* end, uint64_t value) {
+    while (value >= 100) {
+        auto i = (value % 100) * 2;
+        value /= 100;
+        *--end = digit_pairs[i + 1];
+        *--end = digit_pairs[i];
+    }
+    if (value >= 10) {
+        *--end = digit_pairs[value * 2 + 1];
+        *--end = digit_pairs[value * 2];
+    } else {
+        *--end = '0' + value;
+    }
+    return end;
+}
+
 } // namespace internal_use_do_not_use
 
+/// Builds JSON in a single contiguous buffer. `write_json` appends a value to it and produces the
+/// same text as `to_json`, without the many small allocations a `rope` needs.
+///
+/// ```c++
+/// eosio::json_writer w;
+/// write_json(w, response);
+/// eosio::set_output_data(w.sv());
+/// ```
+class json_writer {
+  public:
+    json_writer() = default;
+    json_writer(const json_writer&) = delete;
+    ~json_writer() { free(begin); }
+
+    json_writer& operator=(const json_writer&) = delete;
+
+    /// Make room for `size` more bytes and return where they start. Pass the end of what was
+    /// written to `commit`.
+    char* prepare(size_t size) {
+        if (size_t(end - pos) < size)
+            grow(size);
+        return pos;
+    }
+
+    /// \exclude
+    void commit(char* new_pos) { pos = new_pos; }
+
+    void write(char ch) { *prepare(1) = ch, ++pos; }
+
+    void write(std::string_view sv) {
+        memcpy(prepare(sv.size()), sv.data(), sv.size());
+        pos += sv.size();
+    }
+
+    /// Discard what was written, keeping the buffer for reuse
+    void clear() { pos = begin; }
+
+    /// The JSON written so far
+    std::string_view sv() const { return {begin, size_t(pos - begin)}; }
+
+    /// Hand the buffer over to a `rope`, leaving the writer empty
+    rope release() {
+        rope result{sv()};
+        begin = pos = end = nullptr;
+        return result;
+    }
+
+  private:
+    char* begin = nullptr;
+    char* pos   = nullptr;
+    char* end   = nullptr;
+
+    void grow(size_t size) {
+        size_t used     = pos - begin;
+        size_t capacity = std::max(std::max(size_t(end - begin) * 2, used + size), size_t(64));
+        auto   buffer   = (char*)malloc(capacity);
+        if (used)
+            memcpy(buffer, begin, used);
+        free(begin);
+        begin = buffer;
+        pos   = buffer + used;
+        end   = buffer + capacity;
+    }
+};
+
 /// \exclude
 template <typename T>
 rope to_json(const T& obj);
 
+/// \exclude
+template <typename T>
+void write_json(json_writer& w, const T& obj);
+
 // todo: use hex if content isn't valid utf-8
 /// \group to_json_explicit Convert explicit types to JSON
 /// Convert objects to JSON. These overloads handle specified types.
@@ -109,22 +216,23 @@ __attribute__((noinline)) inline rope to_json(bool value) {
 template <typename T>
 __attribute__((noinline)) inline rope int_to_json(T value) {
     using namespace internal_use_do_not_use;
-    auto        uvalue = std::make_unsigned_t<T>(value);
-    rope_buffer b(std::numeric_limits<T>::digits10 + 4);
-    bool        neg = value < 0;
+    auto uvalue = std::make_unsigned_t<T>(value);
+    bool neg    = value < 0;
     if (neg)
         uvalue = -uvalue;
+    char  digits[std::numeric_limits<T>::digits10 + 4];
+    char* end = digits + sizeof(digits);
+    char* pos = end;
     if (sizeof(T) > 4)
-        *b.pos++ = '"';
-    do {
-        *b.pos++ = '0' + (uvalue % 10);
-        uvalue /= 10;
-    } while (uvalue);
+        *--pos = '"';
+    pos = write_decimal(pos, uvalue);
     if (neg)
-        *b.pos++ = '-';
+        *--pos = '-';
     if (sizeof(T) > 4)
-        *b.pos++ = '"';
-    b.reverse();
+        *--pos = '"';
+    rope_buffer b(end - pos);
+    memcpy(b.pos, pos, end - pos);
+    b.pos += end - pos;
     return b;
 }
 
@@ -311,41 +419,316 @@ __attribute__((noinline)) inline rope to_json(const shared_memory<datastream<con
     return b;
 }
 
-/// \group to_json_explicit
+/// \group write_json_explicit Write explicit types to a json_writer
+/// Append JSON to a `json_writer`. The output matches the corresponding `to_json` overload.
+__attribute__((noinline)) inline void write_json(json_writer& w, std::string_view sv) {
+    using namespace internal_use_do_not_use;
+    w.write('"');
+    auto begin = sv.begin();
+    auto end   = sv.end();
+    while (begin != end) {
+        auto pos = begin;
+        while (pos != end && !json_escape.escape[(unsigned char)(*pos)])
+            ++pos;
+        if (begin != pos) {
+            w.write(std::string_view{begin, size_t(pos - begin)});
+            begin = pos;
+        }
+        if (begin != end) {
+            if (*begin == '"')
+                w.write("\\\"");
+            else if (*begin == '\\')
+                w.write("\\\\");
+            else {
+                char* out = w.prepare(6);
+                out[0]    = '\\';
+                out[1]    = 'u';
+                out[2]    = '0';
+                out[3]    = '0';
+                out[4]    = hex_digits[(unsigned char)(*begin) >> 4];
+                out[5]    = hex_digits[(unsigned char)(*begin) & 15];
+                w.commit(out + 6);
+            }
+            ++begin;
+        }
+    }
+    w.write('"');
+}
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, const std::string& s) { write_json(w, std::string_view{s}); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, shared_memory<std::string_view> sv) { write_json(w, *sv); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, bool value) { w.write(value ? "true" : "false"); }
+
+/// \exclude
 template <typename T>
-__attribute__((noinline)) inline rope to_json(const std::optional<T>& obj) {
+__attribute__((noinline)) inline void int_to_json(json_writer& w, T value) {
+    using namespace internal_use_do_not_use;
+    auto uvalue = std::make_unsigned_t<T>(value);
+    bool neg    = value < 0;
+    if (neg)
+        uvalue = -uvalue;
+    char* out = w.prepare(std::numeric_limits<T>::digits10 + 4);
+    char  digits[std::numeric_limits<uint64_t>::digits10 + 1];
+    char* end = digits + sizeof(digits);
+    char* pos = write_decimal(end, uvalue);
+    if (sizeof(T) > 4)
+        *out++ = '"';
+    if (neg)
+        *out++ = '-';
+    memcpy(out, pos, end - pos);
+    out += end - pos;
+    if (sizeof(T) > 4)
+        *out++ = '"';
+    w.commit(out);
+}
+
+/// \exclude
+template <typename T>
+__attribute__((noinline)) inline void fp_to_json(json_writer& w, T value) {
+    char* out = w.prepare(24 + 2); // fpconv_dtoa writes at most 24 characters
+    if (sizeof(T) > 4)
+        *out++ = '"';
+    int n = fpconv_dtoa(value, out);
+    if (n < 0) {
+        memcpy(out, "NaN", 3);
+        out += 3;
+    } else if (n == 0) {
+        memcpy(out, "ZERO", 4);
+        out += 4;
+    } else
+        out += n;
+    if (sizeof(T) > 4)
+        *out++ = '"';
+    w.commit(out);
+}
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, uint8_t value) { int_to_json(w, value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, uint16_t value) { int_to_json(w, value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, uint32_t value) { int_to_json(w, value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, uint64_t value) { int_to_json(w, value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, unsigned_int value) { int_to_json(w, value.value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, int8_t value) { int_to_json(w, value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, int16_t value) { int_to_json(w, value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, int32_t value) { int_to_json(w, value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, int64_t value) { int_to_json(w, value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, signed_int value) { int_to_json(w, value.value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, double value) { fp_to_json(w, value); }
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, float value) { fp_to_json(w, value); }
+
+/// \group write_json_explicit
+__attribute__((noinline)) inline void write_json(json_writer& w, name value) {
+    char* out = w.prepare(15);
+    *out++    = '"';
+    out       = value.write_as_string(out, out + 13);
+    *out++    = '"';
+    w.commit(out);
+}
+
+/// \group write_json_explicit
+__attribute__((noinline)) inline void write_json(json_writer& w, symbol_code value) {
+    char* out = w.prepare(10);
+    *out++    = '"';
+    out       = value.write_as_string(out, out + 8);
+    *out++    = '"';
+    w.commit(out);
+}
+
+/// \group write_json_explicit
+__attribute__((noinline)) inline void write_json(json_writer& w, asset value) {
+    w.write('"');
+    w.write(value.to_string());
+    w.write('"');
+}
+
+/// \group write_json_explicit
+__attribute__((noinline)) inline void write_json(json_writer& w, extended_asset value) {
+    w.write("{\"contract\":");
+    write_json(w, value.contract);
+    w.write(",\"symbol\":");
+    write_json(w, value.quantity.symbol.code());
+    w.write(",\"precision\":");
+    write_json(w, value.quantity.symbol.precision());
+    w.write(",\"amount\":");
+    write_json(w, value.quantity.amount);
+    w.write('}');
+}
+
+/// \exclude
+inline char* write_hex(char* out, const unsigned char* begin, const unsigned char* end) {
+    using namespace internal_use_do_not_use;
+    *out++ = '"';
+    for (; begin != end; ++begin) {
+        *out++ = hex_digits[*begin >> 4];
+        *out++ = hex_digits[*begin & 15];
+    }
+    *out++ = '"';
+    return out;
+}
+
+/// \group write_json_explicit
+__attribute__((noinline)) inline void write_json(json_writer& w, const checksum256& value) {
+    auto bytes = value.extract_as_byte_array();
+    w.commit(write_hex(w.prepare(66), bytes.data(), bytes.data() + bytes.size()));
+}
+
+/// \exclude
+inline char* write_fixed_size(char* out, uint32_t value, unsigned digits) {
+    for (char* pos = out + digits; pos != out; value /= 10)
+        *--pos = '0' + (value % 10);
+    return out + digits;
+}
+
+/// \group write_json_explicit
+__attribute__((noinline)) inline void write_json(json_writer& w, time_point value) {
+    std::chrono::microseconds us{value.elapsed.count()};
+    date::sys_days            sd(std::chrono::floor<date::days>(us));
+    auto                      ymd = date::year_month_day{sd};
+    uint32_t                  ms  = (std::chrono::round<std::chrono::milliseconds>(us) - sd.time_since_epoch()).count();
+    char*                     out = w.prepare(25);
+    *out++                        = '"';
+    out                           = write_fixed_size(out, (uint32_t)(int)ymd.year(), 4);
+    *out++                        = '-';
+    out                           = write_fixed_size(out, (uint32_t)(unsigned)ymd.month(), 2);
+    *out++                        = '-';
+    out                           = write_fixed_size(out, (uint32_t)(unsigned)ymd.day(), 2);
+    *out++                        = 'T';
+    out                           = write_fixed_size(out, ms / 3600000 % 60, 2);
+    *out++                        = ':';
+    out                           = write_fixed_size(out, ms / 60000 % 60, 2);
+    *out++                        = ':';
+    out                           = write_fixed_size(out, ms / 1000 % 60, 2);
+    *out++                        = '.';
+    out                           = write_fixed_size(out, ms % 1000, 3);
+    *out++                        = '"';
+    w.commit(out);
+}
+
+/// \group write_json_explicit
+inline void write_json(json_writer& w, block_timestamp value) { write_json(w, value.to_time_point()); }
+
+/// \group write_json_explicit
+__attribute__((noinline)) inline void write_json(json_writer& w, const shared_memory<datastream<const char*>>& value) {
+    auto pos = (const unsigned char*)value->pos();
+    w.commit(write_hex(w.prepare(value->remaining() * 2 + 2), pos, pos + value->remaining()));
+}
+
+/// \group write_json_explicit
+template <typename T>
+__attribute__((noinline)) inline void write_json(json_writer& w, const std::optional<T>& obj) {
     if (obj)
-        return to_json(*obj);
+        write_json(w, *obj);
     else
-        return "null";
+        w.write("null");
 }
 
-/// \group to_json_explicit
+/// \group write_json_explicit
 template <typename T>
-__attribute__((noinline)) inline rope to_json(const std::vector<T>& obj) {
-    rope result = "[";
-    bool first  = true;
+__attribute__((noinline)) inline void write_json(json_writer& w, const std::vector<T>& obj) {
+    w.write('[');
+    bool first = true;
     for (auto& v : obj) {
         if (!first)
-            result += ",";
+            w.write(',');
         first = false;
-        result += to_json(v);
+        write_json(w, v);
+    }
+    w.write(']');
+}
+
+/// \group write_json_explicit
+__attribute__((noinline)) inline void write_json(json_writer& w, const std::vector<char>& obj) {
+    auto pos = (const unsigned char*)obj.data();
+    w.commit(write_hex(w.prepare(obj.size() * 2 + 2), pos, pos + obj.size()));
+}
+
+/// \group write_json_explicit
+template <tagged_variant_options Options, typename... NamedTypes>
+__attribute__((noinline)) inline void write_json(json_writer& w, const tagged_variant<Options, NamedTypes...>& v) {
+    w.write('[');
+    write_json(w, tagged_variant<Options, NamedTypes...>::keys[v.value.index()]);
+    std::visit(
+        [&](auto& x) {
+            if constexpr (!is_named_empty_type_v<std::decay_t<decltype(x)>>) {
+                w.write(',');
+                write_json(w, x);
+            }
+        },
+        v.value);
+    w.write(']');
+}
+
+/// \output_section Write reflected objects to a json_writer
+/// Append an object's JSON to a `json_writer`. This overload works with
+/// [reflected objects](standardese://reflection/). Types which aren't reflected
+/// fall back to their `to_json` overload.
+template <typename T>
+__attribute__((noinline)) inline void write_json(json_writer& w, const T& obj) {
+    if constexpr (has_for_each_member<T>::value) {
+        w.write('{');
+        bool first = true;
+        for_each_member((T*)nullptr, [&](std::string_view member_name, auto member) {
+            if (!first)
+                w.write(',');
+            first = false;
+            write_json(w, member_name);
+            w.write(':');
+            write_json(w, member_from_void(member, &obj));
+        });
+        w.write('}');
+    } else {
+        w.write(to_json(obj).sv());
     }
-    result += "]";
-    return result;
+}
+
+/// \group to_json_explicit
+template <typename T>
+__attribute__((noinline)) inline rope to_json(const std::optional<T>& obj) {
+    json_writer w;
+    write_json(w, obj);
+    return w.release();
+}
+
+/// \group to_json_explicit
+template <typename T>
+__attribute__((noinline)) inline rope to_json(const std::vector<T>& obj) {
+    json_writer w;
+    write_json(w, obj);
+    return w.release();
 }
 
 /// \group to_json_explicit
 __attribute__((noinline)) inline rope to_json(const std::vector<char>& obj) {
-    using namespace internal_use_do_not_use;
-    rope_buffer b(obj.size() * 2 + 2);
-    *b.pos++ = '"';
-    for (unsigned char byte : obj) {
-        *b.pos++ = hex_digits[byte >> 4];
-        *b.pos++ = hex_digits[byte & 15];
-    }
-    *b.pos++ = '"';
-    return b;
+    json_writer w;
+    write_json(w, obj);
+    return w.release();
 }
 
 /// \output_section Convert reflected objects to JSON
@@ -353,35 +736,18 @@ __attribute__((noinline)) inline rope to_json(const std::vector<char>& obj) {
 /// [reflected objects](standardese://reflection/).
 template <typename T>
 __attribute__((noinline)) inline rope to_json(const T& obj) {
-    rope result = "{";
-    bool first  = true;
-    for_each_member((T*)nullptr, [&](std::string_view member_name, auto member) {
-        if (!first)
-            result += ",";
-        first = false;
-        result += to_json(member_name);
-        result += ":";
-        result += to_json(member_from_void(member, &obj));
-    });
-    result += "}";
-    return result;
+    static_assert(has_for_each_member<T>::value, "to_json: type isn't reflected and has no to_json overload");
+    json_writer w;
+    write_json(w, obj);
+    return w.release();
 }
 
 /// \group to_json_explicit
 template <tagged_variant_options Options, typename... NamedTypes>
 __attribute__((noinline)) inline rope to_json(const tagged_variant<Options, NamedTypes...>& v) {
-    rope result = "[";
-    result += to_json(tagged_variant<Options, NamedTypes...>::keys[v.value.index()]);
-    std::visit(
-        [&](auto& x) {
-            if constexpr (!is_named_empty_type_v<std::decay_t<decltype(x)>>) {
-                result += ",";
-                result += to_json(x);
-            }
-        },
-        v.value);
-    result += "]";
-    return result;
+    json_writer w;
+    write_json(w, v);
+    return w.release();
 }
 
 } // namespace eosio
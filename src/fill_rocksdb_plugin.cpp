@@ -44,14 +44,17 @@ struct rocksdb_table {
     const abieos::abi_type*                     abi_type  = {};
     std::vector<std::unique_ptr<rocksdb_field>> fields    = {};
     std::map<std::string, rocksdb_field*>       field_map = {};
+    size_t                                      key_size  = 0; // capacity to reserve for this table's keys
 };
 
 struct fill_rocksdb_config : connection_config {
-    uint32_t                skip_to      = 0;
-    uint32_t                stop_before  = 0;
-    std::vector<trx_filter> trx_filters  = {};
-    bool                    enable_trim  = false;
-    bool                    enable_check = false;
+    uint32_t                skip_to       = 0;
+    uint32_t                stop_before   = 0;
+    std::vector<trx_filter> trx_filters   = {};
+    bool                    enable_trim   = false;
+    bool                    enable_check  = false;
+    unsigned                check_threads = 0;
+    uint32_t                bulk_blocks   = 0;
 };
 
 struct fill_rocksdb_plugin_impl : std::enable_shared_from_this<fill_rocksdb_plugin_impl> {
@@ -91,6 +94,20 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
     uint32_t                                   irreversible       = 0;
     abieos::checksum256                        irreversible_id    = {};
     uint32_t                                   first              = 0;
+    bool                                       bulk_active        = false;
+    uint32_t                                   bulk_first         = 0;
+    rdb::bulk_ingester                         bulk;
+
+    // Scratch space for add_row(), remove_row() and trim(). Reused so the write path doesn't allocate
+    // once the buffers reach the sizes the key schema needs.
+    std::vector<std::optional<uint32_t>> positions;
+    std::vector<char>                    key;
+    std::vector<char>                    index_key;
+    std::vector<char>                    journal;
+    std::vector<char>                    journal_key;
+
+    // Number of keys per MultiGet in check()
+    static constexpr size_t multi_get_batch = 256;
 
     flm_session(fill_rocksdb_plugin_impl* my)
         : my(my)
@@ -110,78 +127,229 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
             return;
         }
         ilog("first: ${first}, irreversible: ${irreversible}, head: ${head}", ("first", first)("irreversible", irreversible)("head", head));
+        auto num_threads = config->check_threads ? config->check_threads : std::max(1u, std::thread::hardware_concurrency());
+        ilog("checking with ${t} threads", ("t", num_threads));
+        check_received_blocks(num_threads);
+        check_index_entries(num_threads);
+        ilog("database appears ok");
+    }
 
-        ilog("verifying expected records are present");
-        uint32_t expected = first;
+    // Runs f(i) for each i in [0, n) on num_threads threads. If any throw, stops starting new ones
+    // and rethrows the error of the lowest i.
+    template <typename F>
+    static void parallel_for(size_t n, unsigned num_threads, F f) {
+        std::atomic<size_t>      next   = 0;
+        std::atomic<bool>        failed = false;
+        std::vector<std::string> errors(n);
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < std::min<size_t>(num_threads, n); ++t) {
+            threads.emplace_back([&] {
+                for (size_t i; !failed && (i = next++) < n;) {
+                    try {
+                        f(i);
+                    } catch (std::exception& e) {
+                        errors[i] = e.what();
+                        failed    = true;
+                    }
+                }
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+        for (auto& e : errors)
+            if (!e.empty())
+                throw std::runtime_error(e);
+    }
 
-        for_each_subkey(rocksdb_inst->database, kv::make_table_key(0), kv::make_table_key(0xffff'ffff), [&](auto&, auto k, auto) {
-            auto orig_k = k;
-            if (kv::bin_to_key_tag(k) != kv::key_tag::table)
-                throw std::runtime_error("This shouldn't happen (1)");
-            auto block_num = kv::key_to_native<uint32_t>(k);
+    // Every block in [first, head], and no other, has a received_block record. Shards cover
+    // contiguous block ranges; the ones outside [first, head] must be empty.
+    void check_received_blocks(unsigned num_threads) {
+        ilog("verifying expected records are present");
+        struct shard {
+            uint32_t begin = 0; // inclusive
+            uint32_t end   = 0; // inclusive
+        };
+        std::vector<shard> shards;
+        if (first)
+            shards.push_back({0, first - 1});
+        uint64_t num_blocks = head >= first ? uint64_t(head) - first + 1 : 0;
+        uint64_t num_shards = std::max<uint64_t>(1, std::min<uint64_t>(num_threads * 4, num_blocks / 10'000));
+        for (uint64_t i = 0; i < num_shards && num_blocks; ++i)
+            shards.push_back({uint32_t(first + num_blocks * i / num_shards), uint32_t(first + num_blocks * (i + 1) / num_shards - 1)});
+        if (head != 0xffff'ffff)
+            shards.push_back({head + 1, 0xffff'ffff});
+
+        parallel_for(shards.size(), num_threads, [&](size_t i) {
+            auto&    shard    = shards[i];
+            uint32_t expected = std::max(shard.begin, first);
             for_each_subkey(
-                rocksdb_inst->database, kv::make_table_key(block_num, false, "recvd.block"_n),
-                kv::make_table_key(block_num, true, "recvd.block"_n), [&](auto&, auto k, auto) {
-                    if (block_num != 0 && (block_num < first || block_num > head))
-                        throw std::runtime_error(
-                            "Saw row for block_num " + std::to_string(block_num) +
-                            ", which is out of range [first, head]. key: " + kv::key_to_string(orig_k));
-                    if (block_num == first || block_num == head || !(block_num % 10'000))
-                        ilog("found received_block ${b}", ("b", block_num));
-                    if (block_num != expected)
-                        throw std::runtime_error(
-                            "Saw received_block record " + std::to_string(block_num) + " but expected " + std::to_string(expected));
-                    ++expected;
+                rocksdb_inst->database, kv::make_table_key(shard.begin), kv::make_table_key(shard.end), [&](auto&, auto k, auto) {
+                    auto orig_k = k;
+                    if (kv::bin_to_key_tag(k) != kv::key_tag::table)
+                        throw std::runtime_error("This shouldn't happen (1)");
+                    auto block_num = kv::key_to_native<uint32_t>(k);
+                    for_each_subkey(
+                        rocksdb_inst->database, kv::make_table_key(block_num, false, "recvd.block"_n),
+                        kv::make_table_key(block_num, true, "recvd.block"_n), [&](auto&, auto k, auto) {
+                            if (block_num != 0 && (block_num < first || block_num > head))
+                                throw std::runtime_error(
+                                    "Saw row for block_num " + std::to_string(block_num) +
+                                    ", which is out of range [first, head]. key: " + kv::key_to_string(orig_k));
+                            if (block_num == first || block_num == head || !(block_num % 10'000))
+                                ilog("found received_block ${b}", ("b", block_num));
+                            if (block_num != expected)
+                                throw std::runtime_error(
+                                    "Saw received_block record " + std::to_string(block_num) + " but expected " +
+                                    std::to_string(expected));
+                            ++expected;
+                            return true;
+                        });
                     return true;
                 });
-            return true;
+            if (shard.begin > head || shard.end < first)
+                return;
+            if (shard.end >= head && expected - 1 != head)
+                throw std::runtime_error("Found head " + std::to_string(expected - 1) + " but fill_status.head = " + std::to_string(head));
+            if (expected - 1 != shard.end)
+                throw std::runtime_error("Missing received_block records " + std::to_string(expected) + " - " + std::to_string(shard.end));
         });
-        ilog("found received_block ${b}", ("b", expected - 1));
-        if (expected - 1 != head)
-            throw std::runtime_error("Found head " + std::to_string(expected - 1) + " but fill_status.head = " + std::to_string(head));
+        ilog("found received_block ${b}", ("b", head));
+    }
 
+    // Every index entry references an existing row. Shards split each index family at SST file
+    // boundaries; each looks up the referenced rows with batched MultiGets.
+    void check_index_entries(unsigned num_threads) {
         ilog("verifying index entries reference existing records");
-        uint64_t     num_ti_keys = 0;
-        abieos::name last_table, last_index;
-        uint64_t     last_num_keys = 0;
-        for_each(rocksdb_inst->database, kv::make_index_key(), kv::make_index_key(), [&](auto k, auto v) {
-            abieos::name table, index;
-            auto         kk = k;
-            kv::key_to_native<uint8_t>(kk);
-            kv::read_index_prefix(kk, table, index);
-            if (table != last_table || index != last_index) {
-                if (last_table.value)
-                    ilog(
-                        "table '${t}' index '${i}' has ${e} entries",
-                        ("t", (std::string)last_table)("i", (std::string)last_index)("e", last_num_keys));
-                last_table    = table;
-                last_index    = index;
-                last_num_keys = 0;
-                ilog("table '${t}' index '${i}'", ("t", (std::string)last_table)("i", (std::string)last_index));
+        auto& db = rocksdb_inst->database;
+
+        // Number of entries per table and index, in key order
+        struct index_count {
+            abieos::name table;
+            abieos::name index;
+            uint64_t     num_entries = 0;
+        };
+        struct shard {
+            rocksdb::ColumnFamilyHandle* family = nullptr;
+            std::string                  lower  = {};
+            std::string                  upper  = {};
+            std::vector<index_count>     counts = {};
+        };
+
+        auto     families    = db.column_families(kv::key_tag::index);
+        uint64_t total_bytes = 0;
+        for (auto* family : families) {
+            uint64_t bytes = 0;
+            db.db->GetIntProperty(family, "rocksdb.total-sst-files-size", &bytes);
+            total_bytes += bytes;
+        }
+        auto               index_begin = kv::make_index_key();
+        std::string        lower{index_begin.begin(), index_begin.end()};
+        std::string        upper{char(uint8_t(kv::key_tag::index) + 1)};
+        std::vector<shard> shards;
+        for (auto* family : families) {
+            shards.push_back({family, lower, upper});
+            for (auto& point : rdb::split_points(db, family, total_bytes / (num_threads * 4))) {
+                if (point <= shards.back().lower || point >= upper)
+                    continue;
+                shards.back().upper = point;
+                shards.push_back({family, point, upper});
             }
+        }
 
-            ++last_num_keys;
-            if (!((++num_ti_keys) % 1'000'000))
-                ilog("found ${n} index entries so far, ${i} for this index", ("n", num_ti_keys)("i", last_num_keys));
-
-            auto& c        = *rocksdb_inst->query_config;
-            auto  index_it = c.index_name_map.find(index);
-            if (index_it == c.index_name_map.end())
-                throw std::runtime_error("found unknown index '" + (std::string)index + "'");
-            auto& index_obj = *index_it->second;
-            if (index_obj.table_obj->short_name != table)
-                throw std::runtime_error("index '" + (std::string)index + "' is not for table '" + (std::string)table + "'");
-
-            auto pk = extract_pk_from_index(k, *index_obj.table_obj, index_obj.sort_keys);
-            if (!rdb::exists(rocksdb_inst->database, rdb::to_slice(pk)))
-                throw std::runtime_error(
-                    "index '" + (std::string)index + "' references a missing entry in table '" + (std::string)table + "'");
-            return true;
+        std::atomic<uint64_t> num_ti_keys = 0;
+        parallel_for(shards.size(), num_threads, [&](size_t i) {
+            auto&                shard = shards[i];
+            rocksdb::Slice       upper_bound{shard.upper};
+            rocksdb::ReadOptions options = rdb::total_order_options();
+            options.iterate_upper_bound  = &upper_bound;
+            std::unique_ptr<rocksdb::Iterator> it{db.db->NewIterator(options, shard.family)};
+
+            // Referenced rows waiting for a MultiGet; they're all in rows_family
+            std::vector<char>                    pks;
+            std::vector<size_t>                  pk_ends;
+            std::vector<const kv::index*>        pk_indexes;
+            rocksdb::ColumnFamilyHandle*         rows_family = nullptr;
+            std::vector<std::optional<uint32_t>> positions;
+            std::vector<rocksdb::Slice>          slices;
+            auto                                 check_rows = [&] {
+                slices.clear();
+                for (size_t j = 0; j < pk_ends.size(); ++j) {
+                    auto begin = j ? pk_ends[j - 1] : 0;
+                    slices.emplace_back(pks.data() + begin, pk_ends[j] - begin);
+                }
+                std::vector<rocksdb::PinnableSlice> values(slices.size());
+                std::vector<rocksdb::Status>        statuses(slices.size());
+                db.db->MultiGet(rocksdb::ReadOptions(), rows_family, slices.size(), slices.data(), values.data(), statuses.data());
+                for (size_t j = 0; j < slices.size(); ++j) {
+                    // Compaction drops trimmed rows and their index entries independently
+                    if (statuses[j].IsNotFound() && !db.trim.drops(slices[j], first))
+                        throw std::runtime_error(
+                            "index '" + (std::string)pk_indexes[j]->short_name + "' references a missing entry in table '" +
+                            (std::string)pk_indexes[j]->table_obj->short_name + "'");
+                    if (!statuses[j].IsNotFound())
+                        rdb::check(statuses[j], "check: MultiGet: ");
+                }
+                pks.clear();
+                pk_ends.clear();
+                pk_indexes.clear();
+            };
+
+            uint64_t num_shard_keys = 0;
+            for (it->Seek(shard.lower); it->Valid(); it->Next()) {
+                auto         k = rdb::to_input_buffer(it->key());
+                abieos::name table, index;
+                auto         kk = k;
+                kv::key_to_native<uint8_t>(kk);
+                kv::read_index_prefix(kk, table, index);
+                if (shard.counts.empty() || shard.counts.back().table != table || shard.counts.back().index != index)
+                    shard.counts.push_back({table, index});
+                ++shard.counts.back().num_entries;
+                if (!((++num_shard_keys) % 1'000'000))
+                    ilog(
+                        "check shard ${s}/${n}: ${k} index entries so far, ${t} in all shards",
+                        ("s", i + 1)("n", shards.size())("k", num_shard_keys)("t", num_ti_keys + num_shard_keys));
+
+                auto& c        = *rocksdb_inst->query_config;
+                auto  index_it = c.index_name_map.find(index);
+                if (index_it == c.index_name_map.end())
+                    throw std::runtime_error("found unknown index '" + (std::string)index + "'");
+                auto& index_obj = *index_it->second;
+                if (index_obj.table_obj->short_name != table)
+                    throw std::runtime_error("index '" + (std::string)index + "' is not for table '" + (std::string)table + "'");
+
+                auto size = pks.size();
+                kv::extract_pk_from_index(pks, k, *index_obj.table_obj, index_obj.sort_keys, positions);
+                auto* family = db.column_family(rocksdb::Slice{pks.data() + size, pks.size() - size});
+                if (family != rows_family && !pk_ends.empty()) {
+                    std::vector<char> pk{pks.begin() + size, pks.end()};
+                    pks.resize(size);
+                    check_rows();
+                    pks = std::move(pk);
+                }
+                rows_family = family;
+                pk_ends.push_back(pks.size());
+                pk_indexes.push_back(&index_obj);
+                if (pk_ends.size() >= multi_get_batch)
+                    check_rows();
+            }
+            rdb::check(it->status(), "check: ");
+            if (!pk_ends.empty())
+                check_rows();
+            num_ti_keys += num_shard_keys;
+            ilog("check shard ${s}/${n}: ${k} index entries ok", ("s", i + 1)("n", shards.size())("k", num_shard_keys));
         });
-        ilog(
-            "table '${t}' index '${i}' has ${e} entries", ("t", (std::string)last_table)("i", (std::string)last_index)("e", last_num_keys));
-        ilog("checked ${n} index entries", ("n", num_ti_keys));
-        ilog("database appears ok");
+
+        // Shards may split an index; merge its counts
+        std::vector<index_count> counts;
+        for (auto& shard : shards)
+            for (auto& c : shard.counts)
+                if (!counts.empty() && counts.back().table == c.table && counts.back().index == c.index)
+                    counts.back().num_entries += c.num_entries;
+                else
+                    counts.push_back(c);
+        for (auto& c : counts)
+            ilog("table '${t}' index '${i}' has ${e} entries", ("t", (std::string)c.table)("i", (std::string)c.index)("e", c.num_entries));
+        ilog("checked ${n} index entries", ("n", num_ti_keys.load()));
     }
 
     void fill_fields(rocksdb_table& table, const std::string& base_name, const abieos::abi_field& abi_field) {
@@ -265,6 +433,7 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         table.name     = table_name;
         table.kv_table = &get_kv_table(table_name);
         table.abi_type = &get_type(table_type);
+        table.key_size = kv::max_key_size(*table.kv_table);
 
         if (!table.abi_type->filled_variant || table.abi_type->fields.size() != 1 || !table.abi_type->fields[0].type->filled_struct)
             throw std::runtime_error("don't know how to process " + table.abi_type->name);
@@ -287,6 +456,7 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         block_info_table           = &tables["block_info"];
         block_info_table->name     = "block_info";
         block_info_table->kv_table = &get_kv_table("block_info");
+        block_info_table->key_size = kv::max_key_size(*block_info_table->kv_table);
         fill_fields(*block_info_table, "", abieos::abi_field{"block_num", &get_type("uint32")});
         fill_fields(*block_info_table, "", abieos::abi_field{"block_id", &get_type("checksum256")});
         fill_fields(*block_info_table, "", abieos::abi_field{"timestamp", &get_type("block_timestamp_type")});
@@ -300,6 +470,7 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         action_trace_table           = &tables["action_trace"];
         action_trace_table->name     = "action_trace";
         action_trace_table->kv_table = &get_kv_table("action_trace");
+        action_trace_table->key_size = kv::max_key_size(*action_trace_table->kv_table);
         fill_fields(*action_trace_table, "", abieos::abi_field{"block_num", &get_type("uint32")});
         fill_fields(*action_trace_table, "", abieos::abi_field{"transaction_id", &get_type("checksum256")});
         fill_fields(*action_trace_table, "", abieos::abi_field{"transaction_status", &get_type("uint8")});
@@ -330,6 +501,9 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         init_tables(abi);
 
         load_fill_status();
+        check_layout();
+        if (config->enable_trim)
+            rocksdb_inst->database.trim.watermark = first;
         ilog("clean up stale records");
         end_write(true);
         truncate(head + 1);
@@ -360,6 +534,18 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         first           = current_db_status->first;
     }
 
+    // truncate() and trim() rely on index_journal, which older versions didn't write
+    void check_layout() {
+        auto version = rdb::get<uint32_t>(rocksdb_inst->database, kv::make_layout_key(), false);
+        if (version && *version == kv::layout_version)
+            return;
+        if (version || current_db_status)
+            throw std::runtime_error("database was filled by an incompatible version of fill-rocksdb; it needs to be refilled");
+        rocksdb::WriteBatch batch;
+        rdb::put(rocksdb_inst->database, batch, kv::make_layout_key(), kv::layout_version);
+        write(rocksdb_inst->database, batch);
+    }
+
     std::vector<block_position> get_positions() {
         std::vector<block_position> result;
         if (head) {
@@ -378,7 +564,7 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         else
             current_db_status = state_history::fill_status{
                 .head = head, .head_id = head_id, .irreversible = head, .irreversible_id = head_id, .first = first};
-        rdb::put(batch, kv::make_fill_status_key(), *current_db_status, true);
+        rdb::put(rocksdb_inst->database, batch, kv::make_fill_status_key(), *current_db_status, true);
     }
 
     void truncate(uint32_t block) {
@@ -386,10 +572,16 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         rocksdb::WriteBatch content_batch, index_batch;
         uint64_t            num_rows    = 0;
         uint64_t            num_indexes = 0;
-        for_each(rocksdb_inst->database, kv::make_table_key(block), kv::make_table_key(), [&](auto k, auto v) {
-            remove_row(content_batch, index_batch, k, v, &num_rows, &num_indexes);
+        for_each(rocksdb_inst->database, kv::make_index_journal_key(block), kv::make_index_journal_key(), [&](auto, auto v) {
+            kv::for_each_journaled_index(v, [&](auto index_key) {
+                rdb::erase(rocksdb_inst->database, index_batch, index_key);
+                ++num_indexes;
+            });
+            ++num_rows;
             return true;
         });
+        rdb::delete_range(rocksdb_inst->database, content_batch, kv::make_table_key(block), kv::make_table_key());
+        rdb::delete_range(rocksdb_inst->database, content_batch, kv::make_index_journal_key(block), kv::make_index_journal_key());
 
         auto rb = rdb::get<kv::received_block>(rocksdb_inst->database, kv::make_received_block_key(block - 1), false);
         if (!rb) {
@@ -411,6 +603,16 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
     }
 
     void end_write(bool write_fill) {
+        if (bulk_active) {
+            if (write_fill && head + 1 - bulk_first >= config->bulk_blocks)
+                ingest_bulk();
+            else {
+                bulk.add(active_content_batch);
+                bulk.add(active_index_batch);
+            }
+            return;
+        }
+
         if (write_fill)
             write_fill_status(active_index_batch);
 
@@ -419,11 +621,46 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         write(rocksdb_inst->database, active_index_batch);
     }
 
+    // Blocks well below irreversible can't be undone by a fork, so they go through SST ingestion
+    // instead of the memtables. Everything collected so far is committed when switching.
+    void set_bulk(bool enable) {
+        if (enable == bulk_active)
+            return;
+        if (bulk_active)
+            ingest_bulk();
+        else
+            end_write(true);
+        bulk_active = enable;
+        bulk_first  = head + 1;
+        if (enable)
+            ilog("bulk ingestion starts at block ${b}", ("b", head + 1));
+        else
+            ilog("bulk ingestion stops at block ${b}", ("b", head + 1));
+    }
+
+    void ingest_bulk() {
+        bulk.add(active_content_batch);
+        bulk.add(active_index_batch);
+        if (!bulk.empty()) {
+            ilog(
+                "ingest blocks ${b} - ${e}: ${n} keys, ${m} MiB",
+                ("b", bulk_first)("e", head)("n", bulk.size)("m", bulk.bytes >> 20));
+            auto dir = rocksdb_inst->database.db->GetName() + ".ingest";
+            bulk.ingest(rocksdb_inst->database, dir, std::max(1u, std::thread::hardware_concurrency()));
+        }
+        // fill_status only moves once the ingested files are in place
+        rocksdb::WriteBatch batch;
+        write_fill_status(batch);
+        write(rocksdb_inst->database, batch);
+        bulk_first = head + 1;
+    }
+
     bool received(get_blocks_result_v0& result) override {
         if (!result.this_block)
             return true;
         if (config->stop_before && result.this_block->block_num >= config->stop_before) {
             ilog("block ${b}: stop requested", ("b", result.this_block->block_num));
+            set_bulk(false);
             end_write(true);
             rocksdb_inst->database.flush(false, false);
             return false;
@@ -450,6 +687,7 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         try {
             if (result.this_block->block_num <= head) {
                 ilog("switch forks at block ${b}", ("b", result.this_block->block_num));
+                set_bulk(false);
                 end_write(true);
                 truncate(result.this_block->block_num);
                 end_write(true);
@@ -460,6 +698,8 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
             if (commit_now)
                 ilog("block ${b}", ("b", result.this_block->block_num));
 
+            set_bulk(config->bulk_blocks && result.this_block->block_num + config->bulk_blocks < result.last_irreversible.block_num);
+
             if (head_id != abieos::checksum256{} && (!result.prev_block || result.prev_block->block_id != head_id))
                 throw std::runtime_error("prev_block does not match");
             if (result.block)
@@ -478,12 +718,12 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
                 first = head;
 
             rdb::put(
-                active_content_batch, kv::make_received_block_key(result.this_block->block_num),
+                rocksdb_inst->database, active_content_batch, kv::make_received_block_key(result.this_block->block_num),
                 kv::received_block{result.this_block->block_num, result.this_block->block_id});
 
             if (commit_now) {
                 end_write(true);
-                if (config->enable_trim)
+                if (config->enable_trim && bulk.empty())
                     trim();
             }
             if (near)
@@ -532,66 +772,53 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
     void add_row(
         rocksdb::WriteBatch& content_batch, rocksdb::WriteBatch& index_batch, rocksdb_table& table, uint32_t block_num, bool present_k,
         const std::vector<char>& value) {
-        std::vector<std::optional<uint32_t>> positions;
         kv::init_positions(positions, table.kv_table->fields.size());
         kv::fill_positions({value.data(), value.data() + value.size()}, table.kv_table->fields, positions);
 
-        std::vector<char> key;
+        key.clear();
+        key.reserve(table.key_size);
         kv::append_table_key(key, block_num, present_k, table.kv_table->short_name);
         kv::extract_keys(key, {value.data(), value.data() + value.size()}, table.kv_table->keys, positions);
-        rdb::put(content_batch, key, value);
+        rdb::put(rocksdb_inst->database, content_batch, key, value);
 
-        std::vector<char> index_key;
+        index_key.reserve(table.key_size);
+        journal.clear();
         for (auto* index : table.kv_table->indexes) {
             index_key.clear();
             kv::append_index_key(index_key, table.kv_table->short_name, index->short_name);
             kv::extract_keys(index_key, {value.data(), value.data() + value.size()}, index->sort_keys, positions);
             kv::append_index_suffix(index_key, block_num, present_k);
-            index_batch.Put(rdb::to_slice(index_key), {});
+            index_batch.Put(rocksdb_inst->database.column_family(index_key), rdb::to_slice(index_key), {});
+            kv::append_journaled_index(journal, index_key);
         }
+
+        // content_batch is written first, so the journal is present before any of its index entries
+        kv::with_key_tag(journal_key, {key.data(), key.data() + key.size()}, kv::key_tag::index_journal);
+        rdb::put(rocksdb_inst->database, content_batch, journal_key, journal);
     }
 
+    // Remove a row, its index entries, and its index_journal entry
     void remove_row(
-        rocksdb::WriteBatch& content_batch, rocksdb::WriteBatch& index_batch, abieos::input_buffer k, abieos::input_buffer v,
-        uint64_t* num_rows = nullptr, uint64_t* num_indexes = nullptr) {
-        uint32_t     block_num;
-        abieos::name table_name;
-        bool         present_k;
-        auto         temp_k = k;
-        kv::key_to_native<uint8_t>(temp_k);
-        kv::read_table_prefix(temp_k, block_num, table_name, present_k);
-
-        auto& table = get_kv_table(table_name);
-
-        std::vector<std::optional<uint32_t>> positions;
-        kv::init_positions(positions, table.fields.size());
-        kv::fill_positions(v, table.fields, positions);
-
-        std::vector<char> index_key;
-        for (auto* index : table.indexes) {
-            index_key.clear();
-            kv::append_index_key(index_key, table_name, index->short_name);
-            kv::extract_keys(index_key, v, index->sort_keys, positions);
-            kv::append_index_suffix(index_key, block_num, present_k);
-            index_batch.Delete(rdb::to_slice(index_key));
-            if (num_indexes)
-                ++*num_indexes;
-        }
-
-        content_batch.Delete(rdb::to_slice(k));
-        if (num_rows)
-            ++*num_rows;
+        rocksdb::WriteBatch& batch, abieos::input_buffer journal_key, abieos::input_buffer journal, uint64_t& num_rows,
+        uint64_t& num_indexes) {
+        kv::for_each_journaled_index(journal, [&](auto index_key) {
+            rdb::erase(rocksdb_inst->database, batch, index_key);
+            ++num_indexes;
+        });
+        kv::with_key_tag(key, journal_key, kv::key_tag::table);
+        rdb::erase(rocksdb_inst->database, batch, key);
+        rdb::erase(rocksdb_inst->database, batch, journal_key);
+        ++num_rows;
     }
 
-    void remove_row(
-        rocksdb::WriteBatch& content_batch, rocksdb::WriteBatch& index_batch, abieos::input_buffer k, uint64_t* num_rows = nullptr,
-        uint64_t* num_indexes = nullptr) {
-
-        rocksdb::PinnableSlice v;
-        auto*                  db   = rocksdb_inst->database.db.get();
-        auto                   stat = db->Get(rocksdb::ReadOptions(), db->DefaultColumnFamily(), rdb::to_slice(k), &v);
-        rdb::check(stat, "get: ");
-        remove_row(content_batch, index_batch, k, rdb::to_input_buffer(v), num_rows, num_indexes);
+    void remove_row(rocksdb::WriteBatch& batch, const std::vector<char>& table_key, uint64_t& num_rows, uint64_t& num_indexes) {
+        kv::with_key_tag(journal_key, {table_key.data(), table_key.data() + table_key.size()}, kv::key_tag::index_journal);
+
+        abieos::input_buffer   k{journal_key.data(), journal_key.data() + journal_key.size()};
+        rocksdb::PinnableSlice value;
+        auto&                  db = rocksdb_inst->database;
+        rdb::check(db.db->Get(rocksdb::ReadOptions(), db.journal_family, rdb::to_slice(k), &value), "get: ");
+        remove_row(batch, k, rdb::to_input_buffer(value), num_rows, num_indexes);
     }
 
     void receive_block(
@@ -744,6 +971,11 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         if (first >= end_trim)
             return;
         rocksdb_inst->database.flush(true, true);
+
+        // The flush made the last trim's fill_status durable, so compaction may now drop history-only
+        // rows before its first. Doing it any sooner could leave a gap after a crash.
+        rocksdb_inst->database.trim.watermark = first;
+
         rocksdb::WriteBatch batch;
         ilog("trim: ${b} - ${e}", ("b", first)("e", end_trim));
 
@@ -751,8 +983,8 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         uint64_t                    num_indexes = 0;
         std::set<std::vector<char>> trim_keys;
 
-        auto lower_bound = kv::make_table_key(first);
-        auto upper_bound = kv::make_table_key(end_trim);
+        auto lower_bound = kv::make_index_journal_key(first);
+        auto upper_bound = kv::make_index_journal_key(end_trim);
         rdb::for_each(rocksdb_inst->database, lower_bound, upper_bound, [&](auto k, auto v) {
             uint32_t     block_num;
             abieos::name table_name;
@@ -763,16 +995,13 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
 
             auto& table = get_kv_table(table_name);
             if (table.trim_index_obj && block_num > first) {
-                std::vector<char>                    index_key;
-                std::vector<std::optional<uint32_t>> positions;
-                kv::init_positions(positions, table.fields.size());
-                kv::fill_positions(v, table.fields, positions);
-                kv::append_index_key(index_key, table_name, table.trim_index_obj->short_name);
-                kv::extract_keys(index_key, v, table.trim_index_obj->sort_keys, positions);
-                trim_keys.insert(std::move(index_key));
-            } else if (!table.trim_index_obj && block_num < end_trim) {
-                remove_row(batch, batch, k, v, &num_rows, &num_indexes);
+                auto prefix = kv::make_index_key(table_name, table.trim_index_obj->short_name);
+                kv::for_each_journaled_index(v, [&](auto index_key) {
+                    if (size_t(index_key.end - index_key.pos) > prefix.size() && !memcmp(index_key.pos, prefix.data(), prefix.size()))
+                        trim_keys.emplace(index_key.pos, index_key.end - kv::index_suffix_size);
+                });
             }
+            // Tables without a trim index are left to rdb::trim_filter
             return true;
         });
 
@@ -785,18 +1014,18 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
             auto& table = get_kv_table(table_name);
             auto& index = *table.trim_index_obj;
 
-            uint32_t prev_block = 0xffff'ffff;
+            uint32_t          prev_block = 0xffff'ffff;
+            std::vector<char> pk;
             rdb::for_each(rocksdb_inst->database, range, range, [&](auto k, auto) {
-                std::vector<std::optional<uint32_t>> positions;
                 kv::init_positions(positions, table.fields.size());
-                uint32_t          block;
-                bool              present_k;
-                auto              suffix_pos = kv::fill_positions_from_index(k, index.sort_keys, block, present_k, positions);
-                std::vector<char> partial_k{k.pos, suffix_pos};
+                uint32_t block;
+                bool     present_k;
+                kv::fill_positions_from_index(k, index.sort_keys, block, present_k, positions);
 
                 if (prev_block <= end_trim) {
-                    auto pk = extract_pk(k, table, block, present_k, positions);
-                    remove_row(batch, batch, {pk.data(), pk.data() + pk.size()}, &num_rows, &num_indexes);
+                    pk.clear();
+                    kv::extract_pk(pk, k, table, block, present_k, positions);
+                    remove_row(batch, pk, num_rows, num_indexes);
                 }
                 prev_block = block;
                 return true;
@@ -842,6 +1071,11 @@ fill_rocksdb_plugin::~fill_rocksdb_plugin() {}
 void fill_rocksdb_plugin::set_program_options(options_description& cli, options_description& cfg) {
     auto clop = cli.add_options();
     clop("frdb-check", "Check database");
+    clop("frdb-check-threads", bpo::value<unsigned>(), "Number of threads --frdb-check uses. Default: number of cores");
+    clop(
+        "frdb-bulk-ingest", bpo::value<uint32_t>(),
+        "Load blocks more than this many blocks behind irreversible by writing SST files and ingesting them, this many blocks at a "
+        "time. Speeds up filling full history. Uses memory proportional to the block range.");
 }
 
 void fill_rocksdb_plugin::plugin_initialize(const variables_map& options) {
@@ -850,15 +1084,17 @@ void fill_rocksdb_plugin::plugin_initialize(const variables_map& options) {
         if (endpoint.find(':') == std::string::npos)
             throw std::runtime_error("invalid endpoint: " + endpoint);
 
-        auto port                = endpoint.substr(endpoint.find(':') + 1, endpoint.size());
-        auto host                = endpoint.substr(0, endpoint.find(':'));
-        my->config->host         = host;
-        my->config->port         = port;
-        my->config->skip_to      = options.count("fill-skip-to") ? options["fill-skip-to"].as<uint32_t>() : 0;
-        my->config->stop_before  = options.count("fill-stop") ? options["fill-stop"].as<uint32_t>() : 0;
-        my->config->trx_filters  = fill_plugin::get_trx_filters(options);
-        my->config->enable_trim  = options.count("fill-trim");
-        my->config->enable_check = options.count("frdb-check");
+        auto port                 = endpoint.substr(endpoint.find(':') + 1, endpoint.size());
+        auto host                 = endpoint.substr(0, endpoint.find(':'));
+        my->config->host          = host;
+        my->config->port          = port;
+        my->config->skip_to       = options.count("fill-skip-to") ? options["fill-skip-to"].as<uint32_t>() : 0;
+        my->config->stop_before   = options.count("fill-stop") ? options["fill-stop"].as<uint32_t>() : 0;
+        my->config->trx_filters   = fill_plugin::get_trx_filters(options);
+        my->config->enable_trim   = options.count("fill-trim");
+        my->config->enable_check  = options.count("frdb-check");
+        my->config->check_threads = options.count("frdb-check-threads") ? options["frdb-check-threads"].as<unsigned>() : 0;
+        my->config->bulk_blocks   = options.count("frdb-bulk-ingest") ? options["frdb-bulk-ingest"].as<uint32_t>() : 0;
     }
     FC_LOG_AND_RETHROW()
 }
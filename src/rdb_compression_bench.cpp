@@ -0,0 +1,226 @@
+// copyright defined in LICENSE.txt
+
+// Measures how rdb::database's compression settings affect database size and read latency. For
+// each setting, copies an existing database (e.g. one filled by fill-rocksdb) into a fresh one,
+// compacts it down to the bottommost level, then times point reads and short scans of sampled keys.
+//
+// Settings are "<upper>:<bottommost>:<dictionary bytes>", e.g. lz4:zstd:16384. See
+// rdb::compression_options.
+
+#include "state_history_rocksdb.hpp"
+#include "util.hpp"
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+
+namespace bpo = boost::program_options;
+namespace rdb = state_history::rdb;
+namespace kv  = state_history::kv;
+
+using namespace std::literals;
+
+struct setting {
+    std::string              name;
+    rdb::compression_options compression;
+};
+
+// Latencies are in ns
+struct result {
+    uint64_t              sst_bytes    = 0;
+    double                load_seconds = 0;
+    std::vector<uint64_t> get_ns       = {};
+    std::vector<uint64_t> scan_ns      = {};
+};
+
+static setting parse_setting(const std::string& s) {
+    auto colon1 = s.find(':');
+    auto colon2 = s.find(':', colon1 == std::string::npos ? colon1 : colon1 + 1);
+    if (colon2 == std::string::npos)
+        throw std::runtime_error("invalid setting '" + s + "'; expected <upper>:<bottommost>:<dictionary bytes>");
+    setting result{s};
+    result.compression.upper      = s.substr(0, colon1);
+    result.compression.bottommost = s.substr(colon1 + 1, colon2 - colon1 - 1);
+    result.compression.dict_bytes = std::stoul(s.substr(colon2 + 1));
+    rdb::compression_type(result.compression.upper);
+    rdb::compression_type(result.compression.bottommost);
+    return result;
+}
+
+// Opens every family of an existing database for reading
+struct source_database {
+    std::unique_ptr<rocksdb::DB>              db;
+    std::vector<rocksdb::ColumnFamilyHandle*> families;
+
+    source_database(const std::string& path) {
+        rocksdb::Options         options;
+        std::vector<std::string> names;
+        rdb::check(rocksdb::DB::ListColumnFamilies(options, path, &names), "ListColumnFamilies: ");
+        std::vector<rocksdb::ColumnFamilyDescriptor> descriptors;
+        for (auto& name : names)
+            descriptors.emplace_back(name, rocksdb::ColumnFamilyOptions{});
+        rocksdb::DB* p;
+        rdb::check(rocksdb::DB::OpenForReadOnly(options, path, descriptors, &families, &p), "OpenForReadOnly: ");
+        db.reset(p);
+    }
+
+    ~source_database() {
+        for (auto* handle : families)
+            db->DestroyColumnFamilyHandle(handle);
+    }
+};
+
+// Reservoir sample of the source's keys, so every setting reads the same keys
+static std::vector<std::vector<char>> sample_keys(source_database& source, size_t num_samples) {
+    std::vector<std::vector<char>> result;
+    std::mt19937_64                rng{1};
+    uint64_t                       seen = 0;
+    for (auto* family : source.families) {
+        std::unique_ptr<rocksdb::Iterator> it{source.db->NewIterator(rdb::total_order_options(), family)};
+        for (it->SeekToFirst(); it->Valid(); it->Next(), ++seen) {
+            auto k = it->key();
+            if (result.size() < num_samples)
+                result.emplace_back(k.data(), k.data() + k.size());
+            else if (auto i = std::uniform_int_distribution<uint64_t>{0, seen}(rng); i < num_samples)
+                result[i].assign(k.data(), k.data() + k.size());
+        }
+        rdb::check(it->status(), "sample: ");
+    }
+    std::shuffle(result.begin(), result.end(), rng);
+    return result;
+}
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static result run(
+    const setting& s, source_database& source, const kv::config& config, const std::string& path,
+    const std::vector<std::vector<char>>& keys, uint32_t scan_length) {
+    result r;
+    {
+        boost::filesystem::remove_all(path);
+        rdb::database db{path.c_str(), config, std::nullopt, std::nullopt, false, {}, s.compression};
+
+        auto                start = std::chrono::steady_clock::now();
+        rocksdb::WriteBatch batch;
+        for (auto* family : source.families) {
+            std::unique_ptr<rocksdb::Iterator> it{source.db->NewIterator(rdb::total_order_options(), family)};
+            for (it->SeekToFirst(); it->Valid(); it->Next()) {
+                batch.Put(db.column_family(it->key()), it->key(), it->value());
+                if (batch.GetDataSize() > 64 << 20)
+                    rdb::write(db, batch);
+            }
+            rdb::check(it->status(), "copy: ");
+        }
+        rdb::write(db, batch);
+        db.flush(true, true);
+
+        // Push everything to the bottommost level, where most of a full-history database ends up
+        rocksdb::CompactRangeOptions compact;
+        compact.bottommost_level_compaction = rocksdb::BottommostLevelCompaction::kForce;
+        for (auto* family : db.families)
+            rdb::check(db.db->CompactRange(compact, family, nullptr, nullptr), "CompactRange: ");
+        r.load_seconds = elapsed_ns(start) / 1e9;
+        for (auto* family : db.families) {
+            uint64_t bytes = 0;
+            db.db->GetIntProperty(family, "rocksdb.total-sst-files-size", &bytes);
+            r.sst_bytes += bytes;
+        }
+    }
+
+    // Reopen so reads start with an empty block cache
+    rdb::database db{path.c_str(), config, std::nullopt, std::nullopt, true, {}, s.compression};
+    for (auto& key : keys) {
+        rocksdb::PinnableSlice value;
+        auto                   start = std::chrono::steady_clock::now();
+        rdb::check(db.db->Get(rocksdb::ReadOptions{}, db.column_family(key), rdb::to_slice(key), &value), "Get: ");
+        r.get_ns.push_back(elapsed_ns(start));
+    }
+    std::map<rocksdb::ColumnFamilyHandle*, std::unique_ptr<rocksdb::Iterator>> iterators;
+    for (auto& key : keys) {
+        auto& it = iterators[db.column_family(key)];
+        if (!it)
+            it.reset(db.db->NewIterator(rdb::total_order_options(), db.column_family(key)));
+        auto     start = std::chrono::steady_clock::now();
+        uint32_t n     = 0;
+        for (it->Seek(rdb::to_slice(key)); it->Valid() && n < scan_length; it->Next())
+            ++n;
+        rdb::check(it->status(), "scan: ");
+        r.scan_ns.push_back(elapsed_ns(start));
+    }
+    return r;
+}
+
+static double percentile_us(std::vector<uint64_t>& v, double p) {
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, size_t(p * v.size()))] / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    try {
+        bpo::options_description desc{"Options"};
+        auto                     op = desc.add_options();
+        op("help,h", "Show this message");
+        op("database,d", bpo::value<std::string>()->required(), "Existing database to copy; opened read-only");
+        op("query-config,q", bpo::value<std::string>()->required(), "Query configuration the database was filled with");
+        op("work-dir,w", bpo::value<std::string>()->default_value("./compression-bench"), "Directory for the copies; removed afterwards");
+        op("setting,s", bpo::value<std::vector<std::string>>()->composing(),
+           "<upper>:<bottommost>:<dictionary bytes>; may be repeated. Default: none:none:0 lz4:lz4:0 lz4:zstd:0 lz4:zstd:16384");
+        op("samples,n", bpo::value<size_t>()->default_value(100000), "Number of keys to read");
+        op("scan-length,l", bpo::value<uint32_t>()->default_value(20), "Number of keys each scan visits");
+        op("keep", "Keep the copies");
+
+        bpo::variables_map vm;
+        bpo::store(bpo::parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            std::cout << "Usage: rdb-compression-bench --database DIR --query-config FILE [options]\n\n" << desc;
+            return 0;
+        }
+        bpo::notify(vm);
+
+        std::vector<std::string> setting_names{"none:none:0", "lz4:lz4:0", "lz4:zstd:0", "lz4:zstd:16384"};
+        if (vm.count("setting"))
+            setting_names = vm["setting"].as<std::vector<std::string>>();
+        std::vector<setting> settings;
+        for (auto& name : setting_names)
+            settings.push_back(parse_setting(name));
+
+        auto config_path = vm["query-config"].as<std::string>();
+        auto config      = std::make_unique<kv::config>();
+        abieos::json_to_native(*config, read_string(config_path.c_str()));
+        config->prepare(kv::abi_type_to_kv_type);
+
+        source_database source{vm["database"].as<std::string>()};
+        auto            keys     = sample_keys(source, vm["samples"].as<size_t>());
+        auto            work_dir = vm["work-dir"].as<std::string>();
+
+        printf("%-24s %12s %8s %9s %9s %9s %9s %9s\n", "setting", "MiB", "ratio", "load s", "get p50", "get p99", "scan p50", "scan p99");
+        double baseline = 0;
+        for (auto& s : settings) {
+            auto path = work_dir + "/" + std::to_string(&s - settings.data());
+            auto r    = run(s, source, *config, path, keys, vm["scan-length"].as<uint32_t>());
+            if (!baseline)
+                baseline = r.sst_bytes;
+            printf(
+                "%-24s %12.1f %8.2f %9.1f %9.1f %9.1f %9.1f %9.1f\n", s.name.c_str(), r.sst_bytes / 1048576.0,
+                r.sst_bytes ? baseline / r.sst_bytes : 0, r.load_seconds, percentile_us(r.get_ns, 0.5), percentile_us(r.get_ns, 0.99),
+                percentile_us(r.scan_ns, 0.5), percentile_us(r.scan_ns, 0.99));
+            fflush(stdout);
+            if (!vm.count("keep"))
+                boost::filesystem::remove_all(path);
+        }
+        if (!vm.count("keep"))
+            boost::filesystem::remove_all(work_dir);
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 2;
+    }
+}
@@ -3,18 +3,27 @@
 #include "rocksdb_plugin.hpp"
 #include "util.hpp"
 
+#include <boost/asio/steady_timer.hpp>
 #include <fc/exception/exception.hpp>
 
 using namespace appbase;
 using namespace std::literals;
 
 struct rocksdb_plugin_impl {
-    boost::filesystem::path         config_path    = {};
-    boost::filesystem::path         db_path        = {};
-    std::optional<uint32_t>         threads        = {};
-    std::optional<uint32_t>         max_open_files = {};
-    std::shared_ptr<::rocksdb_inst> rocksdb_inst   = {};
-    std::mutex                      mutex          = {};
+    boost::filesystem::path                 config_path    = {};
+    boost::filesystem::path                 db_path        = {};
+    std::optional<std::string>              secondary_path = {}; // open db_path as a read replica
+    uint32_t                                catch_up_ms    = 0;
+    std::optional<uint32_t>                 threads        = {};
+    std::optional<uint32_t>                 max_open_files = {};
+    state_history::rdb::filter_options      filters        = {};
+    state_history::rdb::compression_options compression    = {};
+    std::shared_ptr<::rocksdb_inst>         rocksdb_inst   = {};
+    std::mutex                              mutex          = {};
+    boost::asio::steady_timer               catch_up_timer;
+
+    rocksdb_plugin_impl()
+        : catch_up_timer(app().get_io_service()) {}
 };
 
 static abstract_plugin& _rocksdb_plugin = app().register_plugin<rocksdb_plugin>();
@@ -27,48 +36,96 @@ rocksdb_plugin::~rocksdb_plugin() {}
 void rocksdb_plugin::set_program_options(options_description& cli, options_description& cfg) {
     auto op = cfg.add_options();
     op("rdb-database", bpo::value<std::string>()->default_value("./chain.rocksdb"), "Primary database path");
+    op("rdb-secondary", bpo::value<std::string>(),
+       "Open the database as a read-only replica of a primary which another process (e.g. fill-rocksdb) writes. Each replica "
+       "needs its own directory, given here, for its logs. Not compatible with fill_rocksdb_plugin.");
+    op("rdb-catch-up-ms", bpo::value<uint32_t>()->default_value(1000),
+       "How often a replica (--rdb-secondary) applies what its primary has flushed, in ms");
     op("rdb-threads", bpo::value<uint32_t>(),
        "Increase number of background RocksDB threads. Only used with fill_rocksdb_plugin. Recommend 8 for full history on "
        "large chains.");
     op("rdb-max-files", bpo::value<uint32_t>(),
        "RocksDB limit max number of open files (default unlimited). This should be smaller than 'ulimit -n #'. "
        "# should be a very large number for full-history nodes.");
+    op("rdb-bloom-bits", bpo::value<uint32_t>()->default_value(10),
+       "RocksDB bloom filter bits per key (0 to disable). Changes apply to files written after restart.");
+    op("rdb-index-prefix", bpo::value<uint32_t>()->default_value(16),
+       "Number of leading sort-key bytes of each index covered by its prefix bloom filter (0 to disable). Seeks within one "
+       "index key skip files which don't contain its prefix.");
+    op("rdb-compression", bpo::value<std::string>()->default_value("lz4"),
+       "Compression for levels above the bottommost, except L0 and L1: none, snappy, lz4, or zstd");
+    op("rdb-bottommost-compression", bpo::value<std::string>()->default_value("zstd"),
+       "Compression for the bottommost level, which holds most of the data: none, snappy, lz4, or zstd");
+    op("rdb-compression-dict", bpo::value<uint32_t>()->default_value(16384),
+       "Size of the dictionary trained for each bottommost file when it uses zstd (0 to disable)");
 }
 
 void rocksdb_plugin::plugin_initialize(const variables_map& options) {
     try {
         my->config_path = options["query-config"].as<std::string>().c_str();
         my->db_path     = options["rdb-database"].as<std::string>();
+        if (!options["rdb-secondary"].empty())
+            my->secondary_path = options["rdb-secondary"].as<std::string>();
+        my->catch_up_ms = std::max(1u, options["rdb-catch-up-ms"].as<uint32_t>());
         if (!options["rdb-threads"].empty())
             my->threads = options["rdb-threads"].as<uint32_t>();
         if (!options["rdb-max-files"].empty())
             my->max_open_files = options["rdb-max-files"].as<uint32_t>();
+        my->filters.bloom_bits     = options["rdb-bloom-bits"].as<uint32_t>();
+        my->filters.index_prefix   = options["rdb-index-prefix"].as<uint32_t>();
+        my->compression.upper      = options["rdb-compression"].as<std::string>();
+        my->compression.bottommost = options["rdb-bottommost-compression"].as<std::string>();
+        my->compression.dict_bytes = options["rdb-compression-dict"].as<uint32_t>();
+
+        // reject unknown names now instead of when the database is first opened
+        state_history::rdb::compression_type(my->compression.upper);
+        state_history::rdb::compression_type(my->compression.bottommost);
     }
     FC_LOG_AND_RETHROW()
 }
 
 void rocksdb_plugin::plugin_startup() {}
 
-void rocksdb_plugin::plugin_shutdown() {}
+void rocksdb_plugin::plugin_shutdown() { my->catch_up_timer.cancel(); }
 
-static void open_query_config(rocksdb_plugin_impl* my, std::shared_ptr<rocksdb_inst>& inst) {
+static std::unique_ptr<const state_history::kv::config> open_query_config(rocksdb_plugin_impl* my) {
     try {
         ilog("using query config ${qc}", ("qc", my->config_path.c_str()));
         auto query_config = std::make_unique<state_history::kv::config>();
         abieos::json_to_native(*query_config, read_string(my->config_path.c_str()));
         query_config->prepare(state_history::kv::abi_type_to_kv_type);
-        inst->query_config = std::move(query_config);
+        return query_config;
     } catch (const std::exception& e) {
-        inst.reset();
         throw std::runtime_error("error processing "s + my->config_path.c_str() + ": " + e.what());
     }
 }
 
+// catch_up() waits for running queries to finish and holds new ones back until it's done. The lag
+// reported in fill_status shows if it falls behind.
+static void schedule_catch_up(const std::shared_ptr<rocksdb_plugin_impl>& my) {
+    my->catch_up_timer.expires_after(std::chrono::milliseconds(my->catch_up_ms));
+    my->catch_up_timer.async_wait([my](const boost::system::error_code& ec) {
+        if (ec)
+            return;
+        try {
+            my->rocksdb_inst->database.catch_up();
+        } catch (const std::exception& e) {
+            elog("catching up with primary: ${e}", ("e", e.what()));
+        }
+        schedule_catch_up(my);
+    });
+}
+
 std::shared_ptr<rocksdb_inst> rocksdb_plugin::get_rocksdb_inst(bool fast_reads) {
     std::lock_guard<std::mutex> lock(my->mutex);
+    if (my->secondary_path && !fast_reads)
+        throw std::runtime_error("--rdb-secondary opens a read-only replica; it can't be filled");
     if (!my->rocksdb_inst) {
-        my->rocksdb_inst = std::make_shared<rocksdb_inst>(my->db_path.c_str(), my->threads, my->max_open_files, fast_reads);
-        open_query_config(my.get(), my->rocksdb_inst);
+        my->rocksdb_inst = std::make_shared<rocksdb_inst>(
+            my->db_path.c_str(), open_query_config(my.get()), my->threads, my->max_open_files, fast_reads, my->filters, my->compression,
+            my->secondary_path ? my->secondary_path->c_str() : nullptr);
+        if (my->secondary_path)
+            schedule_catch_up(my);
     }
     return my->rocksdb_inst;
 }
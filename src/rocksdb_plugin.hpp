@@ -7,11 +7,15 @@
 #include "state_history_rocksdb.hpp"
 
 struct rocksdb_inst {
-    state_history::rdb::database                     database;
-    std::unique_ptr<const state_history::kv::config> query_config{};
-
-    rocksdb_inst(const char* db_path, std::optional<uint32_t> threads, std::optional<uint32_t> max_open_files, bool fast_reads)
-        : database{db_path, threads, max_open_files, fast_reads} {}
+    std::unique_ptr<const state_history::kv::config> query_config;
+    state_history::rdb::database                     database; // column families come from query_config
+
+    rocksdb_inst(
+        const char* db_path, std::unique_ptr<const state_history::kv::config> query_config, std::optional<uint32_t> threads,
+        std::optional<uint32_t> max_open_files, bool fast_reads, const state_history::rdb::filter_options& filters,
+        const state_history::rdb::compression_options& compression, const char* secondary_path)
+        : query_config{std::move(query_config)}
+        , database{db_path, *this->query_config, threads, max_open_files, fast_reads, filters, compression, secondary_path} {}
 };
 
 class rocksdb_plugin : public appbase::plugin<rocksdb_plugin> {
@@ -0,0 +1,102 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace wasm_ql {
+
+// Runs callbacks at their deadlines on one thread shared by every query. eos-vm's watchdog
+// starts a thread for each timed_run; at() gives a watchdog with the same interface instead.
+class shared_watchdog {
+  public:
+    using clock = std::chrono::steady_clock;
+
+  private:
+    using key = std::pair<clock::time_point, uint64_t>;
+
+    std::mutex                           mutex;
+    std::condition_variable              cv;
+    bool                                 stopping = false;
+    uint64_t                             next_id  = 0;
+    std::map<key, std::function<void()>> timers;
+    std::thread                          thread{[this] { run(); }};
+
+    void run() {
+        std::unique_lock<std::mutex> lock{mutex};
+        while (!stopping) {
+            if (timers.empty()) {
+                cv.wait(lock);
+            } else if (clock::now() >= timers.begin()->first.first) {
+                auto callback = std::move(timers.begin()->second);
+                timers.erase(timers.begin());
+                // Runs under the lock so a guard being destroyed waits for it
+                callback();
+            } else {
+                cv.wait_until(lock, timers.begin()->first.first);
+            }
+        }
+    }
+
+  public:
+    // Cancels its timer when destroyed. Afterwards the callback isn't running and won't run.
+    class guard {
+      public:
+        guard(shared_watchdog& watchdog, key k)
+            : watchdog{watchdog}
+            , k{k} {}
+
+        guard(const guard&) = delete;
+        guard& operator=(const guard&) = delete;
+
+        ~guard() {
+            std::lock_guard<std::mutex> lock{watchdog.mutex};
+            watchdog.timers.erase(k);
+        }
+
+      private:
+        shared_watchdog& watchdog;
+        key              k;
+    };
+
+    // Watchdog for backend::timed_run which fires at a fixed time
+    struct timer {
+        shared_watchdog&  watchdog;
+        clock::time_point deadline;
+
+        template <typename F>
+        guard scoped_run(F&& callback) {
+            return watchdog.call_at(deadline, std::forward<F>(callback));
+        }
+    };
+
+    ~shared_watchdog() {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            stopping = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+    template <typename F>
+    guard call_at(clock::time_point deadline, F&& callback) {
+        std::lock_guard<std::mutex> lock{mutex};
+        key                         k{deadline, next_id++};
+        auto                        it = timers.emplace(k, std::forward<F>(callback)).first;
+        if (it == timers.begin())
+            cv.notify_one();
+        return guard{*this, k};
+    }
+
+    timer at(clock::time_point deadline) { return timer{*this, deadline}; }
+};
+
+} // namespace wasm_ql
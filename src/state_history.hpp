@@ -15,6 +15,7 @@ struct fill_status {
     uint32_t            irreversible    = {};
     eosio::checksum256  irreversible_id = {};
     uint32_t            first           = {};
+    uint32_t            lag_ms          = {}; // not stored: how long ago a read replica last caught up with its primary
 };
 
 EOSIO_REFLECT(fill_status,
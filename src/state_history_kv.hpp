@@ -33,11 +33,33 @@ void fixup_key(std::vector<char>& bin, F f) {
         throw std::runtime_error("unsupported key type");
 }
 
+// Keys hold integers big-endian; the host is little-endian
+template <typename T>
+T byte_swap(T v) {
+    static_assert(std::is_unsigned_v<T>);
+    if constexpr (sizeof(T) == 1)
+        return v;
+    else if constexpr (sizeof(T) == 2)
+        return __builtin_bswap16(v);
+    else if constexpr (sizeof(T) == 4)
+        return __builtin_bswap32(v);
+    else
+        return __builtin_bswap64(v);
+}
+
 template <typename T>
 void native_to_key(std::vector<char>& bin, const T& obj) {
-    fixup_key<T>(bin, [&] { abieos::native_to_bin(obj, bin); });
+    if constexpr (std::is_unsigned_v<T> && !std::is_same_v<T, bool>) {
+        auto v = byte_swap(obj);
+        bin.insert(bin.end(), (const char*)&v, (const char*)&v + sizeof(v));
+    } else if constexpr (std::is_same_v<std::decay_t<T>, abieos::name>) {
+        native_to_key(bin, obj.value);
+    } else {
+        fixup_key<T>(bin, [&] { abieos::native_to_bin(obj, bin); });
+    }
 }
 
+// Decodes in place; doesn't allocate
 template <typename T>
 T key_to_native(abieos::input_buffer& b) {
     if constexpr (
@@ -45,11 +67,22 @@ T key_to_native(abieos::input_buffer& b) {
         std::is_same_v<std::decay_t<T>, abieos::checksum256>) {
         if (b.pos + sizeof(T) > b.end)
             throw std::runtime_error("key deserialization error");
-        std::vector<char> v(b.pos, b.pos + sizeof(T));
-        b.pos += sizeof(T);
-        std::reverse(v.begin(), v.end());
-        auto br = abieos::input_buffer{v.data(), v.data() + v.size()};
-        return abieos::bin_to_native<T>(br);
+        if constexpr (std::is_same_v<T, bool>) {
+            return *b.pos++ != 0;
+        } else if constexpr (std::is_unsigned_v<T>) {
+            T v;
+            memcpy(&v, b.pos, sizeof(v));
+            b.pos += sizeof(v);
+            return byte_swap(v);
+        } else if constexpr (std::is_same_v<std::decay_t<T>, abieos::name>) {
+            return abieos::name{key_to_native<uint64_t>(b)};
+        } else {
+            char v[sizeof(T)];
+            std::reverse_copy(b.pos, b.pos + sizeof(T), v);
+            b.pos += sizeof(T);
+            abieos::input_buffer br{v, v + sizeof(T)};
+            return abieos::bin_to_native<T>(br);
+        }
     } else {
         throw std::runtime_error("unsupported key type");
     }
@@ -60,6 +93,7 @@ struct type {
     void (*bin_to_key)(std::vector<char>&, abieos::input_buffer&)   = nullptr;
     void (*key_to_key)(std::vector<char>&, abieos::input_buffer&)   = nullptr;
     void (*query_to_key)(std::vector<char>&, abieos::input_buffer&) = nullptr;
+    void (*key_to_query)(std::vector<char>&, abieos::input_buffer&) = nullptr;
     void (*lower_bound_key)(std::vector<char>&)                     = nullptr;
     void (*upper_bound_key)(std::vector<char>&)                     = nullptr;
     bool (*skip_bin)(abieos::input_buffer&)                         = nullptr;
@@ -116,6 +150,21 @@ void query_to_key(std::vector<char>& dest, abieos::input_buffer& bin) {
     }
 }
 
+// Inverse of query_to_key
+template <typename T>
+void key_to_query(std::vector<char>& dest, abieos::input_buffer& key) {
+    if constexpr (std::is_same_v<std::decay_t<T>, abieos::varuint32>) {
+        key_to_query<uint32_t>(dest, key);
+    } else {
+        fixup_key<T>(dest, [&] {
+            if (size_t(key.end - key.pos) < sizeof(T))
+                throw std::runtime_error("key deserialization error");
+            dest.insert(dest.end(), key.pos, key.pos + sizeof(T));
+            key.pos += sizeof(T);
+        });
+    }
+}
+
 template <typename T>
 void lower_bound_key(std::vector<char>& dest) {
     if constexpr (
@@ -190,8 +239,8 @@ void fill_empty(std::vector<char>& dest) {
 
 template <typename T>
 constexpr type make_type_for() {
-    return type{bin_to_bin<T>,      bin_to_key<T>, key_to_key<T>, query_to_key<T>, lower_bound_key<T>,
-                upper_bound_key<T>, skip_bin<T>,   skip_key<T>,   fill_empty<T>};
+    return type{bin_to_bin<T>,      bin_to_key<T>,      key_to_key<T>, query_to_key<T>, key_to_query<T>,
+                lower_bound_key<T>, upper_bound_key<T>, skip_bin<T>,   skip_key<T>,     fill_empty<T>};
 }
 
 // clang-format off
@@ -227,10 +276,12 @@ const inline std::map<std::string, type> abi_type_to_kv_type = {
 // =================================================================================================================================================
 // key_tag::table,  block_num, table_name, present_k, pk,               ## present_v,(fields iff present_v) ## 1,2  ## traces, deltas, reducer_outputs
 // key_tag::index,  table_name, index_name, key, ~block_num, !present_k ## (none)                           ## 1    ## indexes. key is superset of pk fields
+// key_tag::index_journal, block_num, table_name, present_k, pk         ## (varuint32 size, index key)*     ## 3    ## index entries of the table row
 //
 // * Keys are serialized in a lexigraphical sort format. See native_to_key() and key_to_native().
 // * Erase range lower_bound(make_table_key(n)) to upper_bound(make_table_key()) to erase blocks >= n.
-//   Also remove index entries corresponding to each removed row.
+//   Also delete the index entries listed in index_journal for the same blocks, then erase that
+//   range of index_journal. Neither step needs to read the table rows.
 // * pk and fields may be empty
 // * block_num is 0 for tables which don't support history (e.g. fill_status)
 //
@@ -242,10 +293,15 @@ const inline std::map<std::string, type> abi_type_to_kv_type = {
 //   * nodeos deltas:     used
 //   * reducer outputs:   used
 //   * all other cases:   =1
+//
+// * index_journal (3)
+//   * Has the same key as the table row, apart from the tag. Written in the same batch as the row.
+//   * Databases without make_layout_key() predate it and must be refilled.
 
 enum class key_tag : uint8_t {
-    table = 0x50,
-    index = 0x60,
+    table         = 0x50,
+    index         = 0x60,
+    index_journal = 0x70,
 };
 
 inline key_tag bin_to_key_tag(abieos::input_buffer& b) { return (key_tag)abieos::bin_to_native<uint8_t>(b); }
@@ -254,6 +310,7 @@ inline const char* to_string(key_tag t) {
     switch (t) {
     case key_tag::table: return "table";
     case key_tag::index: return "index";
+    case key_tag::index_journal: return "index_journal";
     default: return "?";
     }
 }
@@ -340,12 +397,66 @@ inline std::vector<char> make_index_key(abieos::name table_name, abieos::name in
     return result;
 }
 
+inline void append_index_journal_key(std::vector<char>& dest) { native_to_key(dest, (uint8_t)key_tag::index_journal); }
+
+inline void append_index_journal_key(std::vector<char>& dest, uint32_t block) {
+    native_to_key(dest, (uint8_t)key_tag::index_journal);
+    native_to_key(dest, block);
+}
+
+inline std::vector<char> make_index_journal_key() {
+    std::vector<char> result;
+    append_index_journal_key(result);
+    return result;
+}
+
+inline std::vector<char> make_index_journal_key(uint32_t block) {
+    std::vector<char> result;
+    append_index_journal_key(result, block);
+    return result;
+}
+
+// Convert between a table key and its index_journal key
+inline void with_key_tag(std::vector<char>& dest, abieos::input_buffer key, key_tag tag) {
+    if (key.pos == key.end)
+        throw std::runtime_error("with_key_tag: empty key");
+    dest.assign(key.pos, key.end);
+    dest[0] = (char)tag;
+}
+
+inline std::vector<char> with_key_tag(abieos::input_buffer key, key_tag tag) {
+    std::vector<char> result;
+    with_key_tag(result, key, tag);
+    return result;
+}
+
+// Append an index key to an index_journal value
+inline void append_journaled_index(std::vector<char>& journal, const std::vector<char>& index_key) {
+    abieos::push_varuint32(journal, index_key.size());
+    journal.insert(journal.end(), index_key.begin(), index_key.end());
+}
+
+// Call f(abieos::input_buffer index_key) for each index key in an index_journal value
+template <typename F>
+void for_each_journaled_index(abieos::input_buffer journal, F f) {
+    while (journal.pos != journal.end) {
+        auto size = abieos::read_varuint32(journal);
+        if (size > size_t(journal.end - journal.pos))
+            throw std::runtime_error("index_journal value is truncated");
+        f(abieos::input_buffer{journal.pos, journal.pos + size});
+        journal.pos += size;
+    }
+}
+
 inline void read_table_prefix(abieos::input_buffer& bin, uint32_t& block_num, abieos::name& table_name, bool& present_k) {
     block_num  = key_to_native<uint32_t>(bin);
     table_name = key_to_native<abieos::name>(bin);
     present_k  = key_to_native<bool>(bin);
 }
 
+// Size of the ~block_num, !present_k suffix of index keys
+inline constexpr size_t index_suffix_size = sizeof(uint32_t) + sizeof(bool);
+
 inline void append_index_suffix(std::vector<char>& dest, uint32_t block) { native_to_key(dest, ~block); }
 
 inline void append_index_suffix(std::vector<char>& dest, uint32_t block, bool present_k) {
@@ -365,6 +476,10 @@ inline void read_index_suffix(abieos::input_buffer& bin, uint32_t& block, bool&
 
 inline std::vector<char> make_fill_status_key() { return make_table_key(0, true, "fill.status"_n); }
 
+// Present once a database has been filled with index_journal entries; the value is layout_version
+inline std::vector<char> make_layout_key() { return make_table_key(0, true, "kv.layout"_n); }
+inline constexpr uint32_t layout_version = 2; // 1: no column families
+
 struct received_block {
     uint32_t            block_num = {};
     abieos::checksum256 block_id  = {};
@@ -420,6 +535,42 @@ using index  = defs::index;
 using query  = defs::query;
 using config = defs::config;
 
+// Encoded size of key, or 0 if it isn't fixed-width
+inline size_t key_size(const key& key) {
+    static const std::vector<char> zeros(64);
+    abieos::input_buffer           bin{zeros.data(), zeros.data() + zeros.size()};
+    if (key.field->begin_optional || key.field->end_optional || !key.field->type_obj->skip_key(bin))
+        return 0;
+    return bin.pos - zeros.data();
+}
+
+// Size of the leading fixed-width sort keys of index; they follow make_index_key(table, index). Every
+// entry in the index, and every key wasm-ql looks up within it, has at least this many bytes there.
+inline size_t fixed_sort_key_size(const index& index) {
+    size_t result = 0;
+    for (auto& key : index.sort_keys) {
+        auto size = key_size(key);
+        if (!size)
+            break;
+        result += size;
+    }
+    return result;
+}
+
+// Typical size of table's longest table or index key; the capacity to reserve for key buffers.
+// Keys which aren't fixed-width count as 32 bytes.
+inline size_t max_key_size(const table& table) {
+    auto sum = [](size_t header, const std::vector<key>& keys) {
+        for (auto& key : keys)
+            header += key_size(key) ? key_size(key) : 32;
+        return header;
+    };
+    size_t result = sum(1 + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(bool), table.keys);
+    for (auto* index : table.indexes)
+        result = std::max(result, sum(1 + 2 * sizeof(uint64_t) + sizeof(uint32_t) + sizeof(bool), index->sort_keys));
+    return result;
+}
+
 inline void init_positions(std::vector<std::optional<uint32_t>>& positions, size_t size) {
     positions.clear();
     positions.resize(size);
@@ -510,26 +661,42 @@ inline const char* fill_positions_from_index(
     return suffix_pos;
 }
 
-inline std::vector<char> extract_pk(
-    abieos::input_buffer index, const kv::table& table, uint32_t block, bool present_k, std::vector<std::optional<uint32_t>>& positions) {
-    std::vector<char> result;
-    append_table_key(result, block, present_k, table.short_name);
+// Append the table key an index entry refers to
+inline void extract_pk(
+    std::vector<char>& dest, abieos::input_buffer index, const kv::table& table, uint32_t block, bool present_k,
+    std::vector<std::optional<uint32_t>>& positions) {
+    append_table_key(dest, block, present_k, table.short_name);
     for (auto& k : table.keys) {
         if (!positions.at(k.field->field_index))
             throw std::runtime_error("secondary index is missing pk fields");
         abieos::input_buffer b = {index.pos + *positions[k.field->field_index], index.end};
-        k.field->type_obj->key_to_key(result, b);
+        k.field->type_obj->key_to_key(dest, b);
     }
+}
+
+inline std::vector<char> extract_pk(
+    abieos::input_buffer index, const kv::table& table, uint32_t block, bool present_k, std::vector<std::optional<uint32_t>>& positions) {
+    std::vector<char> result;
+    extract_pk(result, index, table, block, present_k, positions);
     return result;
 }
 
-inline std::vector<char> extract_pk_from_index(abieos::input_buffer index, const kv::table& table, const std::vector<kv::key>& index_keys) {
-    std::vector<std::optional<uint32_t>> positions;
+// positions is scratch space; callers which look up many entries can reuse it
+inline void extract_pk_from_index(
+    std::vector<char>& dest, abieos::input_buffer index, const kv::table& table, const std::vector<kv::key>& index_keys,
+    std::vector<std::optional<uint32_t>>& positions) {
     init_positions(positions, table.fields.size());
     uint32_t block;
     bool     present_k;
     fill_positions_from_index(index, index_keys, block, present_k, positions);
-    return extract_pk(index, table, block, present_k, positions);
+    extract_pk(dest, index, table, block, present_k, positions);
+}
+
+inline std::vector<char> extract_pk_from_index(abieos::input_buffer index, const kv::table& table, const std::vector<kv::key>& index_keys) {
+    std::vector<char>                    result;
+    std::vector<std::optional<uint32_t>> positions;
+    extract_pk_from_index(result, index, table, index_keys, positions);
+    return result;
 }
 
 } // namespace kv
@@ -134,6 +134,184 @@ inline std::string bin_to_sql<eosio::bytes>(eosio::input_stream& bin) {
     return quote_bytea(result);
 }
 
+// Decoders for PostgreSQL's binary result format (resultFormat = 1). Each one appends the abieos
+// binary form of a single result field to `bin`. A null field arrives as an empty `data`; it
+// decodes to the type's default value, matching what the text-format path produced.
+
+inline void push_bytes(std::vector<char>& bin, const void* data, size_t size) {
+    bin.insert(bin.end(), (const char*)data, (const char*)data + size);
+}
+
+template <typename T>
+void push_le(std::vector<char>& bin, T v) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    push_bytes(bin, &v, sizeof(v));
+}
+
+inline void push_varuint32_bin(std::vector<char>& bin, uint32_t v) {
+    do {
+        uint8_t b = v & 0x7f;
+        v >>= 7;
+        b |= (v > 0) << 7;
+        bin.push_back(b);
+    } while (v);
+}
+
+// int2, int4 and int8 are all sent big-endian; the width is implied by the field size
+inline int64_t pg_binary_int(std::string_view data) {
+    uint64_t v = 0;
+    for (unsigned char c : data)
+        v = (v << 8) | c;
+    switch (data.size()) {
+    case 0: return 0;
+    case 2: return (int16_t)v;
+    case 4: return (int32_t)v;
+    case 8: return (int64_t)v;
+    default: throw std::runtime_error("unexpected integer field size " + std::to_string(data.size()));
+    }
+}
+
+// numeric: int16 ndigits, int16 weight, uint16 sign, uint16 dscale, then ndigits base-10000 digits
+inline unsigned __int128 pg_binary_numeric(std::string_view data, bool& negative) {
+    negative = false;
+    if (data.empty())
+        return 0;
+    if (data.size() < 8)
+        throw std::runtime_error("numeric field is truncated");
+    auto read_u16 = [&](size_t pos) { return uint16_t((uint8_t(data[pos]) << 8) | uint8_t(data[pos + 1])); };
+    int16_t  ndigits = read_u16(0);
+    int16_t  weight  = read_u16(2);
+    uint16_t sign    = read_u16(4);
+    if (sign == 0xc000)
+        throw std::runtime_error("numeric field is NaN");
+    if (data.size() < 8 + 2 * size_t(ndigits))
+        throw std::runtime_error("numeric field is truncated");
+    negative = sign == 0x4000;
+
+    unsigned __int128 result = 0;
+    for (int16_t i = 0; i < ndigits && i <= weight; ++i)
+        result = result * 10000 + read_u16(8 + 2 * i);
+    for (int16_t i = std::max<int16_t>(ndigits, 0); i <= weight; ++i)
+        result *= 10000;
+    return result;
+}
+
+inline void push_checksum256(std::vector<char>& bin, std::string_view data) {
+    auto v = eosio::convert_to_bin(sql_to_checksum256(std::string(data).c_str()));
+    bin.insert(bin.end(), v.begin(), v.end());
+}
+
+// timestamp: int64 microseconds since 2000-01-01
+inline int64_t pg_binary_timestamp_us(std::string_view data) {
+    if (data.empty())
+        return 0;
+    return pg_binary_int(data) + 946'684'800'000'000ll;
+}
+
+template <typename T>
+void binary_to_bin(std::vector<char>& bin, std::string_view data) {
+    if constexpr (std::is_same_v<T, bool>) {
+        bin.push_back(!data.empty() && data[0]);
+    } else if constexpr (std::is_integral_v<T>) {
+        push_le(bin, T(pg_binary_int(data)));
+    } else {
+        static_assert(std::is_same_v<T, void>, "binary_to_bin: unsupported type");
+    }
+}
+
+// clang-format off
+template <> inline void binary_to_bin<uint64_t>(std::vector<char>& bin, std::string_view data)                { bool neg; push_le(bin, uint64_t(pg_binary_numeric(data, neg))); }
+template <> inline void binary_to_bin<unsigned __int128>(std::vector<char>& bin, std::string_view data)       { bool neg; push_le(bin, pg_binary_numeric(data, neg)); }
+template <> inline void binary_to_bin<eosio::varuint32>(std::vector<char>& bin, std::string_view data)        { push_varuint32_bin(bin, pg_binary_int(data)); }
+template <> inline void binary_to_bin<eosio::varint32>(std::vector<char>& bin, std::string_view data)         { int32_t v = pg_binary_int(data); push_varuint32_bin(bin, (uint32_t(v) << 1) ^ uint32_t(v >> 31)); }
+template <> inline void binary_to_bin<eosio::name>(std::vector<char>& bin, std::string_view data)             { push_le(bin, eosio::name{data}.value); }
+template <> inline void binary_to_bin<eosio::checksum256>(std::vector<char>& bin, std::string_view data)      { push_checksum256(bin, data); }
+template <> inline void binary_to_bin<eosio::time_point>(std::vector<char>& bin, std::string_view data)       { push_le(bin, pg_binary_timestamp_us(data)); }
+template <> inline void binary_to_bin<eosio::time_point_sec>(std::vector<char>& bin, std::string_view data)   { push_le(bin, uint32_t(pg_binary_timestamp_us(data) / 1'000'000)); }
+template <> inline void binary_to_bin<eosio::block_timestamp>(std::vector<char>& bin, std::string_view data)  { push_le(bin, uint32_t(data.empty() ? 0 : pg_binary_int(data) / 500'000)); }
+// clang-format on
+
+template <>
+inline void binary_to_bin<__int128>(std::vector<char>& bin, std::string_view data) {
+    bool     neg;
+    __int128 v = pg_binary_numeric(data, neg);
+    push_le(bin, neg ? -v : v);
+}
+
+template <>
+inline void binary_to_bin<double>(std::vector<char>& bin, std::string_view data) {
+    uint64_t raw = data.empty() ? 0 : pg_binary_int(data);
+    double   v;
+    memcpy(&v, &raw, sizeof(v));
+    push_le(bin, v);
+}
+
+template <>
+inline void binary_to_bin<eosio::float128>(std::vector<char>& bin, std::string_view data) {
+    if (!data.empty() && data.size() != 16)
+        throw std::runtime_error("float128 field has incorrect length");
+    if (data.empty())
+        bin.resize(bin.size() + 16);
+    else
+        push_bytes(bin, data.data(), data.size());
+}
+
+template <>
+inline void binary_to_bin<std::string>(std::vector<char>& bin, std::string_view data) {
+    push_varuint32_bin(bin, data.size());
+    push_bytes(bin, data.data(), data.size());
+}
+
+template <>
+inline void binary_to_bin<eosio::bytes>(std::vector<char>& bin, std::string_view data) {
+    binary_to_bin<std::string>(bin, data);
+}
+
+template <>
+inline void binary_to_bin<eosio::public_key>(std::vector<char>& bin, std::string_view data) {
+    auto v = eosio::convert_to_bin(eosio::public_key_from_string(data));
+    bin.insert(bin.end(), v.begin(), v.end());
+}
+
+template <>
+inline void binary_to_bin<eosio::signature>(std::vector<char>& bin, std::string_view data) {
+    auto v = eosio::convert_to_bin(eosio::signature_from_string(data));
+    bin.insert(bin.end(), v.begin(), v.end());
+}
+
+// symbols are stored as "precision,CODE"
+template <>
+inline void binary_to_bin<eosio::symbol>(std::vector<char>& bin, std::string_view data) {
+    uint64_t value = 0;
+    auto     comma = data.find(',');
+    if (!data.empty()) {
+        if (comma == std::string_view::npos || comma == 0 || data.size() - comma - 1 > 7)
+            throw std::runtime_error("invalid symbol: " + std::string(data));
+        uint8_t precision = 0;
+        for (auto c : data.substr(0, comma))
+            precision = precision * 10 + (c - '0');
+        value    = precision;
+        int step = 8;
+        for (auto c : data.substr(comma + 1)) {
+            value |= uint64_t(uint8_t(c)) << step;
+            step += 8;
+        }
+    }
+    push_le(bin, value);
+}
+
+template <>
+inline void binary_to_bin<eosio::ship_protocol::transaction_status>(std::vector<char>& bin, std::string_view data) {
+    static constexpr std::string_view labels[] = {"executed", "soft_fail", "hard_fail", "delayed", "expired"};
+    for (uint8_t i = 0; i < std::size(labels); ++i) {
+        if (data == labels[i]) {
+            bin.push_back(i);
+            return;
+        }
+    }
+    throw std::runtime_error("unknown transaction_status: " + std::string(data));
+}
+
 struct type_names {
     const char *abi, *sql;
 };
@@ -171,5 +349,171 @@ template<> inline constexpr type_names names_for<eosio::ship_protocol::transacti
 template<> inline constexpr type_names names_for<eosio::ship_protocol::recurse_transaction_trace> = type_names{"recurse_transaction_trace","varchar"};
 // clang-format on
 
+// Text-format parameters for PQexecParams. Unlike sql_str, which feeds COPY, nothing is escaped twice and
+// zero timestamps are sent as the time they stand for, matching what binary_to_bin decodes them from.
+template <typename It>
+std::string param_bytea(It begin, It end) {
+    std::string result = "\\x";
+    boost::algorithm::hex(begin, end, back_inserter(result));
+    return result;
+}
+
+template <typename T>
+std::string bin_to_param(eosio::input_stream& bin) {
+    T v;
+    from_bin(v, bin);
+    if constexpr (std::is_same_v<T, eosio::time_point>) {
+        return eosio::microseconds_to_str(v.elapsed.count());
+    } else if constexpr (std::is_same_v<T, eosio::time_point_sec>) {
+        return eosio::microseconds_to_str(uint64_t(v.utc_seconds) * 1'000'000);
+    } else if constexpr (std::is_same_v<T, eosio::block_timestamp>) {
+        return eosio::microseconds_to_str(v.to_time_point().elapsed.count());
+    } else if constexpr (std::is_same_v<T, eosio::float128>) {
+        const auto& bytes = v.extract_as_byte_array();
+        return param_bytea(bytes.begin(), bytes.end());
+    } else {
+        return sql_str(v);
+    }
+}
+
+template <>
+inline std::string bin_to_param<eosio::bytes>(eosio::input_stream& bin) {
+    uint32_t size;
+    eosio::varuint32_from_bin(size, bin);
+    eosio::check(size <= bin.end - bin.pos, "invalid bytes size");
+    bin.pos += size;
+    return param_bytea(bin.pos - size, bin.pos);
+}
+
+struct type {
+    std::string (*bin_to_param)(eosio::input_stream&)            = nullptr;
+    void (*binary_to_bin)(std::vector<char>&, std::string_view) = nullptr;
+};
+
+template <typename T>
+constexpr type make_type_for() {
+    return type{bin_to_param<T>, binary_to_bin<T>};
+}
+
+// clang-format off
+const inline std::map<std::string, type> abi_type_to_sql_type = {
+    {"bool",                    make_type_for<bool>()},
+    {"varuint32",               make_type_for<eosio::varuint32>()},
+    {"varint32",                make_type_for<eosio::varint32>()},
+    {"uint8",                   make_type_for<uint8_t>()},
+    {"uint16",                  make_type_for<uint16_t>()},
+    {"uint32",                  make_type_for<uint32_t>()},
+    {"uint64",                  make_type_for<uint64_t>()},
+    {"uint128",                 make_type_for<unsigned __int128>()},
+    {"int8",                    make_type_for<int8_t>()},
+    {"int16",                   make_type_for<int16_t>()},
+    {"int32",                   make_type_for<int32_t>()},
+    {"int64",                   make_type_for<int64_t>()},
+    {"int128",                  make_type_for<__int128>()},
+    {"float64",                 make_type_for<double>()},
+    {"float128",                make_type_for<eosio::float128>()},
+    {"name",                    make_type_for<eosio::name>()},
+    {"string",                  make_type_for<std::string>()},
+    {"time_point",              make_type_for<eosio::time_point>()},
+    {"time_point_sec",          make_type_for<eosio::time_point_sec>()},
+    {"block_timestamp_type",    make_type_for<eosio::block_timestamp>()},
+    {"checksum256",             make_type_for<eosio::checksum256>()},
+    {"public_key",              make_type_for<eosio::public_key>()},
+    {"signature",               make_type_for<eosio::signature>()},
+    {"bytes",                   make_type_for<eosio::bytes>()},
+    {"symbol",                  make_type_for<eosio::symbol>()},
+    {"transaction_status",      make_type_for<eosio::ship_protocol::transaction_status>()},
+};
+// clang-format on
+
+struct defs {
+    using type   = pg::type;
+    using field  = query_config::field<defs>;
+    using key    = query_config::key<defs>;
+    using table  = query_config::table<defs>;
+    using index  = query_config::index<defs>;
+    using query  = query_config::query<defs>;
+    using config = query_config::config<defs>;
+}; // defs
+
+using field  = defs::field;
+using key    = defs::key;
+using table  = defs::table;
+using index  = defs::index;
+using query  = defs::query;
+using config = defs::config;
+
+// A query_database request as a call to the query's SQL function
+struct query_call {
+    std::string              sql            = {};
+    std::vector<std::string> params         = {};
+    uint32_t                 snapshot_block = 0;
+    uint32_t                 max_results    = 0;
+};
+
+// bin holds the request after the query name: snapshot block (if any), args, first key, last key, max_results
+inline query_call make_query_call(const std::string& schema, const query& query, eosio::input_stream& bin, uint32_t head) {
+    query_call call;
+    call.sql       = "select * from \"" + schema + "\"." + query.function + "(";
+    auto add_param = [&](std::string value) {
+        call.params.push_back(std::move(value));
+        if (call.params.size() > 1)
+            call.sql += ",";
+        call.sql += "$" + std::to_string(call.params.size());
+    };
+    if (query.has_block_snapshot) {
+        uint32_t snapshot_block;
+        from_bin(snapshot_block, bin);
+        call.snapshot_block = std::min(head, snapshot_block);
+        add_param(sql_str(call.snapshot_block));
+    }
+    auto add_args = [&](auto& args) {
+        for (auto& arg : args)
+            add_param(arg.bin_to_param(bin));
+    };
+    add_args(query.arg_types);
+    add_args(query.index_obj->range_types);
+    add_args(query.index_obj->range_types);
+    uint32_t max_results;
+    from_bin(max_results, bin);
+    call.max_results = std::min(max_results, query.max_results);
+    add_param(sql_str(call.max_results));
+    call.sql += ")";
+    return call;
+}
+
+// Appends a result row in abieos binary form. get_field(i) returns column i in binary format, empty if null.
+template <typename F>
+void row_to_bin(std::vector<char>& bin, const query& query, F get_field) {
+    int i = 0;
+    for (size_t field_index = 0; field_index < query.result_fields.size();) {
+        auto& field = query.result_fields[field_index++];
+        auto  value = get_field(i++);
+        field.type_obj->binary_to_bin(bin, value);
+        if (field.begin_optional && (value.empty() || !value[0])) {
+            while (field_index < query.result_fields.size()) {
+                ++field_index;
+                ++i;
+                if (query.result_fields[field_index - 1].end_optional)
+                    break;
+            }
+        }
+    }
+}
+
+// The index's sort key of a result row, or nothing if the query doesn't return every key field
+template <typename F>
+std::optional<std::vector<char>> row_sort_key(const query& query, F get_field) {
+    std::vector<char> key;
+    for (auto& sort_key : query.index_obj->sort_keys) {
+        auto it =
+            std::find_if(query.result_fields.begin(), query.result_fields.end(), [&](auto& f) { return f.name == sort_key.name; });
+        if (it == query.result_fields.end())
+            return {};
+        it->type_obj->binary_to_bin(key, get_field(it - query.result_fields.begin()));
+    }
+    return key;
+}
+
 } // namespace pg
 } // namespace state_history
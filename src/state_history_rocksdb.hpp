@@ -3,9 +3,24 @@
 #pragma once
 #include "state_history_kv.hpp"
 
+#include <atomic>
 #include <boost/filesystem.hpp>
+#include <chrono>
+#include <condition_variable>
 #include <fc/exception/exception.hpp>
+#include <map>
+#include <mutex>
+#include <rocksdb/compaction_filter.h>
 #include <rocksdb/db.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/metadata.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/sst_file_writer.h>
+#include <rocksdb/table.h>
+#include <rocksdb/write_batch.h>
+#include <set>
+#include <shared_mutex>
+#include <thread>
 
 namespace state_history {
 namespace rdb {
@@ -20,17 +35,188 @@ inline void check(rocksdb::Status s, const char* prefix) {
         throw std::runtime_error(std::string(prefix) + s.ToString());
 }
 
+// What a column family holds. Each kind gets options tuned for how it's read.
+enum class family_kind {
+    meta,    // default family: fill_status, received_block, and tables missing from the query config
+    content, // table rows; read by point lookup and by block range
+    journal, // index_journal; read by block range during truncate and trim
+    index,   // one index; read by seeks on key prefixes
+};
+
+struct filter_options {
+    uint32_t bloom_bits   = 10; // bloom filter bits per key; 0 disables bloom filters
+    uint32_t index_prefix = 16; // bytes of sort key included in index prefixes; 0 disables prefix extractors
+};
+
+struct compression_options {
+    std::string upper      = "lz4";    // levels above the bottommost, except L0 and L1
+    std::string bottommost = "zstd";   // bottommost level; holds most of the data
+    uint32_t    dict_bytes = 16 << 10; // bottommost dictionary size; 0 disables dictionaries
+    int         zstd_level = 3;
+};
+
+// rocksdb::DB::Open() rejects types the rocksdb build doesn't support
+inline rocksdb::CompressionType compression_type(const std::string& name) {
+    if (name == "none")
+        return rocksdb::kNoCompression;
+    if (name == "snappy")
+        return rocksdb::kSnappyCompression;
+    if (name == "lz4")
+        return rocksdb::kLZ4Compression;
+    if (name == "zstd")
+        return rocksdb::kZSTD;
+    throw std::runtime_error("unknown compression type: " + name);
+}
+
+// L0 and L1 stay uncompressed; they're small and rewritten often. ZSTD dictionaries are trained on
+// samples of each bottommost compaction's output; names and checksums repeat heavily across blocks.
+inline void set_compression(rocksdb::Options& options, const compression_options& compression) {
+    auto upper = compression_type(compression.upper);
+    for (size_t i = 0; i < options.compression_per_level.size(); ++i)
+        options.compression_per_level[i] = i < 2 ? rocksdb::kNoCompression : upper;
+    options.bottommost_compression                     = compression_type(compression.bottommost);
+    options.bottommost_compression_opts.enabled        = true;
+    options.bottommost_compression_opts.level          = compression.zstd_level;
+    options.bottommost_compression_opts.max_dict_bytes = compression.dict_bytes;
+    options.bottommost_compression_opts.zstd_max_train_bytes =
+        options.bottommost_compression == rocksdb::kZSTD ? compression.dict_bytes * 100 : 0;
+}
+
+// prefix_size: length of the prefixes the family's bloom filters cover, or 0 for whole keys only
+inline rocksdb::ColumnFamilyOptions
+family_options(const rocksdb::Options& base, family_kind kind, const filter_options& filters, size_t prefix_size) {
+    rocksdb::ColumnFamilyOptions    result{base};
+    rocksdb::BlockBasedTableOptions table_options;
+    switch (kind) {
+    case family_kind::index: table_options.block_size = 4 << 10; break;
+    case family_kind::meta: table_options.block_size = 4 << 10; break;
+    case family_kind::content: table_options.block_size = 32 << 10; break;
+    case family_kind::journal: table_options.block_size = 64 << 10; break;
+    }
+    if (filters.bloom_bits)
+        table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(filters.bloom_bits, false));
+    if (prefix_size) {
+        // Index entries are only found by seeking, never by Get(), so whole keys aren't worth filtering
+        result.prefix_extractor.reset(rocksdb::NewCappedPrefixTransform(prefix_size));
+        result.memtable_prefix_bloom_size_ratio = filters.bloom_bits ? 0.05 : 0;
+        table_options.whole_key_filtering       = false;
+    }
+    result.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+    return result;
+}
+
+// Trims history during compaction. Drops the rows, index_journal entries and index entries of
+// history-only tables (those without a trim index) from blocks before watermark. Rows of tables
+// with a trim index are only removed once superseded, which a filter can't see; trim() still
+// deletes those explicitly.
+struct trim_filter : rocksdb::CompactionFilter {
+    std::atomic<uint32_t> watermark = 0; // 0: don't drop anything
+    std::set<uint64_t>    tables    = {}; // short names of history-only tables
+
+    // Whether key may be dropped once the trim point reaches watermark
+    bool drops(rocksdb::Slice key, uint32_t watermark) const {
+        if (!watermark)
+            return false;
+        abieos::input_buffer b{key.data(), key.data() + key.size()};
+        auto                 tag = kv::bin_to_key_tag(b);
+        if (tag == kv::key_tag::table || tag == kv::key_tag::index_journal) {
+            if (b.end - b.pos < 12)
+                return false;
+            auto block = kv::key_to_native<uint32_t>(b);
+            return block < watermark && tables.count(kv::key_to_native<abieos::name>(b).value);
+        }
+        if (tag == kv::key_tag::index) {
+            if (b.end - b.pos < 16 + ptrdiff_t(kv::index_suffix_size))
+                return false;
+            auto                 table = kv::key_to_native<abieos::name>(b);
+            abieos::input_buffer suffix{b.end - kv::index_suffix_size, b.end};
+            return ~kv::key_to_native<uint32_t>(suffix) < watermark && tables.count(table.value);
+        }
+        return false;
+    }
+
+    bool Filter(int, const rocksdb::Slice& key, const rocksdb::Slice&, std::string*, bool*) const override {
+        return drops(key, watermark.load(std::memory_order_relaxed));
+    }
+
+    const char* Name() const override { return "history_tools.trim_filter"; }
+};
+
+// Shared by readers and taken exclusively by one writer. Unlike std::shared_mutex, a waiting writer
+// holds back new readers, so a steady stream of them can't starve it. A reader which already holds
+// the gate must not take it again; pass its hold on instead.
+class catch_up_gate {
+  public:
+    void lock_shared() {
+        std::unique_lock<std::mutex> lock{mutex};
+        cv.wait(lock, [&] { return !writer; });
+        ++readers;
+    }
+
+    void unlock_shared() {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (!--readers && writer)
+            cv.notify_all();
+    }
+
+    void lock() {
+        std::unique_lock<std::mutex> lock{mutex};
+        cv.wait(lock, [&] { return !writer; });
+        writer = true;
+        cv.wait(lock, [&] { return !readers; });
+    }
+
+    void unlock() {
+        std::lock_guard<std::mutex> lock{mutex};
+        writer = false;
+        cv.notify_all();
+    }
+
+  private:
+    std::mutex              mutex;
+    std::condition_variable cv;
+    uint32_t                readers = 0;
+    bool                    writer  = false; // waiting for readers to leave, or holding the gate
+};
+
+// Tables and indexes each live in their own column family, so a wide index doesn't share a
+// memtable and compaction schedule with small hot tables. Keys keep their full encoding
+// (key_tag, names, ...); column_family() picks the family from it.
 struct database {
-    std::shared_ptr<rocksdb::Statistics> stats;
-    std::unique_ptr<rocksdb::DB>         db;
+    std::shared_ptr<rocksdb::Statistics>             stats;
+    trim_filter                                      trim; // must outlive db
+    std::unique_ptr<rocksdb::DB>                     db;
+    std::vector<rocksdb::ColumnFamilyHandle*>        families;
+    rocksdb::ColumnFamilyHandle*                     journal_family = nullptr;
+    std::map<uint64_t, rocksdb::ColumnFamilyHandle*> table_families; // by table short_name
+    std::map<uint64_t, rocksdb::ColumnFamilyHandle*> index_families; // by index short_name
+    std::map<uint32_t, rocksdb::ColumnFamilyHandle*> families_by_id;
+    std::map<uint32_t, size_t>                       prefix_sizes; // by column family id; families with a prefix extractor
+
+    // Read replicas: a secondary instance follows a primary opened by another process. Secondaries
+    // can't read through snapshots, so readers hold lock_for_read() instead.
+    bool                                               secondary = false;
+    catch_up_gate                                      gate      = {};
+    std::atomic<std::chrono::steady_clock::time_point> caught_up = {};
 
-    database(const char* db_path, std::optional<uint32_t> threads, std::optional<uint32_t> max_open_files, bool fast_reads) {
+    // secondary_path: open as a read replica of the primary at db_path, keeping the replica's own
+    // files (info logs) in secondary_path
+    database(
+        const char* db_path, const kv::config& config, std::optional<uint32_t> threads, std::optional<uint32_t> max_open_files,
+        bool fast_reads, const filter_options& filters = {}, const compression_options& compression = {},
+        const char* secondary_path = nullptr)
+        : secondary{secondary_path != nullptr} {
         rocksdb::DB*     p;
         rocksdb::Options options;
         // stats = options.statistics = rocksdb::CreateDBStatistics();
         // stats->set_stats_level(rocksdb::kExceptTimeForMutex);
         // options.stats_dump_period_sec = 2;
-        options.create_if_missing = true;
+        options.create_if_missing              = true;
+        options.create_missing_column_families = true;
+
+        // Writes skip the WAL, so flushes must cover every family at once. Otherwise an index
+        // could reach disk without the rows and index_journal truncate() relies on.
+        options.atomic_flush = true;
 
         options.level_compaction_dynamic_level_bytes = true;
         options.max_background_compactions           = 4;
@@ -41,8 +227,8 @@ struct database {
         if (threads)
             options.IncreaseParallelism(*threads);
         options.OptimizeLevelStyleCompaction(256ull << 20);
-        for (auto& x : options.compression_per_level) // todo: fix snappy build
-            x = rocksdb::kNoCompression;
+        options.db_write_buffer_size = 1ull << 30; // shared by every family's memtables
+        set_compression(options, compression);
 
         if (fast_reads) {
             ilog("open ${p}: fast reader mode; writes will be slower", ("p", db_path));
@@ -53,10 +239,84 @@ struct database {
         }
         if (max_open_files)
             options.max_open_files = *max_open_files;
+        if (secondary) {
+            ilog("open ${p}: secondary instance in ${s}", ("p", db_path)("s", secondary_path));
+            options.max_open_files = -1; // required by secondary instances
+        }
+
+        // family name -> kind, short_name
+        std::map<std::string, std::pair<family_kind, uint64_t>> family_names;
+        std::map<std::string, size_t>                           family_prefix_sizes;
+        family_names["default"] = {family_kind::meta, 0};
+        family_names["journal"] = {family_kind::journal, 0};
+        for (auto& table : config.tables)
+            family_names["table." + table.name] = {family_kind::content, table.short_name.value};
+        for (auto& index : config.indexes) {
+            family_names["index." + index.index] = {family_kind::index, index.short_name.value};
 
-        check(rocksdb::DB::Open(options, db_path, &p), "rocksdb::DB::Open: ");
+            // The prefix must stop short of the first variable-width sort key; seeks within an index
+            // key then stay within one prefix.
+            auto sort_key_size = std::min<size_t>(filters.index_prefix, kv::fixed_sort_key_size(index));
+            if (sort_key_size)
+                family_prefix_sizes["index." + index.index] = kv::make_index_key(abieos::name{}, abieos::name{}).size() + sort_key_size;
+        }
+
+        // Every existing family must be opened, including ones the current config no longer has
+        std::vector<std::string> existing;
+        auto                     list_status = rocksdb::DB::ListColumnFamilies(options, db_path, &existing);
+        if (list_status.ok())
+            for (auto& name : existing)
+                if (family_names.find(name) == family_names.end())
+                    family_names[name] = {name.compare(0, 6, "index.") ? family_kind::content : family_kind::index, 0};
+
+        // A secondary can't create families. Until it's restarted, tables and indexes the primary
+        // hasn't created yet map to the default family, which doesn't hold them.
+        if (secondary) {
+            check(list_status, "rocksdb::DB::ListColumnFamilies: ");
+            std::set<std::string> existing_set{existing.begin(), existing.end()};
+            for (auto it = family_names.begin(); it != family_names.end();)
+                it = existing_set.count(it->first) ? std::next(it) : family_names.erase(it);
+        }
+
+        // received_block rows have no index_journal; trim() has never removed them
+        for (auto& table : config.tables)
+            if (!table.trim_index_obj && table.name != "received_block")
+                trim.tables.insert(table.short_name.value);
+
+        std::vector<rocksdb::ColumnFamilyDescriptor> descriptors;
+        for (auto& [name, kind] : family_names) {
+            descriptors.emplace_back(name, family_options(options, kind.first, filters, family_prefix_sizes[name]));
+            if (kind.first != family_kind::meta)
+                descriptors.back().options.compaction_filter = &trim;
+        }
+        if (secondary)
+            check(
+                rocksdb::DB::OpenAsSecondary(options, db_path, secondary_path, descriptors, &families, &p),
+                "rocksdb::DB::OpenAsSecondary: ");
+        else
+            check(rocksdb::DB::Open(options, db_path, descriptors, &families, &p), "rocksdb::DB::Open: ");
         db.reset(p);
-        ilog("database opened");
+        caught_up = std::chrono::steady_clock::now();
+
+        size_t i = 0;
+        for (auto& [name, kind] : family_names) {
+            auto* handle                    = families[i++];
+            families_by_id[handle->GetID()] = handle;
+            if (family_prefix_sizes[name])
+                prefix_sizes[handle->GetID()] = family_prefix_sizes[name];
+            if (name == "journal")
+                journal_family = handle;
+            else if (kind.second && kind.first == family_kind::content)
+                table_families[kind.second] = handle;
+            else if (kind.second && kind.first == family_kind::index)
+                index_families[kind.second] = handle;
+        }
+        ilog("database opened with ${n} column families", ("n", families.size()));
+    }
+
+    ~database() {
+        for (auto* handle : families)
+            db->DestroyColumnFamilyHandle(handle);
     }
 
     database(const database&) = delete;
@@ -64,14 +324,120 @@ struct database {
     database& operator=(const database&) = delete;
     database& operator=(database&&) = delete;
 
+    // Keeps catch_up() from changing what the caller reads until the result is destroyed. Does
+    // nothing on primaries; use a snapshot there. Waits while a catch_up() is pending.
+    std::shared_lock<rdb::catch_up_gate> lock_for_read() {
+        if (!secondary)
+            return {};
+        return std::shared_lock{gate};
+    }
+
+    // Secondary instances: apply what the primary has flushed since the last call. Waits for the
+    // current readers to finish; new ones wait until it's done.
+    void catch_up() {
+        std::unique_lock lock{gate};
+        check(db->TryCatchUpWithPrimary(), "TryCatchUpWithPrimary: ");
+        caught_up = std::chrono::steady_clock::now();
+    }
+
+    // Secondary instances: time since the last catch_up(). 0 for primaries.
+    uint32_t lag_ms() const {
+        if (!secondary)
+            return 0;
+        auto lag = std::chrono::steady_clock::now() - caught_up.load();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(lag).count();
+    }
+
     void flush(bool allow_write_stall, bool wait) {
         rocksdb::FlushOptions op;
         op.allow_write_stall = allow_write_stall;
         op.wait              = wait;
-        db->Flush(op);
+        db->Flush(op, families);
+    }
+
+    // The family which holds key. Keys too short to name their table or index map to the default
+    // family, as do tables and indexes the query config doesn't define.
+    rocksdb::ColumnFamilyHandle* column_family(abieos::input_buffer key) const {
+        if (key.pos == key.end)
+            return db->DefaultColumnFamily();
+        auto tag = kv::bin_to_key_tag(key);
+        if (tag == kv::key_tag::index_journal)
+            return journal_family;
+        if (tag == kv::key_tag::table && key.end - key.pos >= 12) {
+            key.pos += 4; // block_num
+            auto it = table_families.find(kv::key_to_native<abieos::name>(key).value);
+            if (it != table_families.end())
+                return it->second;
+        }
+        if (tag == kv::key_tag::index && key.end - key.pos >= 16) {
+            key.pos += 8; // table_name
+            auto it = index_families.find(kv::key_to_native<abieos::name>(key).value);
+            if (it != index_families.end())
+                return it->second;
+        }
+        return db->DefaultColumnFamily();
+    }
+
+    rocksdb::ColumnFamilyHandle* column_family(const std::vector<char>& key) const {
+        return column_family(abieos::input_buffer{key.data(), key.data() + key.size()});
+    }
+
+    rocksdb::ColumnFamilyHandle* column_family(rocksdb::Slice key) const {
+        return column_family(abieos::input_buffer{key.data(), key.data() + key.size()});
+    }
+
+    // Prefix length of family's prefix extractor, or 0 if it has none
+    size_t prefix_size(rocksdb::ColumnFamilyHandle* family) const {
+        auto it = prefix_sizes.find(family->GetID());
+        return it == prefix_sizes.end() ? 0 : it->second;
+    }
+
+    // Every family which may hold keys with this tag
+    std::vector<rocksdb::ColumnFamilyHandle*> column_families(kv::key_tag tag) const {
+        if (tag == kv::key_tag::index_journal)
+            return {journal_family};
+        std::vector<rocksdb::ColumnFamilyHandle*> result{db->DefaultColumnFamily()};
+        for (auto& [_, handle] : tag == kv::key_tag::table ? table_families : index_families)
+            result.push_back(handle);
+        return result;
     }
 };
 
+// Options for iterators whose range may cross prefixes. Without total_order_seek, an iterator on a
+// family with a prefix extractor may skip keys outside the prefix of its last Seek().
+inline rocksdb::ReadOptions total_order_options() {
+    rocksdb::ReadOptions result;
+    result.total_order_seek = true;
+    return result;
+}
+
+// Keys which split family into ranges of roughly range_bytes each, in order. They are the first
+// keys of SST files in family's largest level, so finding them doesn't read any data.
+inline std::vector<std::string> split_points(database& db, rocksdb::ColumnFamilyHandle* family, uint64_t range_bytes) {
+    rocksdb::ColumnFamilyMetaData meta;
+    db.db->GetColumnFamilyMetaData(family, &meta);
+    const rocksdb::LevelMetaData* largest = nullptr;
+    for (auto& level : meta.levels)
+        if (!largest || level.size > largest->size)
+            largest = &level;
+    std::vector<std::string> result;
+    if (!largest || !range_bytes)
+        return result;
+    std::vector<const rocksdb::SstFileMetaData*> files;
+    for (auto& f : largest->files)
+        files.push_back(&f);
+    std::sort(files.begin(), files.end(), [](auto* a, auto* b) { return a->smallestkey < b->smallestkey; });
+    uint64_t bytes = 0;
+    for (auto* f : files) {
+        if (bytes >= range_bytes) {
+            result.push_back(f->smallestkey);
+            bytes = 0;
+        }
+        bytes += f->size;
+    }
+    return result;
+}
+
 inline rocksdb::Slice to_slice(const std::vector<char>& v) { return {v.data(), v.size()}; }
 
 inline rocksdb::Slice to_slice(abieos::input_buffer v) { return {v.pos, size_t(v.end - v.pos)}; }
@@ -80,14 +446,32 @@ inline abieos::input_buffer to_input_buffer(rocksdb::Slice v) { return {v.data()
 
 inline abieos::input_buffer to_input_buffer(rocksdb::PinnableSlice& v) { return {v.data(), v.data() + v.size()}; }
 
-inline void put(rocksdb::WriteBatch& batch, const std::vector<char>& key, const std::vector<char>& value, bool overwrite = false) {
+inline void
+put(database& db, rocksdb::WriteBatch& batch, const std::vector<char>& key, const std::vector<char>& value, bool overwrite = false) {
     // !!! remove overwrite
-    batch.Put(to_slice(key), to_slice(value));
+    batch.Put(db.column_family(key), to_slice(key), to_slice(value));
 }
 
 template <typename T>
-void put(rocksdb::WriteBatch& batch, const std::vector<char>& key, const T& value, bool overwrite = false) {
-    put(batch, key, abieos::native_to_bin(value), overwrite);
+void put(database& db, rocksdb::WriteBatch& batch, const std::vector<char>& key, const T& value, bool overwrite = false) {
+    put(db, batch, key, abieos::native_to_bin(value), overwrite);
+}
+
+inline void erase(database& db, rocksdb::WriteBatch& batch, abieos::input_buffer key) {
+    batch.Delete(db.column_family(key), to_slice(key));
+}
+
+inline void erase(database& db, rocksdb::WriteBatch& batch, const std::vector<char>& key) {
+    batch.Delete(db.column_family(key), to_slice(key));
+}
+
+// Erase keys in range [lower_bound, upper_bound], inclusive, with a range tombstone in each
+// family which may hold them. Like for_each(), lower_bound and upper_bound may be partial keys.
+inline void delete_range(database& db, rocksdb::WriteBatch& batch, const std::vector<char>& lower_bound, std::vector<char> upper_bound) {
+    kv::inc_key(upper_bound);
+    abieos::input_buffer tag{lower_bound.data(), lower_bound.data() + lower_bound.size()};
+    for (auto* family : db.column_families(kv::bin_to_key_tag(tag)))
+        check(batch.DeleteRange(family, to_slice(lower_bound), to_slice(upper_bound)), "delete_range: ");
 }
 
 inline void write(database& db, rocksdb::WriteBatch& batch) {
@@ -98,9 +482,127 @@ inline void write(database& db, rocksdb::WriteBatch& batch) {
     batch.Clear();
 }
 
+// Collects the puts from write batches, then loads them into the database as sorted SST files
+// instead of through the memtables. Only suitable for keys nothing else is writing; batches
+// containing deletes are rejected.
+struct bulk_ingester {
+    using entry = std::pair<std::string, std::string>;
+
+    std::map<uint32_t, std::vector<entry>> families = {}; // by column family id
+    size_t                                 size     = 0;
+    size_t                                 bytes    = 0;
+
+    bool empty() const { return !size; }
+
+    // Move the contents of batch into the ingester
+    void add(rocksdb::WriteBatch& batch) {
+        struct handler : rocksdb::WriteBatch::Handler {
+            bulk_ingester& self;
+
+            handler(bulk_ingester& self)
+                : self{self} {}
+
+            rocksdb::Status PutCF(uint32_t family, const rocksdb::Slice& key, const rocksdb::Slice& value) override {
+                self.families[family].emplace_back(key.ToString(), value.ToString());
+                ++self.size;
+                self.bytes += key.size() + value.size();
+                return rocksdb::Status::OK();
+            }
+
+            rocksdb::Status DeleteCF(uint32_t, const rocksdb::Slice&) override {
+                return rocksdb::Status::NotSupported("bulk_ingester: delete");
+            }
+
+            rocksdb::Status DeleteRangeCF(uint32_t, const rocksdb::Slice&, const rocksdb::Slice&) override {
+                return rocksdb::Status::NotSupported("bulk_ingester: delete range");
+            }
+        } h{*this};
+        check(batch.Iterate(&h), "bulk_ingester: ");
+        batch.Clear();
+    }
+
+    // Sort, write SST files into dir on up to num_threads threads, and ingest them into all
+    // families at once. Later puts of the same key win, as they would in a write batch.
+    void ingest(database& db, const std::string& dir, unsigned num_threads) {
+        if (empty())
+            return;
+
+        struct file {
+            rocksdb::ColumnFamilyHandle* family;
+            const std::vector<entry>*    entries;
+            size_t                       begin, end;
+            std::string                  path;
+            std::string                  error;
+        };
+        std::vector<file> files;
+        for (auto& [id, entries] : families) {
+            std::stable_sort(entries.begin(), entries.end(), [](auto& a, auto& b) { return a.first < b.first; });
+            size_t dest = 0;
+            for (size_t i = 0; i < entries.size(); ++i) {
+                if (i + 1 < entries.size() && entries[i].first == entries[i + 1].first)
+                    continue;
+                if (dest != i)
+                    entries[dest] = std::move(entries[i]);
+                ++dest;
+            }
+            entries.resize(dest);
+
+            auto it = db.families_by_id.find(id);
+            if (it == db.families_by_id.end())
+                throw std::runtime_error("bulk_ingester: unknown column family " + std::to_string(id));
+            size_t num_files = std::max<size_t>(1, std::min<size_t>(num_threads, entries.size() / 10000));
+            for (size_t f = 0; f < num_files; ++f)
+                files.push_back(file{
+                    it->second, &entries, entries.size() * f / num_files, entries.size() * (f + 1) / num_files,
+                    dir + "/" + std::to_string(files.size()) + ".sst"});
+        }
+
+        boost::filesystem::create_directories(dir);
+        std::atomic<size_t>      next = 0;
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < std::max(1u, num_threads); ++t) {
+            threads.emplace_back([&] {
+                for (size_t i; (i = next++) < files.size();) {
+                    auto& f = files[i];
+                    try {
+                        rocksdb::SstFileWriter writer{rocksdb::EnvOptions{}, db.db->GetOptions(f.family)};
+                        check(writer.Open(f.path), "SstFileWriter::Open: ");
+                        for (auto j = f.begin; j < f.end; ++j)
+                            check(writer.Put((*f.entries)[j].first, (*f.entries)[j].second), "SstFileWriter::Put: ");
+                        check(writer.Finish(), "SstFileWriter::Finish: ");
+                    } catch (std::exception& e) {
+                        f.error = e.what();
+                    }
+                }
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+        for (auto& f : files)
+            if (!f.error.empty())
+                throw std::runtime_error(f.error);
+
+        std::vector<rocksdb::IngestExternalFileArg> args;
+        for (auto& f : files) {
+            if (args.empty() || args.back().column_family != f.family) {
+                args.emplace_back();
+                args.back().column_family      = f.family;
+                args.back().options.move_files = true;
+            }
+            args.back().external_files.push_back(f.path);
+        }
+        check(db.db->IngestExternalFiles(args), "IngestExternalFiles: ");
+        for (auto& f : files)
+            boost::filesystem::remove(f.path);
+        families.clear();
+        size  = 0;
+        bytes = 0;
+    }
+};
+
 inline bool exists(database& db, rocksdb::Slice key) {
     rocksdb::PinnableSlice v;
-    auto                   stat = db.db->Get(rocksdb::ReadOptions(), db.db->DefaultColumnFamily(), key, &v);
+    auto                   stat = db.db->Get(rocksdb::ReadOptions(), db.column_family(key), key, &v);
     if (stat.IsNotFound())
         return false;
     check(stat, "exists: ");
@@ -135,7 +637,7 @@ std::optional<T> get(rocksdb::Iterator& it, const std::vector<char>& key, bool r
 template <typename T>
 std::optional<T> get(database& db, const std::vector<char>& key, bool required) {
     rocksdb::PinnableSlice v;
-    auto                   stat = db.db->Get(rocksdb::ReadOptions(), db.db->DefaultColumnFamily(), to_slice(key), &v);
+    auto                   stat = db.db->Get(rocksdb::ReadOptions(), db.column_family(key), to_slice(key), &v);
     if (stat.IsNotFound() && !required)
         return {};
     check(stat, "get: ");
@@ -161,9 +663,13 @@ void for_each(rocksdb::Iterator& it, const std::vector<char>& lower_bound, const
     check(it.status(), "for_each: ");
 }
 
+// lower_bound and upper_bound must be within a single column family
 template <typename F>
 void for_each(database& db, const std::vector<char>& lower_bound, const std::vector<char>& upper_bound, F f) {
-    std::unique_ptr<rocksdb::Iterator> it{db.db->NewIterator(rocksdb::ReadOptions())};
+    auto* family = db.column_family(lower_bound);
+    if (family != db.column_family(upper_bound))
+        throw std::runtime_error("for_each: range spans column families");
+    std::unique_ptr<rocksdb::Iterator> it{db.db->NewIterator(total_order_options(), family)};
     for_each(*it, lower_bound, upper_bound, f);
 }
 
@@ -193,9 +699,13 @@ void for_each_subkey(rocksdb::Iterator& it, std::vector<char> lower_bound, const
     check(it.status(), "for_each_subkey: ");
 }
 
+// lower_bound and upper_bound must be within a single column family
 template <typename F>
 void for_each_subkey(database& db, std::vector<char> lower_bound, const std::vector<char>& upper_bound, F f) {
-    std::unique_ptr<rocksdb::Iterator> it{db.db->NewIterator(rocksdb::ReadOptions())};
+    auto* family = db.column_family(lower_bound);
+    if (family != db.column_family(upper_bound))
+        throw std::runtime_error("for_each_subkey: range spans column families");
+    std::unique_ptr<rocksdb::Iterator> it{db.db->NewIterator(total_order_options(), family)};
     for_each_subkey(*it, std::move(lower_bound), upper_bound, f);
 }
 
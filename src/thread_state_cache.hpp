@@ -0,0 +1,69 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace wasm_ql {
+
+// Each thread keeps the last state it used, so the common case takes no lock and the state
+// (and its wasm memory) stays with one thread. States released while a thread's slot is
+// occupied, e.g. when a handler hands off to another thread, go to a shared overflow pool.
+template <typename State>
+class basic_thread_state_cache {
+  private:
+    struct local_slot {
+        uint64_t               owner = 0; // basic_thread_state_cache::id
+        std::unique_ptr<State> state;
+    };
+
+    static local_slot& local() {
+        static thread_local local_slot slot;
+        return slot;
+    }
+
+    static inline std::atomic<uint64_t> next_id = 1;
+
+    const uint64_t                          id = next_id++;
+    std::mutex                              mutex;
+    std::function<std::unique_ptr<State>()> make_state;
+    std::vector<std::unique_ptr<State>>     overflow;
+
+  public:
+    explicit basic_thread_state_cache(std::function<std::unique_ptr<State>()> make_state)
+        : make_state(std::move(make_state)) {}
+
+    std::unique_ptr<State> get_state() {
+        auto& slot = local();
+        if (slot.owner == id && slot.state)
+            return std::move(slot.state);
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (!overflow.empty()) {
+                auto result = std::move(overflow.back());
+                overflow.pop_back();
+                return result;
+            }
+        }
+        return make_state();
+    }
+
+    void store_state(std::unique_ptr<State> state) {
+        auto& slot = local();
+        if (slot.owner != id)
+            slot = {id};
+        if (!slot.state) {
+            slot.state = std::move(state);
+            return;
+        }
+        std::lock_guard<std::mutex> lock{mutex};
+        overflow.push_back(std::move(state));
+    }
+};
+
+} // namespace wasm_ql
@@ -0,0 +1,115 @@
+// copyright defined in LICENSE.txt
+
+// Measures thread_state_cache get_state()/store_state() round trips from many threads at once,
+// against the single-mutex pool it replaced. Each thread alternates between its own state and
+// a handoff, where it releases a state it didn't take (as a handler does when it moves to
+// another thread), so the overflow path is exercised too.
+
+#include "thread_state_cache.hpp"
+
+#include <boost/program_options.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+namespace bpo = boost::program_options;
+
+// Stands in for wasm_ql::thread_state; only its lifetime matters here
+struct bench_state {
+    char memory[4096] = {};
+};
+
+// The original cache: one pool behind one mutex
+template <typename State>
+class mutex_state_cache {
+    std::mutex                          mutex;
+    std::vector<std::unique_ptr<State>> states;
+
+  public:
+    std::unique_ptr<State> get_state() {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (states.empty())
+            return std::make_unique<State>();
+        auto result = std::move(states.back());
+        states.pop_back();
+        return result;
+    }
+
+    void store_state(std::unique_ptr<State> state) {
+        std::lock_guard<std::mutex> lock{mutex};
+        states.push_back(std::move(state));
+    }
+};
+
+// Returns round trips per second across all threads
+template <typename Cache>
+static double run(Cache& cache, int num_threads, uint64_t iterations, uint32_t handoff_every) {
+    std::atomic<int>         ready = 0;
+    std::atomic<bool>        go    = false;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&] {
+            ++ready;
+            while (!go)
+                std::this_thread::yield();
+            for (uint64_t i = 0; i < iterations; ++i) {
+                auto state = cache.get_state();
+                state->memory[i % sizeof(state->memory)]++;
+                if (handoff_every && i % handoff_every == 0) {
+                    // Release an extra state, as if another thread's work finished here
+                    auto other = cache.get_state();
+                    cache.store_state(std::move(other));
+                }
+                cache.store_state(std::move(state));
+            }
+        });
+    }
+    while (ready < num_threads)
+        std::this_thread::yield();
+    auto start = std::chrono::steady_clock::now();
+    go         = true;
+    for (auto& t : threads)
+        t.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return num_threads * iterations / elapsed;
+}
+
+int main(int argc, char** argv) {
+    try {
+        bpo::options_description desc{"Options"};
+        auto                     op = desc.add_options();
+        op("help,h", "Show this message");
+        op("threads,t", bpo::value<std::vector<int>>()->multitoken(), "Thread counts to measure (default: 1 8 32 64)");
+        op("iterations,i", bpo::value<uint64_t>()->default_value(1'000'000), "Round trips per thread");
+        op("handoff-every", bpo::value<uint32_t>()->default_value(16), "Release a second state every N round trips (0: never)");
+
+        bpo::variables_map vm;
+        bpo::store(bpo::parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            std::cout << "Usage: thread-state-cache-bench [options]\n\n" << desc;
+            return 0;
+        }
+        bpo::notify(vm);
+
+        std::vector<int> thread_counts = {1, 8, 32, 64};
+        if (vm.count("threads"))
+            thread_counts = vm["threads"].as<std::vector<int>>();
+        auto iterations    = vm["iterations"].as<uint64_t>();
+        auto handoff_every = vm["handoff-every"].as<uint32_t>();
+
+        printf("%8s %16s %16s %8s\n", "threads", "mutex ops/s", "per-thread ops/s", "speedup");
+        for (auto num_threads : thread_counts) {
+            mutex_state_cache<bench_state>                 old_cache;
+            wasm_ql::basic_thread_state_cache<bench_state> new_cache{[] { return std::make_unique<bench_state>(); }};
+            auto old_rate = run(old_cache, num_threads, iterations, handoff_every);
+            auto new_rate = run(new_cache, num_threads, iterations, handoff_every);
+            printf("%8d %16.0f %16.0f %7.1fx\n", num_threads, old_rate, new_rate, new_rate / old_rate);
+        }
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 2;
+    }
+}
@@ -2,13 +2,33 @@
 
 #include "wasm_ql.hpp"
 
+#include <boost/asio/post.hpp>
 #include <fc/log/logger.hpp>
 #include <fc/scoped_exit.hpp>
 
+#include <algorithm>
+#include <condition_variable>
+
 using namespace abieos::literals;
+using namespace std::literals;
 
 namespace wasm_ql {
 
+// append_output_data hands the reply to thread_state.output_sink in pieces of at least this size
+static constexpr size_t output_chunk_size = 64 * 1024;
+
+static void check_deadline(const wasm_ql::thread_state& thread_state) {
+    if (std::chrono::steady_clock::now() > thread_state.deadline)
+        throw std::runtime_error("query timed out");
+}
+
+static void start_deadline(wasm_ql::thread_state& thread_state) {
+    if (thread_state.shared->query_timeout_ms)
+        thread_state.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(thread_state.shared->query_timeout_ms);
+    else
+        thread_state.deadline = std::chrono::steady_clock::time_point::max();
+}
+
 struct callbacks;
 using backend_t = eosio::vm::backend<callbacks>;
 using rhf_t     = eosio::vm::registered_host_functions<callbacks>;
@@ -54,13 +74,33 @@ struct callbacks {
 
     void set_output_data(const char* begin, const char* end) {
         check_bounds(begin, end);
+        if (thread_state.streamed)
+            throw std::runtime_error("set_output_data called after output was streamed");
         thread_state.reply.assign(begin, end);
     }
 
+    void append_output_data(const char* begin, const char* end) {
+        check_bounds(begin, end);
+        check_deadline(thread_state);
+        thread_state.reply.insert(thread_state.reply.end(), begin, end);
+        if (thread_state.output_sink && thread_state.reply.size() >= output_chunk_size) {
+            // Handing chunks to the network thread is the serialize phase of a streamed reply
+            scoped_timer timer{thread_state.timing.serialize_ns};
+            thread_state.streamed = true;
+            thread_state.output_sink(std::move(thread_state.reply));
+            thread_state.reply.clear();
+        }
+    }
+
     void query_database(const char* req_begin, const char* req_end, uint32_t cb_alloc_data, uint32_t cb_alloc) {
         check_bounds(req_begin, req_end);
-        auto result = thread_state.query_session->query_database({req_begin, req_end}, thread_state.fill_status.head);
-        auto data   = alloc(cb_alloc_data, cb_alloc, result.size());
+        check_deadline(thread_state);
+        std::vector<char> result;
+        {
+            scoped_timer timer{thread_state.timing.database_ns};
+            result = thread_state.query_session->query_database({req_begin, req_end}, thread_state.fill_status.head);
+        }
+        auto data = alloc(cb_alloc_data, cb_alloc, result.size());
         memcpy(data, result.data(), result.size());
     }
 
@@ -73,6 +113,7 @@ struct callbacks {
 
 void register_callbacks() {
     rhf_t::add<callbacks, &callbacks::abort, eosio::vm::wasm_allocator>("env", "abort");
+    rhf_t::add<callbacks, &callbacks::append_output_data, eosio::vm::wasm_allocator>("env", "append_output_data");
     rhf_t::add<callbacks, &callbacks::eosio_assert_message, eosio::vm::wasm_allocator>("env", "eosio_assert_message");
     rhf_t::add<callbacks, &callbacks::get_database_status, eosio::vm::wasm_allocator>("env", "get_database_status");
     rhf_t::add<callbacks, &callbacks::get_input_data, eosio::vm::wasm_allocator>("env", "get_input_data");
@@ -92,7 +133,8 @@ static void fill_context_data(wasm_ql::thread_state& thread_state) {
 
 // todo: detect thread_state.fill_status.first changing (history trim)
 static bool did_fork(wasm_ql::thread_state& thread_state) {
-    auto id = thread_state.query_session->get_block_id(thread_state.fill_status.head);
+    scoped_timer timer{thread_state.timing.database_ns};
+    auto         id = thread_state.query_session->get_block_id(thread_state.fill_status.head);
     if (!id) {
         ilog("fork detected (prev head not found)");
         return true;
@@ -106,11 +148,19 @@ static bool did_fork(wasm_ql::thread_state& thread_state) {
 
 template <typename F>
 static void retry_loop(wasm_ql::thread_state& thread_state, F f) {
+    if (!thread_state.database)
+        throw std::runtime_error("no database for this request");
     int num_tries = 0;
     while (true) {
-        auto exit                  = fc::make_scoped_exit([&] { thread_state.query_session.reset(); });
-        thread_state.query_session = thread_state.shared->db_iface->create_query_session();
-        thread_state.fill_status   = thread_state.query_session->get_fill_status();
+        check_deadline(thread_state);
+        auto exit = fc::make_scoped_exit([&] { thread_state.query_session.reset(); });
+        {
+            scoped_timer timer{thread_state.timing.database_ns};
+            thread_state.query_session = thread_state.database->db_iface->create_query_session();
+            thread_state.query_session->set_deadline(thread_state.deadline);
+            thread_state.fill_status   = thread_state.query_session->get_fill_status();
+        }
+        thread_state.shared->metrics->record_status(thread_state.database->name, thread_state.fill_status);
         if (!thread_state.fill_status.head)
             throw std::runtime_error("database is empty");
         fill_context_data(thread_state);
@@ -122,54 +172,427 @@ static void retry_loop(wasm_ql::thread_state& thread_state, F f) {
     }
 }
 
+static uint64_t ns_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Adds the time until destruction, less any database time, to timing.execute_ns
+class execute_timer {
+  public:
+    explicit execute_timer(query_timing& timing)
+        : timing{timing}
+        , other_ns{other(timing)} {}
+
+    ~execute_timer() {
+        auto elapsed = ns_since(start);
+        timing.execute_ns += elapsed - std::min(elapsed, other(timing) - other_ns);
+    }
+
+  private:
+    // Time spent in the database or streaming out the reply, which the wasm runs through
+    static uint64_t other(const query_timing& timing) { return timing.database_ns + timing.serialize_ns; }
+
+    query_timing&                         timing;
+    uint64_t                              other_ns;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
 static void run_query(wasm_ql::thread_state& thread_state, abieos::name short_name) {
+    auto      start = std::chrono::steady_clock::now();
     auto      code = backend_t::read_wasm(thread_state.shared->wasm_dir + "/" + (std::string)short_name + "-server.wasm");
     backend_t backend(code);
     callbacks cb{thread_state, backend};
     backend.set_wasm_allocator(&thread_state.wa);
+    thread_state.reply.clear();
 
     rhf_t::resolve(backend.get_module());
     backend.initialize(&cb);
-    backend(&cb, "env", "initialize");
-    backend(&cb, "env", "run_query");
+    thread_state.timing.load_ns += ns_since(start);
+
+    execute_timer timer{thread_state.timing};
+    auto          run = [&] {
+        backend(&cb, "env", "initialize");
+        backend(&cb, "env", "run_query");
+    };
+    if (thread_state.deadline == std::chrono::steady_clock::time_point::max() || !thread_state.shared->watchdog)
+        return run();
+
+    // The host callbacks check the deadline too, but a wasm which doesn't call them needs the watchdog
+    check_deadline(thread_state);
+    backend.timed_run(thread_state.shared->watchdog->at(thread_state.deadline), run);
+}
+
+// Runs one sub-request of a batch. Returns false if a fork was detected.
+static bool run_batch_item(wasm_ql::thread_state& thread_state, abieos::input_buffer request, std::vector<char>& reply) {
+    thread_state.request = request;
+    auto ns_name         = abieos::bin_to_native<abieos::name>(thread_state.request);
+    if (ns_name != "local"_n)
+        throw std::runtime_error("unknown namespace: " + (std::string)ns_name);
+    auto short_name = abieos::bin_to_native<abieos::name>(thread_state.request);
+
+    auto& metrics       = thread_state.shared->metrics->get(thread_state.database->name, (std::string)short_name);
+    thread_state.timing = {};
+    try {
+        run_query(thread_state, short_name);
+        if (did_fork(thread_state)) {
+            metrics.record_fork();
+            return false;
+        }
+    } catch (...) {
+        metrics.record(thread_state.timing, true);
+        throw;
+    }
+    metrics.record(thread_state.timing, false);
+    reply = std::move(thread_state.reply);
+    return true;
+}
+
+std::unique_ptr<thread_state> make_thread_state(const std::shared_ptr<const shared_state>& shared) {
+    static constexpr size_t wasm_page_size = 64 * 1024;
+
+    auto result    = std::make_unique<thread_state>();
+    result->shared = shared;
+    // eos-vm reserves wasm memory PROT_NONE and only maps it as modules grow into it, so a new
+    // state's first queries would page-fault their way through it. reset() zeroes the pages it
+    // unlocked, which faults them in; they stay resident when they're protected again.
+    if (auto pages = shared->prefault_bytes / wasm_page_size) {
+        result->wa.alloc<char>(pages);
+        result->wa.reset(pages);
+    }
+    return result;
+}
+
+std::unique_ptr<thread_state> batch_executor::get_state(const thread_state& parent) {
+    std::unique_ptr<thread_state> result;
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (!states.empty()) {
+            result = std::move(states.back());
+            states.pop_back();
+        }
+    }
+    if (!result)
+        result = make_thread_state(parent.shared);
+    result->shared          = parent.shared;
+    result->fill_status     = parent.fill_status;
+    result->database_status = parent.database_status;
+    result->deadline        = parent.deadline;
+    result->database        = parent.database;
+    return result;
+}
+
+void batch_executor::store_state(std::unique_ptr<thread_state> state) {
+    std::lock_guard<std::mutex> lock{mutex};
+    states.push_back(std::move(state));
+}
+
+bool batch_executor::run(thread_state& parent, const std::vector<abieos::input_buffer>& requests, std::vector<std::vector<char>>& replies) {
+    std::mutex              done_mutex;
+    std::condition_variable done_cv;
+    size_t                  remaining = requests.size();
+    bool                    ok        = true;
+    std::exception_ptr      error;
+
+    for (size_t i = 0; i < requests.size(); ++i) {
+        boost::asio::post(pool, [&, i] {
+            bool               item_ok = false;
+            std::exception_ptr item_error;
+            auto               state = get_state(parent);
+            try {
+                auto exit            = fc::make_scoped_exit([&] { state->query_session.reset(); });
+                state->query_session = parent.database->db_iface->create_child_session(*parent.query_session);
+                state->query_session->set_deadline(state->deadline);
+                item_ok              = run_batch_item(*state, requests[i], replies[i]);
+            } catch (...) {
+                item_error = std::current_exception();
+            }
+            store_state(std::move(state));
+
+            std::lock_guard<std::mutex> lock{done_mutex};
+            ok = ok && item_ok;
+            if (item_error && !error)
+                error = item_error;
+            if (!--remaining)
+                done_cv.notify_one();
+        });
+    }
+
+    std::unique_lock<std::mutex> lock{done_mutex};
+    done_cv.wait(lock, [&] { return !remaining; });
+    if (error)
+        std::rethrow_exception(error);
+    return ok;
 }
 
 std::vector<char> query(wasm_ql::thread_state& thread_state, const std::vector<char>& request) {
     std::vector<char> result;
+    start_deadline(thread_state);
     retry_loop(thread_state, [&]() {
         abieos::input_buffer request_bin{request.data(), request.data() + request.size()};
         auto                 num_requests = abieos::bin_to_native<abieos::varuint32>(request_bin).value;
-        result.clear();
-        abieos::push_varuint32(result, num_requests);
-        for (uint32_t request_index = 0; request_index < num_requests; ++request_index) {
-            thread_state.request = abieos::bin_to_native<abieos::input_buffer>(request_bin);
-            auto ns_name         = abieos::bin_to_native<abieos::name>(thread_state.request);
-            if (ns_name != "local"_n)
-                throw std::runtime_error("unknown namespace: " + (std::string)ns_name);
-            auto short_name = abieos::bin_to_native<abieos::name>(thread_state.request);
-
-            run_query(thread_state, short_name);
-            if (did_fork(thread_state))
+
+        std::vector<abieos::input_buffer> requests;
+        for (uint32_t request_index = 0; request_index < num_requests; ++request_index)
+            requests.push_back(abieos::bin_to_native<abieos::input_buffer>(request_bin));
+
+        std::vector<std::vector<char>> replies(requests.size());
+        if (thread_state.shared->batch && requests.size() > 1) {
+            if (!thread_state.shared->batch->run(thread_state, requests, replies))
                 return false;
+        } else {
+            for (size_t i = 0; i < requests.size(); ++i)
+                if (!run_batch_item(thread_state, requests[i], replies[i]))
+                    return false;
+        }
 
-            // elog("result: ${s} ${x}", ("s", thread_state.reply.size())("x", fc::to_hex(thread_state.reply)));
-            abieos::push_varuint32(result, thread_state.reply.size());
-            result.insert(result.end(), thread_state.reply.begin(), thread_state.reply.end());
+        // elog("result: ${s} ${x}", ("s", thread_state.reply.size())("x", fc::to_hex(thread_state.reply)));
+        result.clear();
+        abieos::push_varuint32(result, num_requests);
+        for (auto& reply : replies) {
+            abieos::push_varuint32(result, reply.size());
+            result.insert(result.end(), reply.begin(), reply.end());
         }
         return true;
     });
     return result;
 }
 
+const named_database* shared_state::route(std::string& target, std::string_view host) const {
+    if (target.size() > 1 && target[0] == '/') {
+        auto end = target.find('/', 1);
+        if (end != std::string::npos) {
+            auto it = databases.find(target.substr(1, end - 1));
+            if (it != databases.end() && !it->first.empty()) {
+                target.erase(0, end);
+                return &it->second;
+            }
+        }
+    }
+    auto name = hosts.find(std::string{host.substr(0, host.find(':'))});
+    auto it   = databases.find(name == hosts.end() ? "" : name->second);
+    return it == databases.end() ? nullptr : &it->second;
+}
+
+bool query_cache::same_head(const state_history::fill_status& status) const {
+    return status.head == head && status.head_id.value == head_id.value;
+}
+
+void query_cache::clear() {
+    entries.clear();
+    lru.clear();
+    bytes = 0;
+}
+
+void query_cache::reset(const state_history::fill_status& status) {
+    clear();
+    head    = status.head;
+    head_id = status.head_id;
+}
+
+bool query_cache::get(const std::string& key, const state_history::fill_status& status, std::vector<char>& reply) {
+    std::lock_guard<std::mutex> lock{mutex};
+    // Lookups use the status just fetched, so a lower head here means the fill rewound (a fork
+    // or a truncated fill), not a slow query; without this, put() would refuse every new entry
+    // until the head passed its old height again
+    if (status.head < head)
+        reset(status);
+    if (!same_head(status))
+        return false;
+    auto it = entries.find(key);
+    if (it == entries.end())
+        return false;
+    lru.splice(lru.begin(), lru, it->second);
+    reply = it->second->reply;
+    return true;
+}
+
+void query_cache::put(const std::string& key, const state_history::fill_status& status, const std::vector<char>& reply) {
+    std::lock_guard<std::mutex> lock{mutex};
+    if (status.head < head)
+        return; // computed against a head we've already moved past
+    if (!same_head(status))
+        reset(status);
+    if (entries.count(key) || key.size() + reply.size() > max_bytes)
+        return;
+    lru.push_front(entry{key, reply});
+    entries[lru.front().key] = lru.begin();
+    bytes += entry_size(lru.front());
+    while (bytes > max_bytes) {
+        bytes -= entry_size(lru.back());
+        entries.erase(lru.back().key);
+        lru.pop_back();
+    }
+}
+
+void query_metrics::histogram::add(uint64_t ns) {
+    auto seconds = ns / 1e9;
+    auto it      = std::lower_bound(std::begin(bucket_bounds), std::end(bucket_bounds), seconds);
+    if (it != std::end(bucket_bounds))
+        buckets[it - std::begin(bucket_bounds)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+void query_metrics::series::record(const query_timing& timing, bool error) {
+    requests.fetch_add(1, std::memory_order_relaxed);
+    if (error)
+        errors.fetch_add(1, std::memory_order_relaxed);
+    // Phases a query didn't go through (e.g. wasm load for a native handler) aren't observed
+    if (timing.load_ns)
+        load.add(timing.load_ns);
+    if (timing.execute_ns)
+        execute.add(timing.execute_ns);
+    if (timing.database_ns)
+        database.add(timing.database_ns);
+    if (timing.serialize_ns)
+        serialize.add(timing.serialize_ns);
+}
+
+void query_metrics::add_database(const std::string& database, const std::vector<std::string>& queries) {
+    auto& stats = databases[database];
+    for (auto& query : queries)
+        stats.queries.try_emplace(query);
+    stats.queries.try_emplace(other_query);
+}
+
+query_metrics::series& query_metrics::get(const std::string& database, const std::string& query) {
+    auto& queries = databases.at(database).queries;
+    auto  it      = queries.find(query);
+    if (it == queries.end())
+        it = queries.find(other_query);
+    return it->second;
+}
+
+void query_metrics::record_status(const std::string& database, const state_history::fill_status& status) {
+    auto& stats = databases.at(database);
+    stats.head.store(status.head, std::memory_order_relaxed);
+    stats.lag_ms.store(status.lag_ms, std::memory_order_relaxed);
+}
+
+static std::string prometheus_label(const std::string& value) {
+    std::string result;
+    for (auto ch : value) {
+        if (ch == '\\' || ch == '"')
+            result += '\\';
+        if (ch == '\n')
+            result += "\\n";
+        else
+            result += ch;
+    }
+    return result;
+}
+
+std::string query_metrics::report() {
+    std::string result;
+    char        num[64];
+    auto        label = [](const std::string& database, const std::string& query) {
+        return prometheus_label(database.empty() ? query : database + ":" + query);
+    };
+    auto counter = [&](const char* metric, const char* help, std::atomic<uint64_t> series::*field) {
+        result += "# HELP "s + metric + " " + help + "\n# TYPE " + metric + " counter\n";
+        for (auto& [database, stats] : databases)
+            for (auto& [query, s] : stats.queries)
+                result += metric + "{query=\""s + label(database, query) + "\"} " +
+                          std::to_string((s.*field).load(std::memory_order_relaxed)) + "\n";
+    };
+
+    counter("wasmql_requests_total", "Queries run, by wasm query name or legacy target", &series::requests);
+    counter("wasmql_errors_total", "Queries which failed", &series::errors);
+    counter("wasmql_fork_retries_total", "Queries rerun because the head block changed while they ran", &series::fork_retries);
+
+    result += "# HELP wasmql_phase_seconds Time spent in each phase of a query\n# TYPE wasmql_phase_seconds histogram\n";
+    for (auto& [database, stats] : databases) {
+        for (auto& [query, s] : stats.queries) {
+            for (auto [phase, h] : {std::pair{"load", &s.load}, std::pair{"execute", &s.execute}, std::pair{"database", &s.database},
+                                    std::pair{"serialize", &s.serialize}}) {
+                // Other threads may be adding; the count is read first so buckets never add up to less
+                auto count = h->count.load(std::memory_order_relaxed);
+                if (!count)
+                    continue;
+                auto     labels     = "{query=\"" + label(database, query) + "\",phase=\"" + phase + "\"";
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i < std::size(bucket_bounds); ++i) {
+                    cumulative += h->buckets[i].load(std::memory_order_relaxed);
+                    snprintf(num, sizeof(num), "%g", bucket_bounds[i]);
+                    result += "wasmql_phase_seconds_bucket" + labels + ",le=\"" + num + "\"} " + std::to_string(cumulative) + "\n";
+                }
+                count = std::max(count, cumulative);
+                result += "wasmql_phase_seconds_bucket" + labels + ",le=\"+Inf\"} " + std::to_string(count) + "\n";
+                snprintf(num, sizeof(num), "%.9f", h->sum_ns.load(std::memory_order_relaxed) / 1e9);
+                result += "wasmql_phase_seconds_sum" + labels + "} " + num + "\n";
+                result += "wasmql_phase_seconds_count" + labels + "} " + std::to_string(count) + "\n";
+            }
+        }
+    }
+
+    result += "# HELP wasmql_head_block Head block of each database as of its last query\n# TYPE wasmql_head_block gauge\n";
+    for (auto& [name, stats] : databases)
+        result += "wasmql_head_block{database=\"" + prometheus_label(name) + "\"} " +
+                  std::to_string(stats.head.load(std::memory_order_relaxed)) + "\n";
+    result += "# HELP wasmql_replica_lag_seconds Time since a read replica last caught up with its primary, as of its last query; 0 "
+              "for primaries\n# TYPE wasmql_replica_lag_seconds gauge\n";
+    for (auto& [name, stats] : databases) {
+        snprintf(num, sizeof(num), "%.3f", stats.lag_ms.load(std::memory_order_relaxed) / 1e3);
+        result += "wasmql_replica_lag_seconds{database=\"" + prometheus_label(name) + "\"} " + num + "\n";
+    }
+    return result;
+}
+
+static void run_legacy_query(
+    wasm_ql::thread_state& thread_state, const std::string& target, const std::vector<char>& request, query_cache* cache,
+    const std::string& key) {
+    retry_loop(thread_state, [&]() {
+        if (cache && cache->get(key, thread_state.fill_status, thread_state.reply))
+            return true;
+        bool native = false;
+        if (thread_state.shared->native_legacy) {
+            execute_timer timer{thread_state.timing};
+            native = native_legacy_query(thread_state, target, std::string_view{request.data(), request.size()});
+        }
+        if (!native || thread_state.shared->verify_native) {
+            std::vector<char> native_reply;
+            if (native)
+                native_reply = std::move(thread_state.reply);
+            run_query(thread_state, "legacy"_n);
+            if (native && native_reply != thread_state.reply)
+                elog(
+                    "native ${t} differs from wasm. request: ${r} native: ${n} wasm: ${w}",
+                    ("t", target)("r", std::string(request.begin(), request.end()))                //
+                    ("n", std::string(native_reply.begin(), native_reply.end()))                    //
+                    ("w", std::string(thread_state.reply.begin(), thread_state.reply.end())));
+        }
+        if (did_fork(thread_state)) {
+            if (thread_state.streamed)
+                throw std::runtime_error("fork detected after part of the reply was sent");
+            thread_state.shared->metrics->get(thread_state.database->name, target).record_fork();
+            return false;
+        }
+        if (cache && !thread_state.streamed)
+            cache->put(key, thread_state.fill_status, thread_state.reply);
+        return true;
+    });
+}
+
 const std::vector<char>& legacy_query(wasm_ql::thread_state& thread_state, const std::string& target, const std::vector<char>& request) {
     std::vector<char> req;
     abieos::native_to_bin(target, req);
     abieos::native_to_bin(request, req);
-    thread_state.request = abieos::input_buffer{req.data(), req.data() + req.size()};
-    retry_loop(thread_state, [&]() {
-        run_query(thread_state, "legacy"_n);
-        return !did_fork(thread_state);
-    });
+    thread_state.request  = abieos::input_buffer{req.data(), req.data() + req.size()};
+    thread_state.streamed = false;
+    start_deadline(thread_state);
+    auto*       cache     = thread_state.database->cache.get();
+    std::string key;
+    if (cache)
+        key.assign(req.begin(), req.end());
+    auto& metrics       = thread_state.shared->metrics->get(thread_state.database->name, target);
+    thread_state.timing = {};
+    try {
+        run_legacy_query(thread_state, target, request, cache, key);
+    } catch (...) {
+        metrics.record(thread_state.timing, true);
+        throw;
+    }
+    metrics.record(thread_state.timing, false);
     return thread_state.reply;
 }
 
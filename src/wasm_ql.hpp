@@ -1,32 +1,228 @@
 // copyright defined in LICENSE.txt
 
 #pragma once
+#include "shared_watchdog.hpp"
 #include "wasm_ql_plugin.hpp"
 
+#include <boost/asio/thread_pool.hpp>
 #include <eosio/vm/backend.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
 namespace wasm_ql {
 
+// Caches legacy query replies, bounded by bytes with LRU eviction. Replies are only valid for
+// the head they were computed against; seeing a newer head, a fork at the same height, or a
+// lookup at a lower head drops every entry.
+class query_cache {
+  public:
+    explicit query_cache(size_t max_bytes)
+        : max_bytes{max_bytes} {}
+
+    bool get(const std::string& key, const state_history::fill_status& status, std::vector<char>& reply);
+    void put(const std::string& key, const state_history::fill_status& status, const std::vector<char>& reply);
+
+  private:
+    struct entry {
+        std::string       key;
+        std::vector<char> reply;
+    };
+
+    bool   same_head(const state_history::fill_status& status) const;
+    size_t entry_size(const entry& e) const { return e.key.size() + e.reply.size(); }
+    void   clear();
+    void   reset(const state_history::fill_status& status);
+
+    std::mutex                                                       mutex;
+    size_t                                                           max_bytes = 0;
+    size_t                                                           bytes     = 0;
+    uint32_t                                                         head      = 0;
+    eosio::checksum256                                               head_id   = {};
+    std::list<entry>                                                 lru;
+    std::unordered_map<std::string_view, std::list<entry>::iterator> entries;
+};
+
+// Time spent in each phase of a query, in nanoseconds
+struct query_timing {
+    uint64_t load_ns      = 0; // reading and instantiating the wasm
+    uint64_t execute_ns   = 0; // running the wasm or native handler, excluding database time
+    uint64_t database_ns  = 0; // query_database, fill status and fork checks
+    uint64_t serialize_ns = 0; // building the HTTP response, including compression
+};
+
+// Adds the time between construction and destruction to a counter
+class scoped_timer {
+  public:
+    explicit scoped_timer(uint64_t& ns)
+        : ns{ns} {}
+
+    ~scoped_timer() { ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(); }
+
+  private:
+    uint64_t&                             ns;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+// Targets legacy-server.wasm answers. Each has its own metrics series; other targets share one.
+inline const std::vector<std::string> legacy_targets = {
+    "/v1/chain/get_table_rows",        //
+    "/v1/chain/get_currency_balance",  //
+    "/v1/chain/get_account",           //
+    "/v1/chain/get_code",              //
+    "/v1/chain/get_abi",               //
+    "/v1/chain/get_producer_schedule", //
+    "/v1/chain/get_block",             //
+    "/v1/history/get_transaction",     //
+    "/v1/history/get_actions",         //
+};
+
+// Request, error and fork retry counts plus per-phase latency histograms, keyed by query name
+// (the short name of a wasm query, or a legacy target), and the last status seen of each database.
+// report() produces the Prometheus text format served on /metrics.
+//
+// Databases and their query names are registered before serving starts; after that the maps don't
+// change, so recording only touches atomics. Unregistered names are counted under `other`, which
+// keeps client input from adding series.
+class query_metrics {
+  private:
+    // Histogram bucket upper bounds, in seconds
+    static constexpr double bucket_bounds[] = {
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+    struct histogram {
+        std::atomic<uint64_t> buckets[std::size(bucket_bounds)] = {}; // not cumulative; report() sums them
+        std::atomic<uint64_t> count                             = 0;
+        std::atomic<uint64_t> sum_ns                            = 0;
+
+        void add(uint64_t ns);
+    };
+
+  public:
+    static constexpr const char* other_query = "other";
+
+    class series {
+      public:
+        void record(const query_timing& timing, bool error);
+        void record_fork() { fork_retries.fetch_add(1, std::memory_order_relaxed); }
+        void record_serialize(uint64_t ns) { serialize.add(ns); }
+
+      private:
+        friend query_metrics;
+
+        std::atomic<uint64_t> requests     = 0;
+        std::atomic<uint64_t> errors       = 0;
+        std::atomic<uint64_t> fork_retries = 0;
+        histogram             load;
+        histogram             execute;
+        histogram             database;
+        histogram             serialize;
+    };
+
+    // Not thread safe; call before any query runs
+    void add_database(const std::string& database, const std::vector<std::string>& queries);
+
+    series&     get(const std::string& database, const std::string& query);
+    void        record_status(const std::string& database, const state_history::fill_status& status);
+    std::string report();
+
+  private:
+    struct database_stats {
+        std::map<std::string, series> queries;
+        std::atomic<uint32_t>         head   = 0;
+        std::atomic<uint32_t>         lag_ms = 0;
+    };
+
+    std::map<std::string, database_stats> databases; // by database name
+};
+
+class batch_executor;
+
+// A database queries run against. The one named "" answers requests without a database prefix;
+// others answer /<name>/... requests and requests whose Host header maps to them.
+struct named_database {
+    std::string                         name     = {};
+    std::shared_ptr<database_interface> db_iface = {};
+    std::unique_ptr<query_cache>        cache    = {};
+};
+
 struct shared_state {
-    bool                                console      = {};
-    std::string                         allow_origin = {};
-    std::string                         wasm_dir     = {};
-    std::string                         static_dir   = {};
-    std::shared_ptr<database_interface> db_iface     = {};
+    bool                                  console           = {};
+    std::string                           allow_origin      = {};
+    std::string                           wasm_dir          = {};
+    std::string                           static_dir        = {};
+    size_t                                static_cache_size = 64 * 1024 * 1024; // bytes of static files kept in memory
+    size_t                                prefault_bytes    = 1024 * 1024;      // wasm memory touched when a thread_state is created
+    std::map<std::string, named_database> databases         = {};               // by name
+    std::map<std::string, std::string>    hosts             = {};               // Host header (without port) -> database name
+    std::unique_ptr<batch_executor>       batch             = {};
+    bool                                  native_legacy     = {};
+    bool                                  verify_native     = {};
+    uint32_t                              subscribe_poll_ms = 500;
+    uint32_t                              compress_min_size = 1024; // 0: don't compress replies
+    uint32_t                              query_timeout_ms  = 0;    // 0: no deadline
+    uint32_t                              max_per_client    = 0;    // queries waiting or running per client address. 0: unlimited
+    uint32_t                              max_subscriptions = 16;   // websocket subscriptions per client address. 0: unlimited
+    std::unique_ptr<query_metrics>        metrics           = std::make_unique<query_metrics>();
+    std::unique_ptr<shared_watchdog>      watchdog          = {}; // interrupts wasms past their deadline; set if query_timeout_ms
+
+    // Picks the database for a request and strips its prefix, if any, from target. Returns nullptr
+    // if the request doesn't select a database and there's no default one.
+    const named_database* route(std::string& target, std::string_view host) const;
 };
 
 struct thread_state {
-    std::shared_ptr<const shared_state> shared          = {};
-    eosio::vm::wasm_allocator           wa              = {};
-    std::vector<char>                   database_status = {};
-    abieos::input_buffer                request         = {}; // todo: rename
-    std::vector<char>                   reply           = {}; // todo: rename
-    std::unique_ptr<::query_session>    query_session   = {};
-    state_history::fill_status          fill_status     = {};
+    std::shared_ptr<const shared_state>      shared          = {};
+    eosio::vm::wasm_allocator                wa              = {};
+    std::vector<char>                        database_status = {};
+    abieos::input_buffer                     request         = {}; // todo: rename
+    std::vector<char>                        reply           = {}; // todo: rename
+    std::unique_ptr<::query_session>         query_session   = {};
+    state_history::fill_status               fill_status     = {};
+    std::function<void(std::vector<char>&&)> output_sink     = {}; // receives reply data early if set; see append_output_data
+    bool                                     streamed        = {}; // output_sink received some of the reply
+    query_timing                             timing          = {}; // of the current query or batch item
+    std::chrono::steady_clock::time_point    deadline        = std::chrono::steady_clock::time_point::max();
+    const named_database*                    database        = {}; // set by the caller for each request
 };
 
+// Runs the sub-requests of a /wasmql/v1/query batch concurrently. Each worker gets its own
+// thread_state and query_session, but queries against the batch's head; the batch is retried
+// if any sub-request sees a fork.
+class batch_executor {
+  public:
+    explicit batch_executor(int num_threads)
+        : pool(num_threads) {}
+
+    ~batch_executor() { pool.join(); }
+
+    // Returns false if a fork was detected
+    bool run(thread_state& parent, const std::vector<abieos::input_buffer>& requests, std::vector<std::vector<char>>& replies);
+
+  private:
+    std::unique_ptr<thread_state> get_state(const thread_state& parent);
+    void                          store_state(std::unique_ptr<thread_state> state);
+
+    boost::asio::thread_pool                   pool;
+    std::mutex                                 mutex;
+    std::vector<std::unique_ptr<thread_state>> states;
+};
+
+// A new thread_state, with the first shared->prefault_bytes of its wasm memory already faulted in
+std::unique_ptr<thread_state> make_thread_state(const std::shared_ptr<const shared_state>& shared);
+
 void                     register_callbacks();
 std::vector<char>        query(wasm_ql::thread_state& thread_state, const std::vector<char>& request);
 const std::vector<char>& legacy_query(wasm_ql::thread_state& thread_state, const std::string& target, const std::vector<char>& request);
 
+// Native versions of the busiest legacy endpoints (wasm_ql_legacy.cpp). Returns false if there is
+// no native handler for the request; the caller then runs legacy-server.wasm.
+bool native_legacy_query(wasm_ql::thread_state& thread_state, std::string_view target, std::string_view request);
+
 } // namespace wasm_ql
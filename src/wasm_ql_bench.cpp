@@ -0,0 +1,319 @@
+// copyright defined in LICENSE.txt
+
+// Replays a corpus of requests against a running wasm-ql server and reports throughput and
+// latency per endpoint. With --compare, sends each request once to two servers and reports
+// replies which differ.
+//
+// Corpus format: one request per line, "<target> <body>". /wasmql/v1/query bodies are hex;
+// other bodies are sent as they are. Blank lines and lines starting with # are skipped.
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace beast = boost::beast;
+namespace http  = beast::http;
+namespace net   = boost::asio;
+namespace bpo   = boost::program_options;
+using tcp       = net::ip::tcp;
+
+using namespace std::literals;
+
+struct corpus_entry {
+    std::string target;
+    std::string body;
+};
+
+struct endpoint_stats {
+    std::vector<uint64_t> latencies_us;
+    uint64_t              errors = 0;
+};
+
+using stats_map = std::map<std::string, endpoint_stats>;
+
+struct config {
+    std::string               host;
+    std::string               port;
+    std::vector<corpus_entry> corpus;
+    bool                      keep_alive   = true;
+    uint64_t                  max_requests = 0; // 0: run for the duration
+};
+
+static std::string hex_to_bin(const std::string& hex, const std::string& context) {
+    auto digit = [&](char ch) -> int {
+        if (ch >= '0' && ch <= '9')
+            return ch - '0';
+        if (ch >= 'a' && ch <= 'f')
+            return ch - 'a' + 10;
+        if (ch >= 'A' && ch <= 'F')
+            return ch - 'A' + 10;
+        throw std::runtime_error("invalid hex in " + context);
+    };
+    if (hex.size() % 2)
+        throw std::runtime_error("odd-length hex in " + context);
+    std::string result;
+    result.reserve(hex.size() / 2);
+    for (size_t i = 0; i < hex.size(); i += 2)
+        result.push_back(char(digit(hex[i]) * 16 + digit(hex[i + 1])));
+    return result;
+}
+
+static std::vector<corpus_entry> read_corpus(const std::string& filename) {
+    std::ifstream file{filename};
+    if (!file)
+        throw std::runtime_error("unable to open " + filename);
+    std::vector<corpus_entry> result;
+    std::string               line;
+    for (int line_num = 1; std::getline(file, line); ++line_num) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        auto         space = line.find(' ');
+        corpus_entry entry{line.substr(0, space), space == std::string::npos ? "" : line.substr(space + 1)};
+        if (entry.target == "/wasmql/v1/query")
+            entry.body = hex_to_bin(entry.body, filename + ":" + std::to_string(line_num));
+        result.push_back(std::move(entry));
+    }
+    if (result.empty())
+        throw std::runtime_error(filename + " has no requests");
+    return result;
+}
+
+// One connection, sending requests back to back. Entries are taken round-robin across all
+// workers so the mix matches the corpus.
+class worker {
+  public:
+    worker(const config& cfg, const tcp::resolver::results_type& endpoints, std::atomic<uint64_t>& next)
+        : cfg{cfg}
+        , endpoints{endpoints}
+        , next{next} {}
+
+    // Records into `stats` only while `recording` is set; returns when `stop` is set or the
+    // request limit is reached
+    void run(const std::atomic<bool>& recording, const std::atomic<bool>& stop) {
+        while (!stop) {
+            auto index = next++;
+            if (cfg.max_requests && index >= cfg.max_requests)
+                break;
+            auto& entry = cfg.corpus[index % cfg.corpus.size()];
+            auto  start = std::chrono::steady_clock::now();
+            bool  ok    = send(entry);
+            auto  us    = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            if (!recording)
+                continue;
+            auto& s = stats[entry.target];
+            if (ok)
+                s.latencies_us.push_back(us);
+            else
+                ++s.errors;
+        }
+    }
+
+    // Sends one request and returns the response; throws on connection errors
+    http::response<http::string_body> fetch(const corpus_entry& entry) {
+        try {
+            if (!stream) {
+                stream.emplace(ioc);
+                stream->connect(endpoints);
+                stream->socket().set_option(tcp::no_delay(true));
+            }
+            http::request<http::string_body> req{http::verb::post, entry.target, 11};
+            req.set(http::field::host, cfg.host);
+            req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+            req.keep_alive(cfg.keep_alive);
+            req.body() = entry.body;
+            req.prepare_payload();
+            http::write(*stream, req);
+
+            http::response<http::string_body> res;
+            http::read(*stream, buffer, res);
+            if (!cfg.keep_alive || !res.keep_alive())
+                close();
+            return res;
+        } catch (...) {
+            close();
+            throw;
+        }
+    }
+
+    stats_map stats;
+
+  private:
+    const config&                      cfg;
+    const tcp::resolver::results_type& endpoints;
+    std::atomic<uint64_t>&             next;
+    net::io_context                    ioc;
+    std::optional<beast::tcp_stream>   stream;
+    beast::flat_buffer                 buffer;
+
+    bool send(const corpus_entry& entry) {
+        try {
+            return fetch(entry).result() == http::status::ok;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+
+    void close() {
+        if (!stream)
+            return;
+        beast::error_code ec;
+        stream->socket().shutdown(tcp::socket::shutdown_both, ec);
+        stream.reset();
+        buffer.clear();
+    }
+};
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+// Sends each corpus entry once to both servers and reports every entry whose status or body differs,
+// e.g. to check the native legacy handlers against legacy-server.wasm on the same database
+static bool compare(const config& cfg, const config& other_cfg, net::io_context& resolve_ioc) {
+    auto                  endpoints       = tcp::resolver{resolve_ioc}.resolve(cfg.host, cfg.port);
+    auto                  other_endpoints = tcp::resolver{resolve_ioc}.resolve(other_cfg.host, other_cfg.port);
+    std::atomic<uint64_t> unused          = 0;
+    worker                a{cfg, endpoints, unused};
+    worker                b{other_cfg, other_endpoints, unused};
+    uint64_t              differ = 0;
+    for (auto& entry : cfg.corpus) {
+        auto x = a.fetch(entry);
+        auto y = b.fetch(entry);
+        if (x.result() == y.result() && x.body() == y.body())
+            continue;
+        ++differ;
+        auto& xb  = x.body();
+        auto& yb  = y.body();
+        auto  pos = std::mismatch(xb.begin(), xb.begin() + std::min(xb.size(), yb.size()), yb.begin()).first - xb.begin();
+        printf(
+            "%s %s\n  status %u vs %u, %zu vs %zu bytes, first difference at byte %zu\n", entry.target.c_str(),
+            entry.target == "/wasmql/v1/query" ? "(binary)" : entry.body.c_str(), x.result_int(), y.result_int(), xb.size(), yb.size(),
+            size_t(pos));
+    }
+    printf("%zu requests, %llu differ\n", cfg.corpus.size(), (unsigned long long)differ);
+    return !differ;
+}
+
+int main(int argc, char** argv) {
+    try {
+        bpo::options_description desc{"Options"};
+        auto                     op = desc.add_options();
+        op("help,h", "Show this message");
+        op("url,u", bpo::value<std::string>()->default_value("127.0.0.1:8880"), "wasm-ql server address (host:port)");
+        op("corpus,c", bpo::value<std::string>()->required(), "Request corpus file");
+        op("connections,n", bpo::value<int>()->default_value(16), "Number of concurrent connections");
+        op("duration,d", bpo::value<uint32_t>()->default_value(30), "Seconds to measure");
+        op("warmup,w", bpo::value<uint32_t>()->default_value(5), "Seconds to run before measuring");
+        op("requests,r", bpo::value<uint64_t>(), "Stop after this many requests instead of after --duration (no warmup)");
+        op("no-keep-alive", "Open a new connection for each request");
+        op("max-p99-ms", bpo::value<double>(), "Exit with status 1 if any endpoint's p99 latency exceeds this");
+        op("max-errors", bpo::value<uint64_t>(), "Exit with status 1 if there are more than this many failed requests");
+        op("compare", bpo::value<std::string>(), "Send each request once to --url and to this server (host:port) and compare the replies");
+
+        bpo::variables_map vm;
+        bpo::store(bpo::parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            std::cout << "Usage: wasm-ql-bench --corpus FILE [options]\n\n" << desc;
+            return 0;
+        }
+        bpo::notify(vm);
+
+        auto set_url = [](config& cfg, const std::string& url) {
+            if (url.find(':') == std::string::npos)
+                throw std::runtime_error("invalid server address: " + url);
+            cfg.host = url.substr(0, url.find(':'));
+            cfg.port = url.substr(url.find(':') + 1);
+        };
+
+        config cfg;
+        set_url(cfg, vm["url"].as<std::string>());
+        cfg.corpus     = read_corpus(vm["corpus"].as<std::string>());
+        cfg.keep_alive = !vm.count("no-keep-alive");
+        if (vm.count("requests"))
+            cfg.max_requests = vm["requests"].as<uint64_t>();
+        auto num_connections = std::max(1, vm["connections"].as<int>());
+        auto warmup          = std::chrono::seconds(vm["warmup"].as<uint32_t>());
+        auto duration        = std::chrono::seconds(vm["duration"].as<uint32_t>());
+
+        net::io_context resolve_ioc;
+        if (vm.count("compare")) {
+            config other_cfg = cfg;
+            set_url(other_cfg, vm["compare"].as<std::string>());
+            return compare(cfg, other_cfg, resolve_ioc) ? 0 : 1;
+        }
+        auto endpoints = tcp::resolver{resolve_ioc}.resolve(cfg.host, cfg.port);
+
+        std::atomic<uint64_t>                next      = 0;
+        std::atomic<bool>                    recording = warmup.count() == 0 || cfg.max_requests;
+        std::atomic<bool>                    stop      = false;
+        std::vector<std::unique_ptr<worker>> workers;
+        std::vector<std::thread>             threads;
+        for (int i = 0; i < num_connections; ++i)
+            workers.push_back(std::make_unique<worker>(cfg, endpoints, next));
+        for (auto& w : workers)
+            threads.emplace_back([&, w = w.get()] { w->run(recording, stop); });
+
+        auto start = std::chrono::steady_clock::now();
+        if (!cfg.max_requests) {
+            std::this_thread::sleep_for(warmup);
+            start     = std::chrono::steady_clock::now();
+            recording = true;
+            std::this_thread::sleep_for(duration);
+            stop = true;
+        }
+        for (auto& t : threads)
+            t.join();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        stats_map totals;
+        for (auto& w : workers) {
+            for (auto& [target, s] : w->stats) {
+                auto& total = totals[target];
+                total.latencies_us.insert(total.latencies_us.end(), s.latencies_us.begin(), s.latencies_us.end());
+                total.errors += s.errors;
+            }
+        }
+
+        bool     failed     = false;
+        uint64_t all_errors = 0;
+        printf("%-40s %10s %8s %10s %9s %9s %9s\n", "endpoint", "requests", "errors", "req/s", "p50 ms", "p99 ms", "p999 ms");
+        for (auto& [target, s] : totals) {
+            std::sort(s.latencies_us.begin(), s.latencies_us.end());
+            auto p99 = percentile(s.latencies_us, 0.99) / 1000.0;
+            printf(
+                "%-40s %10zu %8llu %10.1f %9.3f %9.3f %9.3f\n", target.c_str(), s.latencies_us.size(), (unsigned long long)s.errors,
+                s.latencies_us.size() / elapsed, percentile(s.latencies_us, 0.5) / 1000.0, p99, percentile(s.latencies_us, 0.999) / 1000.0);
+            all_errors += s.errors;
+            if (vm.count("max-p99-ms") && p99 > vm["max-p99-ms"].as<double>()) {
+                fprintf(stderr, "%s: p99 %.3f ms exceeds --max-p99-ms\n", target.c_str(), p99);
+                failed = true;
+            }
+        }
+        if (vm.count("max-errors") && all_errors > vm["max-errors"].as<uint64_t>()) {
+            fprintf(stderr, "%llu failed requests exceeds --max-errors\n", (unsigned long long)all_errors);
+            failed = true;
+        }
+        return failed ? 1 : 0;
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 2;
+    }
+}
@@ -8,62 +8,163 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 
 #include "wasm_ql_http.hpp"
+#include "thread_state_cache.hpp"
+#include "util.hpp"
 
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/beast/websocket.hpp>
 #include <boost/make_unique.hpp>
 #include <boost/optional.hpp>
 
 #include <fc/exception/exception.hpp>
 #include <fc/log/logger.hpp>
+#include <fc/scoped_exit.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
-namespace beast = boost::beast;         // from <boost/beast.hpp>
-namespace http  = beast::http;          // from <boost/beast/http.hpp>
-namespace net   = boost::asio;          // from <boost/asio.hpp>
-using tcp       = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
+#include <sys/stat.h>
+
+namespace beast     = boost::beast;         // from <boost/beast.hpp>
+namespace http      = beast::http;          // from <boost/beast/http.hpp>
+namespace net       = boost::asio;          // from <boost/asio.hpp>
+namespace websocket = beast::websocket;     // from <boost/beast/websocket.hpp>
+using tcp           = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
 
 using namespace std::literals;
 
 namespace wasm_ql {
 
-class thread_state_cache {
+using thread_state_cache = basic_thread_state_cache<thread_state>;
+
+// Runs queries off the network threads. Requests beyond max_pending (queued plus executing),
+// or beyond max_per_client from one client address, are rejected so that overload shows up as
+// fast 503s and 429s instead of growing latency. Cheap requests go ahead of queued slow ones,
+// and slow ones may not occupy every thread, so point lookups stay fast while scans pile up.
+class execution_pool {
+  public:
+    enum class priority { high, low };
+
+    enum class admission {
+        accepted,
+        busy,        // the pool is full
+        client_busy, // the client is at max_per_client
+    };
+
   private:
-    std::mutex                                   mutex;
-    std::shared_ptr<const wasm_ql::shared_state> shared_state;
-    std::vector<std::unique_ptr<thread_state>>   states;
+    struct job {
+        std::function<void()> f;
+        std::string           client;
+        bool                  low = false;
+    };
+
+    std::mutex                                mutex;
+    std::condition_variable                   cv;
+    std::deque<job>                           high_jobs;
+    std::deque<job>                           low_jobs;
+    std::vector<std::thread>                  threads;
+    std::unordered_map<std::string, uint32_t> per_client;
+    uint32_t                                  pending        = 0;
+    uint32_t                                  max_pending    = 0;
+    uint32_t                                  max_per_client = 0; // 0: unlimited
+    uint32_t                                  low_running    = 0;
+    uint32_t                                  max_low        = 0;
+    bool                                      stopping       = false;
+
+    void run() {
+        std::unique_lock<std::mutex> lock{mutex};
+        while (true) {
+            cv.wait(lock, [&] { return stopping || !high_jobs.empty() || (!low_jobs.empty() && low_running < max_low); });
+            if (stopping)
+                return;
+            auto& jobs = high_jobs.empty() ? low_jobs : high_jobs;
+            job   j    = std::move(jobs.front());
+            jobs.pop_front();
+            if (j.low)
+                ++low_running;
+            lock.unlock();
+            try {
+                j.f();
+            } catch (const std::exception& e) {
+                elog("query execution failed: ${s}", ("s", e.what()));
+            } catch (...) {
+                elog("query execution failed: unknown exception");
+            }
+            lock.lock();
+            --pending;
+            if (j.low) {
+                --low_running;
+                cv.notify_one();
+            }
+            if (!j.client.empty()) {
+                auto it = per_client.find(j.client);
+                if (it != per_client.end() && !--it->second)
+                    per_client.erase(it);
+            }
+        }
+    }
 
   public:
-    thread_state_cache(const std::shared_ptr<const wasm_ql::shared_state>& shared_state)
-        : shared_state(shared_state) {}
+    execution_pool(int num_threads, uint32_t max_pending, uint32_t max_per_client)
+        : max_pending(max_pending)
+        , max_per_client(max_per_client)
+        // A quarter of the threads (at least one, if there are two or more) are kept for high-priority work
+        , max_low(std::max(1, num_threads - std::max(num_threads > 1 ? 1 : 0, num_threads / 4))) {
+        threads.reserve(num_threads);
+        for (int i = 0; i < num_threads; ++i)
+            threads.emplace_back([this] { run(); });
+    }
 
-    std::unique_ptr<thread_state> get_state() {
-        std::lock_guard<std::mutex> lock{mutex};
-        if (states.empty()) {
-            auto result    = std::make_unique<thread_state>();
-            result->shared = shared_state;
-            return result;
+    ~execution_pool() { stop(); }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            stopping = true;
         }
-        auto result = std::move(states.back());
-        states.pop_back();
-        return result;
+        cv.notify_all();
+        for (auto& t : threads)
+            t.join();
+        threads.clear();
     }
 
-    void store_state(std::unique_ptr<thread_state> state) {
+    // client may be empty for internal work, which isn't subject to max_per_client
+    template <typename F>
+    admission post(F&& f, priority prio = priority::high, const std::string& client = {}) {
         std::lock_guard<std::mutex> lock{mutex};
-        states.push_back(std::move(state));
+        if (pending >= max_pending)
+            return admission::busy;
+        if (!client.empty() && max_per_client) {
+            auto& count = per_client[client];
+            if (count >= max_per_client)
+                return admission::client_busy;
+            ++count;
+        }
+        ++pending;
+        bool low = prio == priority::low;
+        (low ? low_jobs : high_jobs).push_back(job{std::forward<F>(f), max_per_client ? client : std::string{}, low});
+        cv.notify_one();
+        return admission::accepted;
     }
 };
 
@@ -149,14 +250,220 @@ std::string path_cat(beast::string_view base, beast::string_view path) {
     return result;
 }
 
+// Requests to these targets run on the execution pool; everything else is answered directly
+// on the network thread.
+static bool is_query_target(beast::string_view target) { return target == "/wasmql/v1/query" || target.starts_with("/v1/"); }
+
+// Point lookups. Everything else (history and table scans, batches) may run much longer.
+static bool is_cheap_target(beast::string_view target) {
+    return target == "/v1/chain/get_account" || target == "/v1/chain/get_abi" || target == "/v1/chain/get_code" ||
+           target == "/v1/chain/get_currency_balance" || target == "/v1/chain/get_producer_schedule" || target == "/v1/chain/get_block" ||
+           target == "/v1/history/get_transaction";
+}
+
+static beast::string_view trim(beast::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+// Whether the client lists gzip (or *) in Accept-Encoding without disabling it with q=0
+template <class Body, class Allocator>
+bool accepts_gzip(const http::request<Body, http::basic_fields<Allocator>>& req) {
+    auto header = req[http::field::accept_encoding];
+    while (!header.empty()) {
+        auto comma = header.find(',');
+        auto item  = header.substr(0, comma);
+        header     = comma == beast::string_view::npos ? beast::string_view{} : header.substr(comma + 1);
+
+        auto semi   = item.find(';');
+        auto coding = trim(item.substr(0, semi));
+        if (!beast::iequals(coding, "gzip") && coding != "*")
+            continue;
+        if (semi == beast::string_view::npos)
+            return true;
+        auto param = trim(item.substr(semi + 1));
+        if (param.size() < 2 || (param[0] != 'q' && param[0] != 'Q') || param[1] != '=')
+            return true;
+        return std::strtod(param.substr(2).to_string().c_str(), nullptr) > 0;
+    }
+    return false;
+}
+
+// Whether an If-None-Match header value matches `etag`
+static bool etag_matches(beast::string_view if_none_match, beast::string_view etag) {
+    while (!if_none_match.empty()) {
+        auto comma    = if_none_match.find(',');
+        auto item     = trim(if_none_match.substr(0, comma));
+        if_none_match = comma == beast::string_view::npos ? beast::string_view{} : if_none_match.substr(comma + 1);
+        if (item.starts_with("W/"))
+            item.remove_prefix(2);
+        if (item == etag || item == "*")
+            return true;
+    }
+    return false;
+}
+
+// A body which shares an immutable buffer, so cached files aren't copied for every response
+struct shared_body {
+    using value_type = std::shared_ptr<const std::vector<char>>;
+
+    static std::uint64_t size(const value_type& body) { return body ? body->size() : 0; }
+
+    class writer {
+        const value_type& body_;
+
+      public:
+        using const_buffers_type = net::const_buffer;
+
+        template <bool isRequest, class Fields>
+        writer(const http::header<isRequest, Fields>&, const value_type& body)
+            : body_(body) {}
+
+        void init(beast::error_code& ec) { ec = {}; }
+
+        boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+            ec = {};
+            if (!body_ || body_->empty())
+                return boost::none;
+            return {{const_buffers_type{body_->data(), body_->size()}, false}};
+        }
+    };
+};
+
+// Keeps static files in memory along with a gzipped copy of compressible ones, bounded by bytes
+// with LRU eviction. An entry is rechecked at most once a second and reloaded when the file's
+// size or modification time changes; both go into its ETags.
+class static_file_cache {
+  public:
+    struct file {
+        std::string                              etag;
+        std::string                              gzip_etag; // a different representation, so a different ETag
+        std::shared_ptr<const std::vector<char>> content;
+        std::shared_ptr<const std::vector<char>> gzipped; // null if it doesn't compress
+
+        size_t size() const { return content->size() + (gzipped ? gzipped->size() : 0); }
+    };
+
+    explicit static_file_cache(size_t max_bytes)
+        : max_bytes{max_bytes} {}
+
+  private:
+    enum {
+        // Larger files are streamed from disk on each request
+        max_file_size = 4 * 1024 * 1024,
+        recheck_ms    = 1000,
+    };
+
+    struct entry {
+        std::string                           path;
+        std::shared_ptr<const file>           f;
+        std::chrono::steady_clock::time_point checked;
+    };
+
+    std::mutex                                                       mutex;
+    size_t                                                           max_bytes = 0;
+    size_t                                                           bytes     = 0;
+    std::list<entry>                                                 lru;
+    std::unordered_map<std::string_view, std::list<entry>::iterator> files;
+
+    static bool compressible(beast::string_view content_type) {
+        return content_type.starts_with("text/") || content_type == "application/javascript" || content_type == "application/json" ||
+               content_type == "application/wasm" || content_type == "application/xml" || content_type == "image/svg+xml";
+    }
+
+    void erase(std::list<entry>::iterator it) {
+        bytes -= it->f->size();
+        files.erase(it->path);
+        lru.erase(it);
+    }
+
+    void put(const std::string& path, const std::shared_ptr<const file>& f, std::chrono::steady_clock::time_point now) {
+        if (auto it = files.find(path); it != files.end())
+            erase(it->second);
+        if (f->size() > max_bytes)
+            return;
+        lru.push_front(entry{path, f, now});
+        files[lru.front().path] = lru.begin();
+        bytes += f->size();
+        while (bytes > max_bytes)
+            erase(std::prev(lru.end()));
+    }
+
+  public:
+    // Returns null if the file is missing or too large to cache; the caller falls back to disk
+    std::shared_ptr<const file> get(const std::string& path, beast::string_view content_type) {
+        if (!max_bytes)
+            return nullptr;
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            auto                        it = files.find(path);
+            if (it != files.end() && now - it->second->checked < std::chrono::milliseconds(recheck_ms)) {
+                lru.splice(lru.begin(), lru, it->second);
+                return it->second->f;
+            }
+        }
+
+        struct stat st;
+        if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode) || st.st_size > max_file_size) {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (auto it = files.find(path); it != files.end())
+                erase(it->second);
+            return nullptr;
+        }
+        char etag[64];
+        snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long)st.st_mtime, (unsigned long long)st.st_size);
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            auto                        it = files.find(path);
+            if (it != files.end() && it->second->f->etag == etag) {
+                it->second->checked = now;
+                lru.splice(lru.begin(), lru, it->second);
+                return it->second->f;
+            }
+        }
+
+        auto result       = std::make_shared<file>();
+        result->etag      = etag;
+        result->gzip_etag = result->etag.substr(0, result->etag.size() - 1) + "-gz\"";
+        try {
+            auto content    = read_string(path.c_str());
+            result->content = std::make_shared<std::vector<char>>(content.begin(), content.end());
+        } catch (...) {
+            return nullptr;
+        }
+        if (compressible(content_type)) {
+            auto gzipped = gzip_compress({result->content->data(), result->content->size()});
+            if (gzipped.size() < result->content->size())
+                result->gzipped = std::make_shared<std::vector<char>>(std::move(gzipped));
+        }
+
+        std::lock_guard<std::mutex> lock{mutex};
+        put(path, result, now);
+        return result;
+    }
+};
+
+// Whether a handle_request() Send can deliver a reply in chunks while it's being produced
+template <typename Send, typename = void>
+struct can_stream : std::false_type {};
+
+template <typename Send>
+struct can_stream<Send, std::void_t<decltype(&Send::chunk_sink)>> : std::true_type {};
+
 // This function produces an HTTP response for the given
 // request. The type of the response object depends on the
 // contents of the request, so the interface requires the
 // caller to pass a generic lambda for receiving the response.
+// `database` is the result of shared_state::route() for the request.
 template <class Body, class Allocator, class Send>
 void handle_request(
-    beast::string_view doc_root, const std::shared_ptr<const shared_state>& shared_state,
-    const std::shared_ptr<thread_state_cache>& state_cache, http::request<Body, http::basic_fields<Allocator>>&& req, Send&& send) {
+    beast::string_view doc_root, static_file_cache& static_files, const std::shared_ptr<const shared_state>& shared_state,
+    const named_database* database, const std::shared_ptr<thread_state_cache>& state_cache,
+    http::request<Body, http::basic_fields<Allocator>>&& req, Send&& send) {
     // Returns a bad request response
     const auto bad_request = [&req](beast::string_view why) {
         http::response<http::string_body> res{http::status::bad_request, req.version()};
@@ -197,24 +504,74 @@ void handle_request(
         if (!shared_state->allow_origin.empty())
             res.set(http::field::access_control_allow_origin, shared_state->allow_origin);
         res.keep_alive(req.keep_alive());
+        if (shared_state->compress_min_size) {
+            res.set(http::field::vary, "Accept-Encoding");
+            if (reply.size() >= shared_state->compress_min_size && accepts_gzip(req)) {
+                reply = gzip_compress({reply.data(), reply.size()});
+                res.set(http::field::content_encoding, "gzip");
+            }
+        }
         res.body() = std::move(reply);
         res.prepare_payload();
         return res;
     };
 
+    // ok(), recording its time as the serialize phase of `name`
+    const auto timed_ok = [&shared_state, &database, &ok](const std::string& name, std::vector<char> reply, const char* content_type) {
+        auto start = std::chrono::steady_clock::now();
+        auto res   = ok(std::move(reply), content_type);
+        shared_state->metrics->get(database->name, name)
+            .record_serialize(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        return res;
+    };
+
+    // Returns the header of a response whose body follows in chunks
+    const auto chunked_header = [&shared_state, &req](const char* content_type) {
+        http::response<http::empty_body> res{http::status::ok, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.set(http::field::content_type, content_type);
+        if (!shared_state->allow_origin.empty())
+            res.set(http::field::access_control_allow_origin, shared_state->allow_origin);
+        res.keep_alive(req.keep_alive());
+        res.chunked(true);
+        return res;
+    };
+
     try {
-        if (req.target() == "/wasmql/v1/query") {
+        if (req.target() == "/metrics") {
+            if (req.method() != http::verb::get)
+                return send(error(http::status::bad_request, "Unsupported HTTP-method for " + req.target().to_string() + "\n"));
+            auto report = shared_state->metrics->report();
+            return send(ok({report.begin(), report.end()}, "text/plain; version=0.0.4"));
+        } else if (is_query_target(req.target()) && !database) {
+            return send(not_found(req.target()));
+        } else if (req.target() == "/wasmql/v1/query") {
             if (req.method() != http::verb::post)
                 return send(error(http::status::bad_request, "Unsupported HTTP-method for " + req.target().to_string() + "\n"));
-            auto thread_state = state_cache->get_state();
-            send(ok(query(*thread_state, req.body()), "application/octet-stream"));
+            auto thread_state      = state_cache->get_state();
+            thread_state->database = database;
+            send(timed_ok("/wasmql/v1/query", query(*thread_state, req.body()), "application/octet-stream"));
             state_cache->store_state(std::move(thread_state));
             return;
         } else if (req.target().starts_with("/v1/")) {
             if (req.method() != http::verb::post)
                 return send(error(http::status::bad_request, "Unsupported HTTP-method for " + req.target().to_string() + "\n"));
-            auto thread_state = state_cache->get_state();
-            send(ok(legacy_query(*thread_state, req.target().to_string(), req.body()), "application/octet-stream"));
+            auto thread_state      = state_cache->get_state();
+            auto target            = req.target().to_string();
+            thread_state->database = database;
+            if constexpr (can_stream<std::decay_t<Send>>::value) {
+                // --wql-verify-native compares whole replies, so it doesn't stream
+                if (!shared_state->verify_native)
+                    thread_state->output_sink = send.chunk_sink(chunked_header("application/octet-stream"));
+                auto& reply               = legacy_query(*thread_state, target, req.body());
+                thread_state->output_sink = nullptr;
+                if (thread_state->streamed)
+                    send.finish_chunks(std::move(thread_state->reply));
+                else
+                    send(timed_ok(target, reply, "application/octet-stream"));
+            } else {
+                send(timed_ok(target, legacy_query(*thread_state, target, req.body()), "application/octet-stream"));
+            }
             state_cache->store_state(std::move(thread_state));
             return;
         } else if (doc_root.empty()) {
@@ -233,6 +590,28 @@ void handle_request(
             if (req.target().back() == '/')
                 path.append("index.html");
 
+            // Serve from memory if possible
+            if (auto file = static_files.get(path, mime_type(path))) {
+                bool  gzip   = file->gzipped && accepts_gzip(req);
+                auto& etag   = gzip ? file->gzip_etag : file->etag;
+                auto  status = etag_matches(req[http::field::if_none_match], etag) ? http::status::not_modified : http::status::ok;
+                http::response<shared_body> res{status, req.version()};
+                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+                res.set(http::field::content_type, mime_type(path));
+                res.set(http::field::etag, etag);
+                if (file->gzipped)
+                    res.set(http::field::vary, "Accept-Encoding");
+                if (gzip)
+                    res.set(http::field::content_encoding, "gzip");
+                res.keep_alive(req.keep_alive());
+                if (status == http::status::not_modified)
+                    return send(std::move(res));
+                res.content_length((gzip ? file->gzipped : file->content)->size());
+                if (req.method() == http::verb::get)
+                    res.body() = gzip ? file->gzipped : file->content;
+                return send(std::move(res));
+            }
+
             // Attempt to open the file
             beast::error_code           ec;
             http::file_body::value_type body;
@@ -277,6 +656,318 @@ void handle_request(
     }
 }
 
+// Counts subscriptions per client address across all of its websocket connections
+class subscription_limits {
+    std::mutex                                mutex;
+    std::unordered_map<std::string, uint32_t> per_client;
+    uint32_t                                  max_per_client = 0; // 0: unlimited
+
+  public:
+    explicit subscription_limits(uint32_t max_per_client)
+        : max_per_client(max_per_client) {}
+
+    bool acquire(const std::string& client) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto&                       count = per_client[client];
+        if (max_per_client && count >= max_per_client)
+            return false;
+        ++count;
+        return true;
+    }
+
+    void release(const std::string& client, uint32_t n) {
+        if (!n)
+            return;
+        std::lock_guard<std::mutex> lock{mutex};
+        auto                        it = per_client.find(client);
+        if (it != per_client.end() && !(it->second -= std::min(n, it->second)))
+            per_client.erase(it);
+    }
+};
+
+// Handles a websocket client on /wasmql/v1/subscribe. Each message from the client registers a
+// query: a binary message holds a /wasmql/v1/query request; a text message holds a legacy
+// target, a newline, then the request body. Queries are rerun when the head block changes and a
+// reply is pushed only when it differs from the last one sent for that subscription.
+class subscription_session : public std::enable_shared_from_this<subscription_session> {
+    struct subscription {
+        uint32_t          id         = 0;
+        std::string       target     = {}; // empty for /wasmql/v1/query requests
+        std::vector<char> request    = {};
+        std::vector<char> last_reply = {};
+        bool              sent       = false;
+    };
+
+    struct message {
+        bool              binary = false;
+        std::vector<char> data   = {};
+    };
+
+    websocket::stream<beast::tcp_stream>       ws_;
+    beast::tcp_stream::executor_type           executor_;
+    beast::flat_buffer                         buffer_;
+    std::shared_ptr<const shared_state>        shared_state_;
+    const named_database*                      database_;
+    std::shared_ptr<thread_state_cache>        state_cache_;
+    std::shared_ptr<execution_pool>            exec_pool_;
+    std::shared_ptr<subscription_limits>       limits_;
+    std::string                                client_; // refreshes count against this client's limits
+    std::vector<std::shared_ptr<subscription>> subscriptions_;
+    std::deque<message>                        writes_;
+    uint32_t                                   next_id_    = 0;
+    bool                                       evaluating_ = false;
+    bool                                       dirty_      = false;
+
+  public:
+    subscription_session(
+        tcp::socket&& socket, const std::shared_ptr<const shared_state>& shared_state, const named_database* database,
+        const std::shared_ptr<thread_state_cache>& state_cache, const std::shared_ptr<execution_pool>& exec_pool,
+        const std::shared_ptr<subscription_limits>& limits, const std::string& client)
+        : ws_(std::move(socket))
+        , executor_(ws_.get_executor())
+        , shared_state_(shared_state)
+        , database_(database)
+        , state_cache_(state_cache)
+        , exec_pool_(exec_pool)
+        , limits_(limits)
+        , client_(client) {}
+
+    ~subscription_session() { limits_->release(client_, subscriptions_.size()); }
+
+    // Accept the websocket upgrade request
+    template <class Body, class Allocator>
+    void run(http::request<Body, http::basic_fields<Allocator>>&& req) {
+        ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+        ws_.read_message_max(10000);
+        ws_.async_accept(req, beast::bind_front_handler(&subscription_session::on_accept, shared_from_this()));
+    }
+
+    const named_database* database() const { return database_; }
+
+    // Called by head_watcher on any thread
+    void on_head_changed() {
+        net::post(executor_, [self = shared_from_this()] { self->evaluate(); });
+    }
+
+  private:
+    void on_accept(beast::error_code ec) {
+        if (ec)
+            return fail(ec, "accept");
+        do_read();
+    }
+
+    void do_read() { ws_.async_read(buffer_, beast::bind_front_handler(&subscription_session::on_read, shared_from_this())); }
+
+    void on_read(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+
+        // This means they closed the connection
+        if (ec == websocket::error::closed)
+            return;
+
+        if (ec)
+            return fail(ec, "read");
+
+        auto data = beast::buffers_to_string(buffer_.data());
+        buffer_.consume(buffer_.size());
+
+        auto sub = std::make_shared<subscription>();
+        sub->id  = next_id_++;
+        if (ws_.got_binary()) {
+            sub->request.assign(data.begin(), data.end());
+        } else {
+            auto nl = data.find('\n');
+            if (nl != std::string::npos && !data.compare(0, 4, "/v1/")) {
+                sub->target = data.substr(0, nl);
+                sub->request.assign(data.begin() + nl + 1, data.end());
+            } else {
+                sub.reset();
+            }
+        }
+
+        if (!sub)
+            write(error_message(next_id_ - 1, "expected a legacy target, a newline, then the request"));
+        else if (!limits_->acquire(client_))
+            write(error_message(sub->id, "too many subscriptions"));
+        else {
+            subscriptions_.push_back(std::move(sub));
+            evaluate();
+        }
+        do_read();
+    }
+
+    static message error_message(uint32_t id, const std::string& what) {
+        auto text = std::to_string(id) + "\nerror: " + what;
+        return {false, {text.begin(), text.end()}};
+    }
+
+    // Rerun every query on the execution pool. Only one run is in flight at a time; a head change
+    // during a run schedules another.
+    void evaluate() {
+        if (evaluating_) {
+            dirty_ = true;
+            return;
+        }
+        if (subscriptions_.empty())
+            return;
+        evaluating_ = true;
+        dirty_      = false;
+        auto posted = exec_pool_->post(
+            [self = shared_from_this(), subs = subscriptions_] {
+                std::vector<message> messages;
+                // The completion below must always be posted; it's what lets this connection evaluate again
+                try {
+                    auto thread_state      = self->state_cache_->get_state();
+                    thread_state->database = self->database_;
+                    for (auto& sub : subs) {
+                        std::vector<char> reply;
+                        try {
+                            if (sub->target.empty())
+                                reply = query(*thread_state, sub->request);
+                            else
+                                reply = legacy_query(*thread_state, sub->target, sub->request);
+                        } catch (const std::exception& e) {
+                            messages.push_back(error_message(sub->id, e.what()));
+                            continue;
+                        } catch (...) {
+                            messages.push_back(error_message(sub->id, "unknown exception"));
+                            continue;
+                        }
+                        if (sub->sent && reply == sub->last_reply)
+                            continue;
+                        sub->sent       = true;
+                        sub->last_reply = reply;
+                        if (sub->target.empty()) {
+                            message m{true};
+                            abieos::push_varuint32(m.data, sub->id);
+                            m.data.insert(m.data.end(), reply.begin(), reply.end());
+                            messages.push_back(std::move(m));
+                        } else {
+                            auto id = std::to_string(sub->id) + "\n";
+                            message m{false, {id.begin(), id.end()}};
+                            m.data.insert(m.data.end(), reply.begin(), reply.end());
+                            messages.push_back(std::move(m));
+                        }
+                    }
+                    self->state_cache_->store_state(std::move(thread_state));
+                } catch (const std::exception& e) {
+                    elog("subscription evaluation failed: ${s}", ("s", e.what()));
+                } catch (...) {
+                    elog("subscription evaluation failed: unknown exception");
+                }
+                net::post(self->executor_, [self, messages = std::move(messages)]() mutable {
+                    for (auto& m : messages)
+                        self->write(std::move(m));
+                    self->evaluating_ = false;
+                    if (self->dirty_)
+                        self->evaluate();
+                });
+            },
+            execution_pool::priority::low, client_);
+        // Server or client is busy; try again on the next head change
+        if (posted != execution_pool::admission::accepted)
+            evaluating_ = false;
+    }
+
+    void write(message m) {
+        writes_.push_back(std::move(m));
+        if (writes_.size() == 1)
+            do_write();
+    }
+
+    void do_write() {
+        ws_.binary(writes_.front().binary);
+        ws_.async_write(net::buffer(writes_.front().data), beast::bind_front_handler(&subscription_session::on_write, shared_from_this()));
+    }
+
+    void on_write(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+        if (ec)
+            return fail(ec, "write");
+        writes_.pop_front();
+        if (!writes_.empty())
+            do_write();
+    }
+};
+
+// Polls fill_status of each database someone is subscribed to and notifies that database's
+// subscription sessions when its head block changes. Polling only runs while someone is subscribed.
+class head_watcher : public std::enable_shared_from_this<head_watcher> {
+    net::steady_timer                                           timer_;
+    std::shared_ptr<const shared_state>                         shared_state_;
+    std::shared_ptr<execution_pool>                             exec_pool_;
+    std::mutex                                                  mutex_;
+    std::vector<std::weak_ptr<subscription_session>>            subscribers_;
+    std::map<const named_database*, state_history::fill_status> status_; // only used by the posted poll
+    std::shared_ptr<subscription_limits>                        limits_;
+
+  public:
+    head_watcher(
+        net::io_context& ioc, const std::shared_ptr<const shared_state>& shared_state, const std::shared_ptr<execution_pool>& exec_pool)
+        : timer_(ioc)
+        , shared_state_(shared_state)
+        , exec_pool_(exec_pool)
+        , limits_(std::make_shared<subscription_limits>(shared_state->max_subscriptions)) {}
+
+    void run() { schedule(); }
+
+    const std::shared_ptr<subscription_limits>& limits() const { return limits_; }
+
+    void subscribe(const std::shared_ptr<subscription_session>& session) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        subscribers_.push_back(session);
+    }
+
+  private:
+    void schedule() {
+        timer_.expires_after(std::chrono::milliseconds(shared_state_->subscribe_poll_ms));
+        timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+            if (!ec)
+                self->poll();
+        });
+    }
+
+    std::vector<std::shared_ptr<subscription_session>> live_subscribers() {
+        std::lock_guard<std::mutex>                        lock{mutex_};
+        std::vector<std::shared_ptr<subscription_session>> result;
+        auto it = std::remove_if(subscribers_.begin(), subscribers_.end(), [&](auto& weak) {
+            auto session = weak.lock();
+            if (session)
+                result.push_back(std::move(session));
+            return !session;
+        });
+        subscribers_.erase(it, subscribers_.end());
+        return result;
+    }
+
+    void poll() {
+        std::set<const named_database*> databases;
+        for (auto& session : live_subscribers())
+            databases.insert(session->database());
+        if (databases.empty())
+            return schedule();
+        auto posted = exec_pool_->post([self = shared_from_this(), databases = std::move(databases)] {
+            for (auto* database : databases) {
+                try {
+                    auto  status = database->db_iface->create_query_session()->get_fill_status();
+                    auto& last   = self->status_[database];
+                    if (status.head != last.head || status.head_id.value != last.head_id.value) {
+                        last = status;
+                        for (auto& session : self->live_subscribers())
+                            if (session->database() == database)
+                                session->on_head_changed();
+                    }
+                } catch (const std::exception& e) {
+                    elog("subscription head check failed: ${s}", ("s", e.what()));
+                }
+            }
+            net::post(self->timer_.get_executor(), [self] { self->schedule(); });
+        });
+        if (posted != execution_pool::admission::accepted)
+            schedule();
+    }
+};
+
 // Handles an HTTP server connection
 class http_session : public std::enable_shared_from_this<http_session> {
     // This queue is used for HTTP pipelining.
@@ -293,7 +984,8 @@ class http_session : public std::enable_shared_from_this<http_session> {
         };
 
         http_session&                      self_;
-        std::vector<std::unique_ptr<work>> items_;
+        std::vector<std::unique_ptr<work>> items_;     // null: response is still being produced
+        uint64_t                           first_ = 0; // slot number of items_.front()
 
       public:
         explicit queue(http_session& self)
@@ -311,14 +1003,101 @@ class http_session : public std::enable_shared_from_this<http_session> {
             BOOST_ASSERT(!items_.empty());
             const auto was_full = is_full();
             items_.erase(items_.begin());
-            if (!items_.empty())
+            ++first_;
+            if (!items_.empty() && items_.front())
                 (*items_.front())();
             return was_full;
         }
 
-        // Called by the HTTP handler to send a response.
+        // Reserves a place in the response order for a request which is answered later
+        uint64_t reserve() {
+            items_.emplace_back();
+            return first_ + items_.size() - 1;
+        }
+
+        // A response whose body is sent with chunked encoding while it's still being produced
+        struct chunked_work : work {
+            http_session&                               self_;
+            http::response<http::empty_body>            res_;
+            http::response_serializer<http::empty_body> sr_;
+            std::deque<std::vector<char>>               chunks_;
+            bool                                        started_        = false;
+            bool                                        writing_        = false;
+            bool                                        header_written_ = false;
+            bool                                        done_           = false;
+
+            chunked_work(http_session& self, http::response<http::empty_body>&& res)
+                : self_(self)
+                , res_(std::move(res))
+                , sr_(res_) {}
+
+            void operator()() {
+                started_ = true;
+                write_next();
+            }
+
+            void write_next() {
+                if (!started_ || writing_)
+                    return;
+                auto self = self_.shared_from_this();
+                if (!header_written_) {
+                    writing_ = true;
+                    http::async_write_header(self_.stream_, sr_, [this, self](beast::error_code ec, std::size_t) {
+                        writing_ = false;
+                        if (ec)
+                            return fail(ec, "write");
+                        header_written_ = true;
+                        write_next();
+                    });
+                } else if (!chunks_.empty()) {
+                    writing_ = true;
+                    auto on_chunk = [this, self](beast::error_code ec, std::size_t) {
+                        writing_ = false;
+                        if (ec)
+                            return fail(ec, "write");
+                        chunks_.pop_front();
+                        write_next();
+                    };
+                    net::async_write(self_.stream_, http::make_chunk(net::buffer(chunks_.front())), std::move(on_chunk));
+                } else if (done_) {
+                    writing_ = true;
+                    auto on_last = [this, self](beast::error_code ec, std::size_t bytes_transferred) {
+                        // on_write() destroys this
+                        self->on_write(res_.need_eof(), ec, bytes_transferred);
+                    };
+                    net::async_write(self_.stream_, http::make_chunk_last(), std::move(on_last));
+                }
+            }
+        };
+
+        // Starts a chunked response in a reserved slot
+        void begin_chunked(uint64_t slot, http::response<http::empty_body>&& res) {
+            auto& item = items_[slot - first_];
+            item       = boost::make_unique<chunked_work>(self_, std::move(res));
+            if (slot == first_)
+                (*item)();
+        }
+
+        // Adds body data to a chunked response
+        void add_chunk(uint64_t slot, std::vector<char>&& data, bool last) {
+            auto& item = static_cast<chunked_work&>(*items_[slot - first_]);
+            if (!data.empty())
+                item.chunks_.push_back(std::move(data));
+            item.done_ = item.done_ || last;
+            item.write_next();
+        }
+
+        // Supplies the response for a reserved slot
         template <bool isRequest, class Body, class Fields>
-        void operator()(http::message<isRequest, Body, Fields>&& msg) {
+        void fill(uint64_t slot, http::message<isRequest, Body, Fields>&& msg) {
+            // Part of a chunked response already went out, so the client can't be told about this
+            // response (usually an error) other than by dropping the connection
+            if (items_[slot - first_]) {
+                beast::error_code ec;
+                self_.stream_.socket().shutdown(tcp::socket::shutdown_both, ec);
+                return;
+            }
+
             // This holds a work item
             struct work_impl : work {
                 http_session&                          self_;
@@ -335,19 +1114,66 @@ class http_session : public std::enable_shared_from_this<http_session> {
             };
 
             // Allocate and store the work
-            items_.push_back(boost::make_unique<work_impl>(self_, std::move(msg)));
+            auto& item = items_[slot - first_];
+            item       = boost::make_unique<work_impl>(self_, std::move(msg));
 
-            // If there was no previous work, start this one
-            if (items_.size() == 1)
-                (*items_.front())();
+            // If it's next in line, start it. Earlier slots start it from on_write().
+            if (slot == first_)
+                (*item)();
+        }
+
+        // Called by the HTTP handler to send a response.
+        template <bool isRequest, class Body, class Fields>
+        void operator()(http::message<isRequest, Body, Fields>&& msg) {
+            fill(reserve(), std::move(msg));
+        }
+    };
+
+    // Delivers a response produced on the execution pool back to the session's strand
+    struct deferred_send {
+        std::shared_ptr<http_session> self;
+        uint64_t                      slot;
+
+        template <bool isRequest, class Body, class Fields>
+        void operator()(http::message<isRequest, Body, Fields>&& msg) const {
+            net::post(self->stream_.get_executor(), [self = self, slot = slot, msg = std::move(msg)]() mutable {
+                self->queue_.fill(slot, std::move(msg));
+            });
+        }
+
+        // Returns a sink which sends reply data as chunks before the query finishes. The first
+        // call sends `header`.
+        std::function<void(std::vector<char>&&)> chunk_sink(http::response<http::empty_body>&& header) const {
+            auto shared_header = std::make_shared<http::response<http::empty_body>>(std::move(header));
+            auto started       = std::make_shared<bool>(false);
+            return [self = self, slot = slot, shared_header, started](std::vector<char>&& data) {
+                bool first = !*started;
+                *started   = true;
+                net::post(self->stream_.get_executor(), [self, slot, shared_header, first, data = std::move(data)]() mutable {
+                    if (first)
+                        self->queue_.begin_chunked(slot, std::move(*shared_header));
+                    self->queue_.add_chunk(slot, std::move(data), false);
+                });
+            };
+        }
+
+        // Sends the rest of a reply which went through chunk_sink()
+        void finish_chunks(std::vector<char>&& data) const {
+            net::post(self->stream_.get_executor(), [self = self, slot = slot, data = std::move(data)]() mutable {
+                self->queue_.add_chunk(slot, std::move(data), true);
+            });
         }
     };
 
     beast::tcp_stream                   stream_;
     beast::flat_buffer                  buffer_;
     std::shared_ptr<const std::string>  doc_root_;
+    std::shared_ptr<static_file_cache>  static_files_;
     std::shared_ptr<const shared_state> shared_state_;
     std::shared_ptr<thread_state_cache> state_cache_;
+    std::shared_ptr<execution_pool>     exec_pool_;
+    std::shared_ptr<head_watcher>       head_watcher_;
+    std::string                         client_; // remote address, for per-client limits
     queue                               queue_;
 
     // The parser is stored in an optional container so we can
@@ -357,13 +1183,22 @@ class http_session : public std::enable_shared_from_this<http_session> {
   public:
     // Take ownership of the socket
     http_session(
-        tcp::socket&& socket, const std::shared_ptr<const std::string>& doc_root, const std::shared_ptr<const shared_state>& shared_state,
-        const std::shared_ptr<thread_state_cache>& state_cache)
+        tcp::socket&& socket, const std::shared_ptr<const std::string>& doc_root, const std::shared_ptr<static_file_cache>& static_files,
+        const std::shared_ptr<const shared_state>& shared_state, const std::shared_ptr<thread_state_cache>& state_cache,
+        const std::shared_ptr<execution_pool>& exec_pool, const std::shared_ptr<head_watcher>& head_watcher)
         : stream_(std::move(socket))
         , doc_root_(doc_root)
+        , static_files_(static_files)
         , shared_state_(shared_state)
         , state_cache_(state_cache)
-        , queue_(*this) {}
+        , exec_pool_(exec_pool)
+        , head_watcher_(head_watcher)
+        , queue_(*this) {
+        beast::error_code ec;
+        auto              endpoint = stream_.socket().remote_endpoint(ec);
+        if (!ec)
+            client_ = endpoint.address().to_string();
+    }
 
     // Start the session
     void run() { do_read(); }
@@ -394,14 +1229,56 @@ class http_session : public std::enable_shared_from_this<http_session> {
         if (ec)
             return fail(ec, "read");
 
+        // Select the database; this strips a /<name> prefix from the target
+        auto& req      = parser_->get();
+        auto  target   = req.target().to_string();
+        auto  database = shared_state_->route(target, {req[http::field::host].data(), req[http::field::host].size()});
+        req.target(target);
+
+        // Hand the connection over to a subscription session
+        if (websocket::is_upgrade(req) && req.target() == "/wasmql/v1/subscribe" && database) {
+            auto session = std::make_shared<subscription_session>(
+                stream_.release_socket(), shared_state_, database, state_cache_, exec_pool_, head_watcher_->limits(), client_);
+            head_watcher_->subscribe(session);
+            return session->run(parser_->release());
+        }
+
         // Send the response
-        handle_request(*doc_root_, shared_state_, state_cache_, parser_->release(), queue_);
+        if (is_query_target(req.target()))
+            execute(parser_->release(), database);
+        else
+            handle_request(*doc_root_, *static_files_, shared_state_, database, state_cache_, parser_->release(), queue_);
 
         // If we aren't at the queue limit, try to pipeline another request
         if (!queue_.is_full())
             do_read();
     }
 
+    // Run a query on the execution pool; its response keeps its place in the pipeline
+    void execute(http::request<http::vector_body<char>>&& req, const named_database* database) {
+        auto slot       = queue_.reserve();
+        auto version    = req.version();
+        auto keep_alive = req.keep_alive();
+        auto prio       = is_cheap_target(req.target()) ? execution_pool::priority::high : execution_pool::priority::low;
+        auto admission  = exec_pool_->post(
+            [self = shared_from_this(), slot, database, req = std::move(req)]() mutable {
+                handle_request(
+                    *self->doc_root_, *self->static_files_, self->shared_state_, database, self->state_cache_, std::move(req),
+                    deferred_send{self, slot});
+            },
+            prio, client_);
+        if (admission != execution_pool::admission::accepted) {
+            bool busy = admission == execution_pool::admission::busy;
+            http::response<http::string_body> res{busy ? http::status::service_unavailable : http::status::too_many_requests, version};
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            res.set(http::field::content_type, "text/html");
+            res.keep_alive(keep_alive);
+            res.body() = busy ? "Server is busy\n" : "Too many concurrent requests from this client\n";
+            res.prepare_payload();
+            queue_.fill(slot, std::move(res));
+        }
+    }
+
     void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
 
@@ -435,18 +1312,24 @@ class listener : public std::enable_shared_from_this<listener> {
     net::io_context&                    ioc_;
     tcp::acceptor                       acceptor_;
     std::shared_ptr<const std::string>  doc_root_;
+    std::shared_ptr<static_file_cache>  static_files_;
     std::shared_ptr<const shared_state> shared_state_;
     std::shared_ptr<thread_state_cache> state_cache_;
+    std::shared_ptr<execution_pool>     exec_pool_;
+    std::shared_ptr<head_watcher>       head_watcher_;
 
   public:
     listener(
         net::io_context& ioc, tcp::endpoint endpoint, const std::shared_ptr<const std::string>& doc_root,
-        const std::shared_ptr<const shared_state>& shared_state)
+        const std::shared_ptr<const shared_state>& shared_state, const std::shared_ptr<execution_pool>& exec_pool)
         : ioc_(ioc)
         , acceptor_(net::make_strand(ioc))
         , doc_root_(doc_root)
+        , static_files_(std::make_shared<static_file_cache>(shared_state->static_cache_size))
         , shared_state_(shared_state)
-        , state_cache_(std::make_shared<thread_state_cache>(shared_state_)) {
+        , state_cache_(std::make_shared<thread_state_cache>([shared_state] { return make_thread_state(shared_state); }))
+        , exec_pool_(exec_pool)
+        , head_watcher_(std::make_shared<head_watcher>(ioc, shared_state_, exec_pool_)) {
 
         beast::error_code ec;
 
@@ -480,7 +1363,10 @@ class listener : public std::enable_shared_from_this<listener> {
     }
 
     // Start accepting incoming connections
-    void run() { do_accept(); }
+    void run() {
+        head_watcher_->run();
+        do_accept();
+    }
 
   private:
     void do_accept() {
@@ -493,7 +1379,9 @@ class listener : public std::enable_shared_from_this<listener> {
             fail(ec, "accept");
         } else {
             // Create the http session and run it
-            std::make_shared<http_session>(std::move(socket), doc_root_, shared_state_, state_cache_)->run();
+            auto session = std::make_shared<http_session>(
+                std::move(socket), doc_root_, static_files_, shared_state_, state_cache_, exec_pool_, head_watcher_);
+            session->run();
         }
 
         // Accept another connection
@@ -503,19 +1391,25 @@ class listener : public std::enable_shared_from_this<listener> {
 
 struct server_impl : http_server, std::enable_shared_from_this<server_impl> {
     int                                 num_threads;
+    int                                 num_http_threads;
     net::io_service                     ioc;
-    std::shared_ptr<const shared_state> state    = {};
-    std::string                         address  = {};
-    std::string                         port     = {};
-    std::vector<std::thread>            threads  = {};
-    std::unique_ptr<tcp::acceptor>      acceptor = {};
-
-    server_impl(int num_threads, const std::shared_ptr<const shared_state>& state, const std::string& address, const std::string& port)
+    std::shared_ptr<const shared_state> state     = {};
+    std::string                         address   = {};
+    std::string                         port      = {};
+    std::vector<std::thread>            threads   = {};
+    std::unique_ptr<tcp::acceptor>      acceptor  = {};
+    std::shared_ptr<execution_pool>     exec_pool = {};
+
+    server_impl(
+        int num_threads, int num_http_threads, uint32_t max_pending, const std::shared_ptr<const shared_state>& state,
+        const std::string& address, const std::string& port)
         : num_threads{num_threads}
-        , ioc{num_threads}
+        , num_http_threads{num_http_threads}
+        , ioc{num_http_threads}
         , state{state}
         , address{address}
-        , port{port} {}
+        , port{port}
+        , exec_pool{std::make_shared<execution_pool>(num_threads, max_pending, state->max_per_client)} {}
 
     virtual ~server_impl() {}
 
@@ -524,6 +1418,7 @@ struct server_impl : http_server, std::enable_shared_from_this<server_impl> {
         for (auto& t : threads)
             t.join();
         threads.clear();
+        exec_pool->stop();
     }
 
     void start() {
@@ -543,19 +1438,22 @@ struct server_impl : http_server, std::enable_shared_from_this<server_impl> {
             throw std::runtime_error("make_address(): "s + address + ": " + e.what());
         }
         std::make_shared<listener>(
-            ioc, tcp::endpoint{a, (unsigned short)std::atoi(port.c_str())}, std::make_shared<std::string>(state->static_dir), state)
+            ioc, tcp::endpoint{a, (unsigned short)std::atoi(port.c_str())}, std::make_shared<std::string>(state->static_dir), state,
+            exec_pool)
             ->run();
 
-        threads.reserve(num_threads);
-        for (int i = 0; i < num_threads; ++i)
+        threads.reserve(num_http_threads);
+        for (int i = 0; i < num_http_threads; ++i)
             threads.emplace_back([self = shared_from_this()] { self->ioc.run(); });
     }
 }; // server_impl
 
 std::shared_ptr<http_server> http_server::create(
-    int num_threads, const std::shared_ptr<const shared_state>& state, const std::string& address, const std::string& port) {
+    int num_threads, int num_http_threads, uint32_t max_pending, const std::shared_ptr<const shared_state>& state,
+    const std::string& address, const std::string& port) {
     FC_ASSERT(num_threads > 0, "too few threads");
-    auto server = std::make_shared<server_impl>(num_threads, state, address, port);
+    FC_ASSERT(num_http_threads > 0, "too few http threads");
+    auto server = std::make_shared<server_impl>(num_threads, num_http_threads, max_pending, state, address, port);
     server->start();
     return server;
 }
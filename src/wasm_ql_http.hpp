@@ -9,7 +9,8 @@ struct http_server {
     virtual ~http_server() {}
 
     static std::shared_ptr<http_server> create( //
-        int num_threads, const std::shared_ptr<const shared_state>& state, const std::string& address, const std::string& port);
+        int num_threads, int num_http_threads, uint32_t max_pending, const std::shared_ptr<const shared_state>& state,
+        const std::string& address, const std::string& port);
 
     virtual void stop() = 0;
 };
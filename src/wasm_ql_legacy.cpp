@@ -0,0 +1,452 @@
+// copyright defined in LICENSE.txt
+
+// Native implementations of the busiest legacy (/v1/...) endpoints. They send the same
+// query_database requests as legacy-server.wasm and produce the same JSON, without the cost of
+// instantiating the wasm and parsing/building JSON inside it. A handler returns false for
+// requests it doesn't cover; the caller then falls back to the wasm.
+
+#include "wasm_ql.hpp"
+
+#include <eosio/abi.hpp>
+#include <eosio/from_bin.hpp>
+#include <eosio/from_json.hpp>
+#include <eosio/to_bin.hpp>
+
+using namespace std::literals;
+
+namespace wasm_ql::legacy {
+
+struct get_table_rows_params {
+    bool        json           = false;
+    eosio::name code           = {};
+    std::string scope          = {};
+    eosio::name table          = {};
+    std::string table_key      = {};
+    std::string lower_bound    = {};
+    std::string upper_bound    = {};
+    uint32_t    limit          = 10;
+    std::string key_type       = {};
+    std::string index_position = {};
+    std::string encode_type    = {};
+    bool        reverse        = false;
+    bool        show_payer     = false;
+};
+
+EOSIO_REFLECT(
+    get_table_rows_params, json, code, scope, table, table_key, lower_bound, upper_bound, limit, key_type, index_position, encode_type,
+    reverse, show_payer)
+
+struct get_currency_balance_params {
+    eosio::name account = {};
+    eosio::name code    = {};
+    std::string symbol  = {};
+};
+
+EOSIO_REFLECT(get_currency_balance_params, account, code, symbol)
+
+struct get_account_params {
+    eosio::name account_name = {};
+};
+
+EOSIO_REFLECT(get_account_params, account_name)
+
+// Matches eosio::query_contract_row_range_code_table_scope_pk
+struct contract_row_key {
+    eosio::name code        = {};
+    eosio::name table       = {};
+    eosio::name scope       = {};
+    uint64_t    primary_key = {};
+};
+
+EOSIO_REFLECT(contract_row_key, code, table, scope, primary_key)
+
+static bool increment_key(contract_row_key& key) {
+    return !++key.primary_key && !++key.scope.value && !++key.table.value && !++key.code.value;
+}
+
+struct query_contract_row_range {
+    eosio::name      query_name     = eosio::name{"cr.ctsp"};
+    uint32_t         snapshot_block = {};
+    contract_row_key first          = {};
+    contract_row_key last           = {};
+    uint32_t         max_results    = {};
+};
+
+EOSIO_REFLECT(query_contract_row_range, query_name, snapshot_block, first, last, max_results)
+
+// Matches eosio::query_account_range_name
+struct query_account_range {
+    eosio::name query_name     = eosio::name{"account"};
+    uint32_t    snapshot_block = {};
+    eosio::name first          = {};
+    eosio::name last           = {};
+    uint32_t    max_results    = {};
+};
+
+EOSIO_REFLECT(query_account_range, query_name, snapshot_block, first, last, max_results)
+
+struct contract_row {
+    uint32_t            block_num   = {};
+    bool                present     = {};
+    eosio::name         code        = {};
+    eosio::name         scope       = {};
+    eosio::name         table       = {};
+    uint64_t            primary_key = {};
+    eosio::name         payer       = {};
+    eosio::input_stream value       = {};
+};
+
+EOSIO_REFLECT(contract_row, block_num, present, code, scope, table, primary_key, payer, value)
+
+struct account {
+    uint32_t            block_num     = {};
+    bool                present       = {};
+    eosio::name         name          = {};
+    uint32_t            creation_date = {}; // block_timestamp slot
+    eosio::input_stream abi           = {};
+};
+
+EOSIO_REFLECT(account, block_num, present, name, creation_date, abi)
+
+struct contract_abi {
+    eosio::abi_def def = {};
+    eosio::abi     abi = {};
+};
+
+template <typename T>
+static bool parse_params(std::string_view request, T& params) {
+    try {
+        std::string json{request};
+        auto        stream = eosio::json_token_stream{json.data()};
+        from_json(params, stream);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+template <typename T>
+static std::vector<char> query_database(wasm_ql::thread_state& thread_state, const T& query) {
+    auto         bin = eosio::convert_to_bin(query);
+    scoped_timer timer{thread_state.timing.database_ns};
+    return thread_state.query_session->query_database({bin.data(), bin.data() + bin.size()}, thread_state.fill_status.head);
+}
+
+template <typename T, typename F>
+static void for_each_query_result(const std::vector<char>& result, F f) {
+    eosio::input_stream bin{result.data(), result.size()};
+    uint32_t            size;
+    eosio::varuint32_from_bin(size, bin);
+    for (uint32_t i = 0; i < size; ++i) {
+        eosio::input_stream record;
+        from_bin(record, bin);
+        T row;
+        from_bin(row, record);
+        f(row);
+    }
+}
+
+// Matches eosio::for_each_query_result_paged. Follows the cursor which query_database appends
+// to each page until f returns false or the range is exhausted.
+template <typename F>
+static void for_each_contract_row_paged(wasm_ql::thread_state& thread_state, query_contract_row_range query, F f) {
+    while (true) {
+        auto                result = query_database(thread_state, query);
+        eosio::input_stream bin{result.data(), result.size()};
+        uint32_t            size;
+        eosio::varuint32_from_bin(size, bin);
+        contract_row_key last;
+        for (uint32_t i = 0; i < size; ++i) {
+            eosio::input_stream record;
+            from_bin(record, bin);
+            contract_row row;
+            from_bin(row, record);
+            last = {.code = row.code, .table = row.table, .scope = row.scope, .primary_key = row.primary_key};
+            if (!f(row))
+                return;
+        }
+        if (bin.pos != bin.end) {
+            if (!eosio::from_bin<uint8_t>(bin))
+                return;
+            from_bin(query.snapshot_block, bin);
+            from_bin(query.first, bin);
+        } else {
+            if (!size || size < query.max_results)
+                return;
+            query.first = last;
+        }
+        if (increment_key(query.first))
+            return;
+    }
+}
+
+static void append_hex(std::string& dest, eosio::input_stream bin) {
+    static const char hex_digits[] = "0123456789ABCDEF";
+    for (; bin.pos != bin.end; ++bin.pos) {
+        dest += hex_digits[uint8_t(*bin.pos) >> 4];
+        dest += hex_digits[uint8_t(*bin.pos) & 15];
+    }
+}
+
+// Same format as the wasm library's to_json(block_timestamp)
+static void append_block_timestamp(std::string& dest, uint32_t slot) {
+    int64_t ms   = slot * 500ll + 946'684'800'000ll;
+    time_t  secs = ms / 1000;
+    tm      t;
+    gmtime_r(&secs, &t);
+    char buf[32];
+    snprintf(
+        buf, sizeof(buf), "\"%04d-%02d-%02dT%02d:%02d:%02d.%03d\"", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min,
+        t.tm_sec, int(ms % 1000));
+    dest += buf;
+}
+
+static void append_asset(std::string& dest, int64_t amount, uint64_t symbol) {
+    uint8_t  precision = symbol & 0xff;
+    uint64_t p10       = 1;
+    for (uint8_t i = 0; i < precision; ++i)
+        p10 *= 10;
+    uint64_t abs_amount = amount < 0 ? -uint64_t(amount) : amount;
+    if (amount < 0)
+        dest += '-';
+    dest += std::to_string(abs_amount / p10);
+    if (precision) {
+        auto fraction = std::to_string(abs_amount % p10);
+        dest += '.';
+        dest.append(precision - fraction.size(), '0');
+        dest += fraction;
+    }
+    dest += ' ';
+    for (symbol >>= 8; symbol; symbol >>= 8)
+        dest += char(symbol & 0xff);
+}
+
+static bool parse_uint64(std::string_view s, uint64_t& result) {
+    if (s.empty() || s.size() > 20)
+        return false;
+    unsigned __int128 v = 0;
+    for (auto c : s) {
+        if (c < '0' || c > '9')
+            return false;
+        v = v * 10 + (c - '0');
+    }
+    if (v > std::numeric_limits<uint64_t>::max())
+        return false;
+    result = v;
+    return true;
+}
+
+// Only accepts names which round-trip; the wasm decides what to do with anything else
+static bool parse_name(std::string_view s, uint64_t& result) {
+    if (s.empty() || s.size() > 13)
+        return false;
+    eosio::name n{s};
+    if (n.to_string() != s)
+        return false;
+    result = n.value;
+    return true;
+}
+
+static bool parse_symbol_code(std::string_view s, uint64_t& result) {
+    if (s.empty() || s.size() > 7)
+        return false;
+    result = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] < 'A' || s[i] > 'Z')
+            return false;
+        result |= uint64_t(s[i]) << (8 * i);
+    }
+    return true;
+}
+
+static std::unique_ptr<contract_abi> get_abi(wasm_ql::thread_state& thread_state, eosio::name name) {
+    std::unique_ptr<contract_abi> result;
+    auto                          rows = query_database(
+        thread_state, query_account_range{
+                          .snapshot_block = thread_state.fill_status.head,
+                          .first          = name,
+                          .last           = name,
+                          .max_results    = 1,
+                      });
+    for_each_query_result<account>(rows, [&](account& a) {
+        if (!a.present || a.abi.pos == a.abi.end)
+            return;
+        try {
+            auto abi = std::make_unique<contract_abi>();
+            from_bin(abi->def, a.abi);
+            if (abi->def.version.substr(0, 13) != "eosio::abi/1.")
+                return;
+            eosio::convert(abi->def, abi->abi);
+            result = std::move(abi);
+        } catch (...) {
+            // treated like the wasm treats a bad abi: rows are returned as hex
+        }
+    });
+    return result;
+}
+
+static const eosio::abi_type* get_table_type(const contract_abi* abi, eosio::name table) {
+    if (!abi)
+        return nullptr;
+    for (auto& table_def : abi->def.tables) {
+        if (table_def.name == table) {
+            auto it = abi->abi.abi_types.find(table_def.type);
+            if (it != abi->abi.abi_types.end())
+                return &it->second;
+        }
+    }
+    return nullptr;
+}
+
+// Only covers the primary index with integer or name keys; everything else goes to the wasm
+static bool get_table_rows(wasm_ql::thread_state& thread_state, std::string_view request) {
+    get_table_rows_params params;
+    if (!parse_params(request, params))
+        return false;
+    if ((params.table.value & 0xFFFF'FFFF'FFFF'FFF0ull) != params.table.value)
+        return false;
+    auto& pos = params.index_position;
+    if (!(pos.empty() || pos == "first" || pos == "primary" || pos == "one" || pos == "0" || pos == "1"))
+        return false;
+
+    uint64_t scope;
+    if (!parse_uint64(params.scope, scope) && !parse_name(params.scope, scope))
+        return false;
+
+    auto convert_key = [&](const std::string& key, uint64_t& result) {
+        if (key.empty())
+            return true;
+        if (params.key_type == "name")
+            return parse_name(key, result);
+        return parse_uint64(key, result);
+    };
+    uint64_t lower_bound = 0;
+    uint64_t upper_bound = 0xffff'ffff'ffff'ffff;
+    if (!convert_key(params.lower_bound, lower_bound) || !convert_key(params.upper_bound, upper_bound))
+        return false;
+
+    auto abi        = params.json ? get_abi(thread_state, params.code) : nullptr;
+    auto table_type = get_table_type(abi.get(), params.table);
+
+    contract_row_key first{.code = params.code, .table = params.table, .scope = eosio::name{scope}, .primary_key = lower_bound};
+    contract_row_key last = first;
+    last.primary_key      = upper_bound;
+    uint32_t limit        = std::min((uint32_t)100, params.limit);
+    auto     query        = query_contract_row_range{
+        .snapshot_block = thread_state.fill_status.head,
+        .first          = first,
+        .last           = last,
+        .max_results    = limit,
+    };
+
+    std::string result    = "{\"rows\":[";
+    uint32_t    num_found = 0;
+    for_each_contract_row_paged(thread_state, query, [&](contract_row& r) {
+        if (num_found >= limit)
+            return false;
+        if (!r.present)
+            return true;
+        if (num_found)
+            result += ',';
+        if (params.show_payer)
+            result += "{\"data\":";
+        bool decoded = false;
+        if (table_type) {
+            try {
+                auto bin = r.value;
+                result += table_type->bin_to_json(bin);
+                decoded = true;
+            } catch (...) {
+            }
+        }
+        if (!decoded) {
+            result += '"';
+            append_hex(result, r.value);
+            result += '"';
+        }
+        if (params.show_payer)
+            result += ",\"payer\":\"" + r.payer.to_string() + "\"}";
+        return ++num_found < limit;
+    });
+    result += "]}";
+    thread_state.reply.assign(result.begin(), result.end());
+    return true;
+}
+
+static bool get_currency_balance(wasm_ql::thread_state& thread_state, std::string_view request) {
+    get_currency_balance_params params;
+    uint64_t                    symbol_code;
+    if (!parse_params(request, params) || !parse_symbol_code(params.symbol, symbol_code))
+        return false;
+
+    contract_row_key key{.code = params.code, .table = eosio::name{"accounts"}, .scope = params.account, .primary_key = symbol_code};
+    auto             rows = query_database(
+        thread_state, query_contract_row_range{
+                          .snapshot_block = thread_state.fill_status.head,
+                          .first          = key,
+                          .last           = key,
+                          .max_results    = 10,
+                      });
+
+    std::string result = "[";
+    bool        found  = false;
+    for_each_query_result<contract_row>(rows, [&](contract_row& r) {
+        if (!r.present || r.value.pos == r.value.end)
+            return;
+        auto amount = eosio::from_bin<int64_t>(r.value);
+        auto symbol = eosio::from_bin<uint64_t>(r.value);
+        if (found)
+            result += ',';
+        found = true;
+        result += '"';
+        append_asset(result, amount, symbol);
+        result += '"';
+    });
+    result += "]";
+    thread_state.reply.assign(result.begin(), result.end());
+    return true;
+}
+
+static bool get_account(wasm_ql::thread_state& thread_state, std::string_view request) {
+    get_account_params params;
+    if (!parse_params(request, params))
+        return false;
+
+    auto rows = query_database(
+        thread_state, query_account_range{
+                          .snapshot_block = std::numeric_limits<uint32_t>::max(),
+                          .first          = params.account_name,
+                          .last           = params.account_name,
+                          .max_results    = 1,
+                      });
+
+    std::string result;
+    for_each_query_result<account>(rows, [&](account& a) {
+        result += "{\"block_num\":" + std::to_string(a.block_num);
+        result += ",\"present\":"s + (a.present ? "true" : "false");
+        result += ",\"name\":\"" + a.name.to_string() + "\"";
+        result += ",\"creation_date\":";
+        append_block_timestamp(result, a.creation_date);
+        result += ",\"abi\":\"";
+        append_hex(result, a.abi);
+        result += "\"}";
+    });
+    thread_state.reply.assign(result.begin(), result.end());
+    return true;
+}
+
+} // namespace wasm_ql::legacy
+
+namespace wasm_ql {
+
+bool native_legacy_query(wasm_ql::thread_state& thread_state, std::string_view target, std::string_view request) {
+    if (target == "/v1/chain/get_table_rows")
+        return legacy::get_table_rows(thread_state, request);
+    if (target == "/v1/chain/get_currency_balance")
+        return legacy::get_currency_balance(thread_state, request);
+    if (target == "/v1/chain/get_account")
+        return legacy::get_account(thread_state, request);
+    return false;
+}
+
+} // namespace wasm_ql
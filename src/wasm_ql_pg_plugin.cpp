@@ -5,47 +5,147 @@
 #include "util.hpp"
 
 #include <fc/exception/exception.hpp>
+#include <libpq-fe.h>
+
+#include <mutex>
+#include <vector>
 
 using namespace appbase;
 namespace pg = state_history::pg;
 
 static abstract_plugin& _wasm_ql_pg_plugin = app().register_plugin<wasm_ql_pg_plugin>();
 
+// Connections left by finished sessions, reused by new ones instead of connecting for every
+// query. Every schema is in the same PostgreSQL database, so all the named databases share one
+// pool. It holds at most as many connections as there were sessions open at once.
+class pg_connection_pool {
+  public:
+    pg_connection_pool() = default;
+    pg_connection_pool(const pg_connection_pool&) = delete;
+    pg_connection_pool& operator=(const pg_connection_pool&) = delete;
+
+    ~pg_connection_pool() {
+        for (auto* conn : idle)
+            PQfinish(conn);
+    }
+
+    // pqxx always asks for text-format results, so queries go through libpq directly. An empty
+    // conninfo picks up the same PG* environment defaults that pqxx::connection uses.
+    PGconn* get() {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (!idle.empty()) {
+                auto* conn = idle.back();
+                idle.pop_back();
+                return conn;
+            }
+        }
+        auto* conn = PQconnectdb("");
+        if (PQstatus(conn) != CONNECTION_OK) {
+            std::string error = PQerrorMessage(conn);
+            PQfinish(conn);
+            throw std::runtime_error("connect to postgresql: " + error);
+        }
+        return conn;
+    }
+
+    // Connections which broke or were left inside a transaction are closed instead of reused
+    void put(PGconn* conn) {
+        if (PQstatus(conn) != CONNECTION_OK || PQtransactionStatus(conn) != PQTRANS_IDLE) {
+            PQfinish(conn);
+            return;
+        }
+        std::lock_guard<std::mutex> lock{mutex};
+        idle.push_back(conn);
+    }
+
+  private:
+    std::mutex           mutex;
+    std::vector<PGconn*> idle;
+};
+
 struct pg_database_interface : database_interface, std::enable_shared_from_this<pg_database_interface> {
-    std::string                       schema = {};
-    std::unique_ptr<const pg::config> config = {};
+    std::string                         schema = {};
+    std::shared_ptr<const pg::config>   config = {};
+    std::shared_ptr<pg_connection_pool> pool   = {};
 
     virtual ~pg_database_interface() {}
 
     virtual std::unique_ptr<query_session> create_query_session();
 };
 
-struct pg_query_session : query_session {
-    virtual ~pg_query_session() {}
+struct pg_result_deleter {
+    void operator()(PGresult* result) const { PQclear(result); }
+};
 
+using pg_result_ptr = std::unique_ptr<PGresult, pg_result_deleter>;
+
+// Results are requested in binary format; this returns one field's raw wire bytes (empty if null)
+static std::string_view get_field(const pg_result_ptr& result, int row, int column) {
+    if (PQgetisnull(result.get(), row, column))
+        return {};
+    return {PQgetvalue(result.get(), row, column), size_t(PQgetlength(result.get(), row, column))};
+}
+
+struct pg_query_session : query_session {
     std::shared_ptr<pg_database_interface> db_iface;
-    pqxx::connection                       sql_connection = {};
+    PGconn*                                sql_connection = nullptr;
+    bool                                   has_timeout    = false; // statement_timeout was changed on sql_connection
+
+    pg_query_session(std::shared_ptr<pg_database_interface> db_iface)
+        : db_iface(std::move(db_iface))
+        , sql_connection(this->db_iface->pool->get()) {}
+
+    virtual ~pg_query_session() {
+        // The next session may not set a deadline
+        if (has_timeout)
+            pg_result_ptr{PQexec(sql_connection, "reset statement_timeout")};
+        db_iface->pool->put(sql_connection);
+    }
 
-    virtual state_history::fill_status get_fill_status() override {
-        pqxx::work t(sql_connection);
-        auto row = t.exec("select head, head_id, irreversible, irreversible_id, first from \"" + db_iface->schema + "\".fill_status")[0];
-
-        state_history::fill_status result;
-        result.head            = row[0].as<uint32_t>();
-        result.head_id         = pg::sql_to_checksum256(row[1].c_str());
-        result.irreversible    = row[2].as<uint32_t>();
-        result.irreversible_id = pg::sql_to_checksum256(row[3].c_str());
-        result.first           = row[4].as<uint32_t>();
+    pg_result_ptr exec(const std::string& query, const std::vector<std::string>& params) {
+        std::vector<const char*> values;
+        values.reserve(params.size());
+        for (auto& p : params)
+            values.push_back(p.c_str());
+        pg_result_ptr result{PQexecParams(
+            sql_connection, query.c_str(), values.size(), nullptr, values.data(), nullptr, nullptr, /* resultFormat = binary */ 1)};
+        if (PQresultStatus(result.get()) != PGRES_TUPLES_OK)
+            throw std::runtime_error(PQresultErrorMessage(result.get()));
         return result;
     }
 
+    // Bounds each statement by the time left until the deadline
+    virtual void set_deadline(std::chrono::steady_clock::time_point deadline) override {
+        if (deadline == std::chrono::steady_clock::time_point::max())
+            return;
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        has_timeout = true;
+        pg_result_ptr result{PQexec(sql_connection, ("set statement_timeout = " + std::to_string(std::max<int64_t>(ms, 1))).c_str())};
+        if (PQresultStatus(result.get()) != PGRES_COMMAND_OK)
+            throw std::runtime_error(PQresultErrorMessage(result.get()));
+    }
+
+    virtual state_history::fill_status get_fill_status() override {
+        auto result = exec("select head, head_id, irreversible, irreversible_id, first from \"" + db_iface->schema + "\".fill_status", {});
+        if (PQntuples(result.get()) < 1)
+            throw std::runtime_error("fill_status is empty");
+
+        state_history::fill_status status;
+        status.head            = pg::pg_binary_int(get_field(result, 0, 0));
+        status.head_id         = pg::sql_to_checksum256(std::string{get_field(result, 0, 1)}.c_str());
+        status.irreversible    = pg::pg_binary_int(get_field(result, 0, 2));
+        status.irreversible_id = pg::sql_to_checksum256(std::string{get_field(result, 0, 3)}.c_str());
+        status.first           = pg::pg_binary_int(get_field(result, 0, 4));
+        return status;
+    }
+
     virtual std::optional<abieos::checksum256> get_block_id(uint32_t block_num) override {
-        pqxx::work t(sql_connection);
-        auto       result =
-            t.exec("select block_id from \"" + db_iface->schema + "\".block_info where block_num=" + pg::sql_str(false, block_num));
-        if (result.empty())
+        auto result =
+            exec("select block_id from \"" + db_iface->schema + "\".block_info where block_num=$1", {pg::sql_str(block_num)});
+        if (PQntuples(result.get()) < 1)
             return {};
-        return pg::sql_to_checksum256(result[0][0].c_str());
+        return pg::sql_to_checksum256(std::string{get_field(result, 0, 0)}.c_str());
     }
 
     virtual std::vector<char> query_database(abieos::input_buffer query_bin, uint32_t head) override {
@@ -58,56 +158,27 @@ struct pg_query_session : query_session {
             throw std::runtime_error("query_database: unknown query: " + (std::string)query_name);
         const pg::query& query = *it->second;
 
-        uint32_t snapshot_block_num = 0;
-        if (query.has_block_snapshot)
-            snapshot_block_num = std::min(head, abieos::bin_to_native<uint32_t>(query_bin));
-        std::string query_str = "select * from \"" + db_iface->schema + "\"." + query.function + "(";
-        bool        need_sep  = false;
-        if (query.has_block_snapshot) {
-            query_str += pg::sql_str(false, snapshot_block_num);
-            need_sep = true;
-        }
-        auto add_args = [&](auto& args) {
-            for (auto& arg : args) {
-                if (need_sep)
-                    query_str += pg::sep(false);
-                query_str += arg.bin_to_sql(sql_connection, false, query_bin);
-                need_sep = true;
-            }
-        };
-        add_args(query.arg_types);
-        add_args(query.index_obj->range_types);
-        add_args(query.index_obj->range_types);
-        auto max_results = abieos::read_raw<uint32_t>(query_bin);
-        query_str += pg::sep(false) + pg::sql_str(false, std::min(max_results, query.max_results));
-        query_str += ")";
-
-        pqxx::work        t(sql_connection);
-        auto              exec_result = t.exec(query_str);
-        std::vector<char> result;
-        std::vector<char> row_bin;
-        abieos::push_varuint32(result, exec_result.size());
-        for (const auto& r : exec_result) {
+        eosio::input_stream bin{query_bin.pos, query_bin.end};
+        auto                call        = pg::make_query_call(db_iface->schema, query, bin, head);
+        auto                exec_result = exec(call.sql, call.params);
+        int                 num_rows    = PQntuples(exec_result.get());
+        std::vector<char>   result;
+        std::vector<char>   row_bin;
+        abieos::push_varuint32(result, num_rows);
+        for (int row = 0; row < num_rows; ++row) {
             row_bin.clear();
-            int i = 0;
-            for (size_t field_index = 0; field_index < query.result_fields.size();) {
-                auto& field = query.result_fields[field_index++];
-                field.type_obj->sql_to_bin(row_bin, r[i++]);
-                if (field.begin_optional && !r[i - 1].as<bool>()) {
-                    while (field_index < query.result_fields.size()) {
-                        ++field_index;
-                        ++i;
-                        if (query.result_fields[field_index - 1].end_optional)
-                            break;
-                    }
-                }
-            }
+            pg::row_to_bin(row_bin, query, [&](int column) { return get_field(exec_result, row, column); });
             if ((uint32_t)row_bin.size() != row_bin.size())
                 throw std::runtime_error("query_database: row is too big");
             abieos::push_varuint32(result, row_bin.size());
             result.insert(result.end(), row_bin.begin(), row_bin.end());
         }
-        t.commit();
+        if (num_rows && (uint32_t)num_rows >= call.max_results) {
+            if (auto key = pg::row_sort_key(query, [&](int column) { return get_field(exec_result, num_rows - 1, column); }))
+                append_query_cursor(result, call.snapshot_block, *key);
+        } else {
+            append_query_end(result);
+        }
         if ((uint32_t)result.size() != result.size())
             throw std::runtime_error("query_database: result is too big");
         return result;
@@ -115,13 +186,12 @@ struct pg_query_session : query_session {
 }; // pg_query_session
 
 std::unique_ptr<query_session> pg_database_interface::create_query_session() {
-    auto session      = std::make_unique<pg_query_session>();
-    session->db_iface = shared_from_this();
-    return session;
+    return std::make_unique<pg_query_session>(shared_from_this());
 }
 
 struct wasm_ql_pg_plugin_impl {
     std::shared_ptr<pg_database_interface> interface;
+    std::shared_ptr<pg_connection_pool>    pool = std::make_shared<pg_connection_pool>();
 };
 
 wasm_ql_pg_plugin::wasm_ql_pg_plugin()
@@ -129,12 +199,16 @@ wasm_ql_pg_plugin::wasm_ql_pg_plugin()
 
 wasm_ql_pg_plugin::~wasm_ql_pg_plugin() {}
 
-void wasm_ql_pg_plugin::set_program_options(options_description& cli, options_description& cfg) {}
+void wasm_ql_pg_plugin::set_program_options(options_description& cli, options_description& cfg) {
+    auto op = cfg.add_options();
+    op("wql-pg-database", bpo::value<std::vector<std::string>>(), "Serve another schema as a named database ('name=schema')");
+}
 
 void wasm_ql_pg_plugin::plugin_initialize(const variables_map& options) {
     try {
         my->interface         = std::make_shared<pg_database_interface>();
         my->interface->schema = options["pg-schema"].as<std::string>();
+        my->interface->pool   = my->pool;
         auto x                = read_string(options["query-config"].as<std::string>().c_str());
         auto config           = std::make_unique<pg::config>();
         try {
@@ -144,7 +218,22 @@ void wasm_ql_pg_plugin::plugin_initialize(const variables_map& options) {
         }
         config->prepare(state_history::pg::abi_type_to_sql_type);
         my->interface->config = std::move(config);
-        app().find_plugin<wasm_ql_plugin>()->set_database(my->interface);
+        auto* wasm_ql         = app().find_plugin<wasm_ql_plugin>();
+        wasm_ql->set_database(my->interface);
+
+        // Named databases share the query config, the wasm_ql threads and the connection pool; each has its own schema
+        if (options.count("wql-pg-database")) {
+            for (auto& s : options["wql-pg-database"].as<std::vector<std::string>>()) {
+                auto eq = s.find('=');
+                if (eq == std::string::npos || !eq || eq + 1 == s.size())
+                    throw std::runtime_error("invalid --wql-pg-database value: " + s);
+                auto interface    = std::make_shared<pg_database_interface>();
+                interface->schema = s.substr(eq + 1);
+                interface->config = my->interface->config;
+                interface->pool   = my->pool;
+                wasm_ql->add_database(s.substr(0, eq), std::move(interface));
+            }
+        }
     }
     FC_LOG_AND_RETHROW()
 }
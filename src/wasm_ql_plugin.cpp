@@ -1,7 +1,5 @@
 // copyright defined in LICENSE.txt
 
-// todo: timeout wasm
-// todo: timeout sql
 // todo: what should memory size limit be?
 // todo: check callbacks for recursion to limit stack size
 // todo: reformulate get_input_data and set_output_data for reentrancy
@@ -19,6 +17,7 @@
 #include "wasm_ql.hpp"
 #include "wasm_ql_http.hpp"
 
+#include <boost/filesystem.hpp>
 #include <fc/exception/exception.hpp>
 #include <fc/log/logger.hpp>
 
@@ -31,12 +30,17 @@ static abstract_plugin& _wasm_ql_plugin = app().register_plugin<wasm_ql_plugin>(
 struct wasm_ql_plugin_impl : std::enable_shared_from_this<wasm_ql_plugin_impl> {
     bool                                   stopping         = false;
     int                                    num_threads      = {};
+    int                                    num_http_threads = {};
+    uint32_t                               max_pending      = {};
+    uint64_t                               cache_size       = {};
     std::string                            endpoint_address = {};
     std::string                            endpoint_port    = {};
     std::shared_ptr<wasm_ql::shared_state> state            = {};
     std::shared_ptr<wasm_ql::http_server>  http_server      = {};
 
-    void start_http() { http_server = wasm_ql::http_server::create(num_threads, state, endpoint_address, endpoint_port); }
+    void start_http() {
+        http_server = wasm_ql::http_server::create(num_threads, num_http_threads, max_pending, state, endpoint_address, endpoint_port);
+    }
 
     void shutdown() {
         stopping = true;
@@ -56,11 +60,25 @@ wasm_ql_plugin::~wasm_ql_plugin() {
 void wasm_ql_plugin::set_program_options(options_description& cli, options_description& cfg) {
     auto op = cfg.add_options();
     op("wql-threads", bpo::value<int>()->default_value(8), "Number of threads to process requests");
+    op("wql-http-threads", bpo::value<int>()->default_value(2), "Number of threads to handle network traffic and static files");
+    op("wql-max-pending", bpo::value<uint32_t>()->default_value(256), "Maximum number of queries waiting or running; more get 503");
+    op("wql-max-per-client", bpo::value<uint32_t>()->default_value(0), "Maximum queries waiting or running per client (0: no limit)");
+    op("wql-query-timeout", bpo::value<uint32_t>()->default_value(0), "Time limit for each query in ms (0: none)");
     op("wql-listen", bpo::value<std::string>()->default_value("127.0.0.1:8880"), "Endpoint to listen on");
     op("wql-allow-origin", bpo::value<std::string>(), "Access-Control-Allow-Origin header. Use \"*\" to allow any.");
     op("wql-wasm-dir", bpo::value<std::string>()->default_value("."), "Directory to fetch WASMs from");
     op("wql-static-dir", bpo::value<std::string>(), "Directory to serve static files from (default: disabled)");
+    op("wql-static-cache-size", bpo::value<uint64_t>()->default_value(64), "Memory for cached static files in MiB (0: read from disk)");
+    op("wql-prefault", bpo::value<uint64_t>()->default_value(1), "Wasm memory to fault in for each new query thread state, in MiB");
     op("wql-console", "Show console output");
+    op("wql-native-legacy", "Answer get_table_rows, get_currency_balance and get_account without legacy-server.wasm");
+    op("wql-verify-native", "Run legacy-server.wasm alongside the native handlers and log differences");
+    op("wql-batch-threads", bpo::value<int>()->default_value(4), "Threads to run sub-requests of a batched query (0: run in order)");
+    op("wql-subscribe-poll", bpo::value<uint32_t>()->default_value(500), "Head block poll interval for websocket subscriptions (ms)");
+    op("wql-max-subscriptions", bpo::value<uint32_t>()->default_value(16), "Maximum websocket subscriptions per client (0: no limit)");
+    op("wql-compress-min", bpo::value<uint32_t>()->default_value(1024), "Gzip replies of at least this many bytes (0: disabled)");
+    op("wql-cache-size", bpo::value<uint64_t>()->default_value(0), "Legacy query result cache size per database in MiB (0: disabled)");
+    op("wql-host", bpo::value<std::vector<std::string>>(), "Serve a named database to requests for a host ('host=name'). May be repeated.");
 }
 
 void wasm_ql_plugin::plugin_initialize(const variables_map& options) {
@@ -72,6 +90,8 @@ void wasm_ql_plugin::plugin_initialize(const variables_map& options) {
         my->state            = std::make_shared<wasm_ql::shared_state>();
         my->state->console   = options.count("wql-console");
         my->num_threads      = options.at("wql-threads").as<int>();
+        my->num_http_threads = options.at("wql-http-threads").as<int>();
+        my->max_pending      = options.at("wql-max-pending").as<uint32_t>();
         my->endpoint_port    = ip_port.substr(ip_port.find(':') + 1, ip_port.size());
         my->endpoint_address = ip_port.substr(0, ip_port.find(':'));
         my->state->wasm_dir  = options.at("wql-wasm-dir").as<std::string>();
@@ -79,6 +99,28 @@ void wasm_ql_plugin::plugin_initialize(const variables_map& options) {
             my->state->allow_origin = options.at("wql-allow-origin").as<std::string>();
         if (options.count("wql-static-dir"))
             my->state->static_dir = options.at("wql-static-dir").as<std::string>();
+        my->state->static_cache_size = options.at("wql-static-cache-size").as<uint64_t>() * 1024 * 1024;
+        my->state->prefault_bytes    = options.at("wql-prefault").as<uint64_t>() * 1024 * 1024;
+        my->state->subscribe_poll_ms = options.at("wql-subscribe-poll").as<uint32_t>();
+        my->state->compress_min_size = options.at("wql-compress-min").as<uint32_t>();
+        my->state->query_timeout_ms  = options.at("wql-query-timeout").as<uint32_t>();
+        if (my->state->query_timeout_ms)
+            my->state->watchdog = std::make_unique<wasm_ql::shared_watchdog>();
+        my->state->max_per_client    = options.at("wql-max-per-client").as<uint32_t>();
+        my->state->max_subscriptions = options.at("wql-max-subscriptions").as<uint32_t>();
+        my->state->verify_native     = options.count("wql-verify-native");
+        my->state->native_legacy     = options.count("wql-native-legacy") || my->state->verify_native;
+        if (auto batch_threads = options.at("wql-batch-threads").as<int>(); batch_threads > 0)
+            my->state->batch = std::make_unique<wasm_ql::batch_executor>(batch_threads);
+        my->cache_size = options.at("wql-cache-size").as<uint64_t>() * 1024 * 1024;
+        if (options.count("wql-host")) {
+            for (auto& s : options["wql-host"].as<std::vector<std::string>>()) {
+                auto eq = s.find('=');
+                if (eq == std::string::npos || !eq || eq + 1 == s.size())
+                    throw std::runtime_error("invalid --wql-host value: " + s);
+                my->state->hosts[s.substr(0, eq)] = s.substr(eq + 1);
+            }
+        }
 
         register_callbacks();
     }
@@ -86,10 +128,37 @@ void wasm_ql_plugin::plugin_initialize(const variables_map& options) {
 }
 
 void wasm_ql_plugin::plugin_startup() {
-    if (!my->state->db_iface)
+    if (my->state->databases.empty())
         throw std::runtime_error("wasm_ql_plugin needs either wasm_ql_pg_plugin or wasm_ql_rocksdb_plugin");
+    for (auto& [host, name] : my->state->hosts)
+        if (my->state->databases.find(name) == my->state->databases.end())
+            throw std::runtime_error("--wql-host " + host + ": unknown database: " + name);
+
+    // Metrics only keep series for known targets and the wasm queries present at startup
+    auto queries = wasm_ql::legacy_targets;
+    queries.push_back("/wasmql/v1/query");
+    for (auto& entry : boost::filesystem::directory_iterator(my->state->wasm_dir)) {
+        auto filename = entry.path().filename().string();
+        auto suffix   = "-server.wasm"s;
+        if (filename.size() > suffix.size() && !filename.compare(filename.size() - suffix.size(), suffix.size(), suffix))
+            queries.push_back(filename.substr(0, filename.size() - suffix.size()));
+    }
+    for (auto& [name, db] : my->state->databases)
+        my->state->metrics->add_database(name, queries);
     my->start_http();
 }
 void wasm_ql_plugin::plugin_shutdown() { my->shutdown(); }
 
-void wasm_ql_plugin::set_database(std::shared_ptr<database_interface> db_iface) { my->state->db_iface = std::move(db_iface); }
+void wasm_ql_plugin::set_database(std::shared_ptr<database_interface> db_iface) { add_database("", std::move(db_iface)); }
+
+void wasm_ql_plugin::add_database(const std::string& name, std::shared_ptr<database_interface> db_iface) {
+    if (name.find('/') != std::string::npos || name == "v1" || name == "wasmql" || name == "metrics")
+        throw std::runtime_error("invalid database name: " + name);
+    auto& db = my->state->databases[name];
+    if (db.db_iface)
+        throw std::runtime_error("duplicate database: " + (name.empty() ? "(default)"s : name));
+    db.name     = name;
+    db.db_iface = std::move(db_iface);
+    if (my->cache_size)
+        db.cache = std::make_unique<wasm_ql::query_cache>(my->cache_size);
+}
@@ -6,18 +6,39 @@
 #include "query_config.hpp"
 #include "state_history.hpp"
 
+#include <chrono>
+
 struct query_session {
     virtual ~query_session() {}
 
+    // Database work past the deadline should fail. Sessions which can't bound their work ignore it.
+    virtual void set_deadline(std::chrono::steady_clock::time_point deadline) {}
+
     virtual state_history::fill_status         get_fill_status()                                         = 0;
     virtual std::optional<abieos::checksum256> get_block_id(uint32_t block_num)                          = 0;
     virtual std::vector<char>                  query_database(abieos::input_buffer query, uint32_t head) = 0;
 };
 
+// A query_database result holds the rows (as a vector<vector<char>>), then a resume cursor: 0 if
+// the range is exhausted, or 1, the snapshot block and the key of the last row examined, in the
+// request's key format. The next page starts just after that key, so it costs the same as the
+// first no matter how deep it is. Without a cursor, clients assume a full page means more follow.
+inline void append_query_end(std::vector<char>& result) { result.push_back(0); }
+
+inline void append_query_cursor(std::vector<char>& result, uint32_t snapshot_block, const std::vector<char>& key) {
+    result.push_back(1);
+    abieos::native_to_bin(snapshot_block, result);
+    result.insert(result.end(), key.begin(), key.end());
+}
+
 struct database_interface {
     virtual ~database_interface() {}
 
     virtual std::unique_ptr<query_session> create_query_session() = 0;
+
+    // A session for work done on behalf of parent while it stays open (batch sub-requests). It
+    // mustn't wait for anything parent holds.
+    virtual std::unique_ptr<query_session> create_child_session(query_session& parent) { return create_query_session(); }
 };
 
 class wasm_ql_plugin : public appbase::plugin<wasm_ql_plugin> {
@@ -32,8 +53,12 @@ class wasm_ql_plugin : public appbase::plugin<wasm_ql_plugin> {
     void         plugin_startup();
     void         plugin_shutdown();
 
+    // Sets the default database, which answers requests that don't select a named one
     void set_database(std::shared_ptr<database_interface> db_iface);
 
+    // Serves db_iface under /<name>/ and to hosts mapped to name by --wql-host
+    void add_database(const std::string& name, std::shared_ptr<database_interface> db_iface);
+
   private:
     std::shared_ptr<struct wasm_ql_plugin_impl> my;
 };
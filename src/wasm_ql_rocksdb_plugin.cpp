@@ -17,38 +17,129 @@ struct rocksdb_database_interface : database_interface, std::enable_shared_from_
     virtual ~rocksdb_database_interface() {}
 
     virtual std::unique_ptr<query_session> create_query_session();
+    virtual std::unique_ptr<query_session> create_child_session(query_session& parent);
 };
 
 struct rocksdb_query_session : query_session {
+    // An iterator which is replaced when it's needed on a different column family
+    struct family_iterator {
+        rocksdb::ColumnFamilyHandle*       family      = nullptr;
+        bool                               prefix_mode = false;
+        std::unique_ptr<rocksdb::Iterator> it          = {};
+    };
+
+    // Keys stored back to back, so collecting many of them doesn't allocate per key
+    struct key_list {
+        std::vector<char>   data = {};
+        std::vector<size_t> ends = {};
+
+        size_t size() const { return ends.size(); }
+
+        rocksdb::Slice operator[](size_t i) const {
+            auto begin = i ? ends[i - 1] : 0;
+            return {data.data() + begin, ends[i] - begin};
+        }
+
+        // Call after appending a key to data
+        void end_key() { ends.push_back(data.size()); }
+    };
+
     std::shared_ptr<rocksdb_database_interface> db_iface;
+    rdb::database&                              database;
+    std::shared_lock<rdb::catch_up_gate>        read_lock; // secondaries: keeps catch_up() from changing the data mid-session
+    const rocksdb::Snapshot*                    snapshot;  // nullptr for secondaries, which don't support snapshots
     state_history::fill_status                  fill_status;
-    std::unique_ptr<rocksdb::Iterator>          it_for_get;
-    std::unique_ptr<rocksdb::Iterator>          it0;
-    std::unique_ptr<rocksdb::Iterator>          it1;
-    std::unique_ptr<rocksdb::Iterator>          it2;
-    std::unique_ptr<rocksdb::Iterator>          it3;
-    std::unique_ptr<rocksdb::Iterator>          it4;
-
-    rocksdb_query_session(const std::shared_ptr<rocksdb_database_interface>& db_iface)
+    family_iterator                             it_for_get;
+    family_iterator                             it0;
+    family_iterator                             it1;
+    family_iterator                             it2;
+    std::chrono::steady_clock::time_point       deadline = std::chrono::steady_clock::time_point::max();
+
+    // Scratch space reused across rows and queries
+    std::vector<std::optional<uint32_t>> positions;
+    std::vector<std::optional<uint32_t>> join_positions;
+    std::vector<char>                    limit_key;
+    std::vector<char>                    join_key;
+
+    // child: the caller already holds the database's read lock for the session's lifetime. Taking it
+    // again could wait behind a pending catch_up(), which waits for the caller.
+    rocksdb_query_session(const std::shared_ptr<rocksdb_database_interface>& db_iface, bool child = false)
         : db_iface(db_iface)
-        , it_for_get{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it0{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it1{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it2{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it3{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it4{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())} {
-
-        auto f = rdb::get<state_history::fill_status>(*it_for_get, kv::make_fill_status_key(), false);
+        , database(db_iface->rocksdb_inst->database)
+        , read_lock(child ? std::shared_lock<rdb::catch_up_gate>{} : database.lock_for_read())
+        , snapshot(database.secondary ? nullptr : database.db->GetSnapshot()) {
+
+        auto key = kv::make_fill_status_key();
+        auto f   = rdb::get<state_history::fill_status>(iterator(it_for_get, key), key, false);
         if (f)
             fill_status = *f;
+        fill_status.lag_ms = database.lag_ms();
     }
 
-    virtual ~rocksdb_query_session() {}
+    // An iterator on the family which holds key. Every iterator in the session reads from the
+    // same snapshot, whichever family it is on. within_key: the caller only visits keys starting
+    // with key, so the iterator may use the family's prefix bloom filters if key covers the prefix.
+    rocksdb::Iterator& iterator(family_iterator& it, const std::vector<char>& key, bool within_key = false) {
+        auto* family      = database.column_family(key);
+        auto  prefix_size = database.prefix_size(family);
+        bool  prefix_mode = within_key && prefix_size && prefix_size <= key.size();
+        if (!it.it || it.family != family || it.prefix_mode != prefix_mode) {
+            auto options                 = rdb::total_order_options();
+            options.snapshot             = snapshot;
+            options.total_order_seek     = !prefix_mode;
+            options.prefix_same_as_start = prefix_mode;
+            it.it.reset(database.db->NewIterator(options, family));
+            it.family      = family;
+            it.prefix_mode = prefix_mode;
+        }
+        return *it.it;
+    }
+
+    virtual ~rocksdb_query_session() {
+        for (auto* it : {&it_for_get, &it0, &it1, &it2})
+            it->it.reset();
+        if (snapshot)
+            database.db->ReleaseSnapshot(snapshot);
+    }
+
+    // Number of keys per MultiGet
+    static constexpr size_t multi_get_batch = 256;
+
+    // Look up keys, which must all be in one column family, with batched MultiGets. f(i, value)
+    // receives keys[i]'s value, in order. Every key must exist, except for rows compaction may have
+    // trimmed (rdb::trim_filter); those are skipped.
+    template <typename F>
+    void multi_get(const key_list& keys, F f) {
+        if (!keys.size())
+            return;
+        rocksdb::ReadOptions options;
+        options.snapshot = snapshot;
+        auto*                       family = database.column_family(keys[0]);
+        std::vector<rocksdb::Slice> slices;
+        for (size_t begin = 0; begin < keys.size(); begin += multi_get_batch) {
+            auto size = std::min(multi_get_batch, keys.size() - begin);
+            slices.clear();
+            for (size_t i = begin; i < begin + size; ++i)
+                slices.push_back(keys[i]);
+            std::vector<rocksdb::PinnableSlice> values(size);
+            std::vector<rocksdb::Status>        statuses(size);
+            database.db->MultiGet(options, family, size, slices.data(), values.data(), statuses.data());
+            for (size_t i = 0; i < size; ++i) {
+                if (statuses[i].IsNotFound() && database.trim.drops(slices[i], fill_status.first))
+                    continue;
+                rdb::check(statuses[i], "query_database: MultiGet: ");
+                f(begin + i, rdb::to_input_buffer(values[i]));
+            }
+        }
+    }
+
+    virtual void set_deadline(std::chrono::steady_clock::time_point deadline) override { this->deadline = deadline; }
 
     virtual state_history::fill_status get_fill_status() override { return fill_status; }
 
     virtual std::optional<abieos::checksum256> get_block_id(uint32_t block_num) override {
-        auto rb = rdb::get<kv::received_block>(*it_for_get, kv::make_received_block_key(block_num), false);
+        auto key = kv::make_received_block_key(block_num);
+        auto rb  = rdb::get<kv::received_block>(iterator(it_for_get, key), key, false);
         if (rb)
             return rb->block_id;
         return {};
@@ -72,6 +163,47 @@ struct rocksdb_query_session : query_session {
         }
     }
 
+    // Append query.fields_from_join to each row, or empty fields for rows without a match. The
+    // join index is searched per row; the joined rows are fetched in batches.
+    void add_join_fields(const kv::query& query, uint32_t snapshot_block_num, std::vector<std::vector<char>>& rows) {
+        key_list            join_pks;
+        std::vector<size_t> join_rows; // index into rows for each of join_pks
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (std::chrono::steady_clock::now() > deadline)
+                throw std::runtime_error("query_database: query timed out");
+            abieos::input_buffer delta_value{rows[i].data(), rows[i].data() + rows[i].size()};
+            kv::init_positions(positions, query.table_obj->fields.size());
+            fill_positions(delta_value, query.table_obj->fields, positions);
+            if (!keys_have_positions(query.join_key_values, positions))
+                continue;
+            join_key.clear();
+            kv::append_index_key(join_key, query.join_table->short_name, query.join_query_short_name);
+            append_fields(join_key, delta_value, query.join_key_values, positions, true);
+            limit_key = join_key;
+            if (query.join_query->table_obj->is_delta)
+                kv::append_index_suffix(limit_key, snapshot_block_num);
+            rdb::for_each(iterator(it2, join_key, true), limit_key, join_key, [&](auto join_index_value, auto) {
+                kv::extract_pk_from_index(
+                    join_pks.data, join_index_value, *query.join_table, query.join_query->index_obj->sort_keys, join_positions);
+                join_pks.end_key();
+                join_rows.push_back(i);
+                return false;
+            });
+        }
+
+        std::vector<bool> found_join(rows.size());
+        multi_get(join_pks, [&](size_t i, abieos::input_buffer join_delta_value) {
+            kv::init_positions(join_positions, query.join_table->fields.size());
+            fill_positions(join_delta_value, query.join_table->fields, join_positions);
+            append_fields(rows[join_rows[i]], join_delta_value, query.fields_from_join, join_positions, false);
+            found_join[join_rows[i]] = true;
+        });
+        for (size_t i = 0; i < rows.size(); ++i)
+            if (!found_join[i])
+                for (auto& field : query.join_table->fields)
+                    field.type_obj->fill_empty(rows[i]);
+    }
+
     virtual std::vector<char> query_database(abieos::input_buffer query_bin, uint32_t head) override {
         abieos::name query_name;
         abieos::bin_to_native(query_name, query_bin);
@@ -90,8 +222,9 @@ struct rocksdb_query_session : query_session {
         if (query.has_block_snapshot)
             snapshot_block_num = std::min(head, abieos::bin_to_native<uint32_t>(query_bin));
 
-        auto first = kv::make_index_key(query.table_obj->short_name, query.index_obj->short_name);
-        auto last  = first;
+        auto first       = kv::make_index_key(query.table_obj->short_name, query.index_obj->short_name);
+        auto last        = first;
+        auto prefix_size = first.size();
 
         auto add_fields = [&](auto& dest, auto& types) {
             for (auto& type : types)
@@ -102,51 +235,45 @@ struct rocksdb_query_session : query_session {
 
         auto max_results = std::min(abieos::read_raw<uint32_t>(query_bin), query.max_results);
 
-        std::vector<std::vector<char>> rows;
-        uint32_t                       num_results = 0;
-        rdb::for_each_subkey(*it0, first, last, [&](const auto& index_key, auto, auto) {
-            std::vector index_key_limit_block = index_key;
+        // Find the primary keys, then fetch the rows in batches
+        key_list          pks;
+        uint32_t          num_results = 0;
+        std::vector<char> last_key;
+        pks.data.reserve(std::min(max_results, 1024u) * kv::max_key_size(*query.table_obj));
+        rdb::for_each_subkey(iterator(it0, first), first, last, [&](const auto& index_key, auto, auto) {
+            if (std::chrono::steady_clock::now() > deadline)
+                throw std::runtime_error("query_database: query timed out");
+            limit_key = index_key;
             if (query.table_obj->is_delta)
-                kv::append_index_suffix(index_key_limit_block, snapshot_block_num);
+                kv::append_index_suffix(limit_key, snapshot_block_num);
             // todo: unify rdb's and pg's handling of negative result because of snapshot_block_num
-            rdb::for_each(*it1, index_key_limit_block, index_key, [&](auto index_value, auto) {
-                auto delta_value =
-                    *rdb::get_raw(*it2, extract_pk_from_index(index_value, *query.table_obj, query.index_obj->sort_keys), true);
-                rows.emplace_back(delta_value.pos, delta_value.end);
-                if (query.join_table) {
-                    auto join_key = kv::make_index_key(query.join_table->short_name, query.join_query_short_name);
-                    std::vector<std::optional<uint32_t>> table_positions;
-                    kv::init_positions(table_positions, query.table_obj->fields.size());
-                    fill_positions(delta_value, query.table_obj->fields, table_positions);
-                    bool found_join = false;
-                    if (keys_have_positions(query.join_key_values, table_positions)) {
-                        append_fields(join_key, delta_value, query.join_key_values, table_positions, true);
-                        auto join_key_limit_block = join_key;
-                        if (query.join_query->table_obj->is_delta)
-                            kv::append_index_suffix(join_key_limit_block, snapshot_block_num);
-                        auto& row = rows.back();
-                        rdb::for_each(*it3, join_key_limit_block, join_key, [&](auto join_index_value, auto) {
-                            found_join            = true;
-                            auto join_delta_value = *rdb::get_raw(
-                                *it4, extract_pk_from_index(join_index_value, *query.join_table, query.join_query->index_obj->sort_keys),
-                                true);
-                            std::vector<std::optional<uint32_t>> join_positions;
-                            kv::init_positions(join_positions, query.join_table->fields.size());
-                            fill_positions(join_delta_value, query.join_table->fields, join_positions);
-                            append_fields(row, join_delta_value, query.fields_from_join, join_positions, false);
-                            return false;
-                        });
-                    }
-                    if (!found_join)
-                        for (auto& field : query.join_table->fields)
-                            field.type_obj->fill_empty(rows.back());
-                }
+            rdb::for_each(iterator(it1, index_key, true), limit_key, index_key, [&](auto index_value, auto) {
+                kv::extract_pk_from_index(pks.data, index_value, *query.table_obj, query.index_obj->sort_keys, positions);
+                pks.end_key();
                 return false;
             });
-            return ++num_results < max_results;
+            if (++num_results < max_results)
+                return true;
+            last_key = index_key;
+            return false;
         });
 
+        std::vector<std::vector<char>> rows(pks.size());
+        multi_get(pks, [&](size_t i, abieos::input_buffer delta_value) { rows[i].assign(delta_value.pos, delta_value.end); });
+        rows.erase(std::remove_if(rows.begin(), rows.end(), [](auto& row) { return row.empty(); }), rows.end());
+        if (query.join_table)
+            add_join_fields(query, snapshot_block_num, rows);
+
         auto result = abieos::native_to_bin(rows);
+        if (!last_key.empty()) {
+            std::vector<char>    cursor;
+            abieos::input_buffer key{last_key.data() + prefix_size, last_key.data() + last_key.size()};
+            for (auto& type : query.index_obj->range_types)
+                type.key_to_query(cursor, key);
+            append_query_cursor(result, snapshot_block_num, cursor);
+        } else {
+            append_query_end(result);
+        }
         if ((uint32_t)result.size() != result.size())
             throw std::runtime_error("query_database: result is too big");
         return result;
@@ -158,6 +285,10 @@ std::unique_ptr<query_session> rocksdb_database_interface::create_query_session(
     return session;
 }
 
+std::unique_ptr<query_session> rocksdb_database_interface::create_child_session(query_session& parent) {
+    return std::make_unique<rocksdb_query_session>(shared_from_this(), true);
+}
+
 struct wasm_ql_rocksdb_plugin_impl {
     std::shared_ptr<rocksdb_database_interface> interface;
 };
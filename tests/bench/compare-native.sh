@@ -0,0 +1,53 @@
+#!/bin/bash
+# copyright defined in LICENSE.txt
+
+# Checks the native legacy handlers against legacy-server.wasm and measures both. It starts two
+# wasm-ql-pg servers on the database make-fixture.sh built, one with --wql-native-legacy and one
+# without, has wasm-ql-bench compare their replies byte for byte, then benchmarks each in turn.
+#
+# Run it from the build directory after make-fixture.sh:
+#
+#   ../tests/bench/compare-native.sh
+#
+# Exits with status 1 if any reply differs.
+
+set -euo pipefail
+
+corpus=${CORPUS:-corpus.txt}
+duration=${DURATION:-30}
+connections=${CONNECTIONS:-32}
+native_port=8881
+wasm_port=8882
+
+work=$(mktemp -d)
+pids=()
+cleanup() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+./wasm-ql-pg --data-dir "$work/native" --wql-listen 127.0.0.1:$native_port --wql-native-legacy >"$work/native.log" 2>&1 &
+pids+=($!)
+./wasm-ql-pg --data-dir "$work/wasm" --wql-listen 127.0.0.1:$wasm_port >"$work/wasm.log" 2>&1 &
+pids+=($!)
+
+echo "waiting for wasm-ql-pg..."
+for port in $native_port $wasm_port; do
+    until curl -s -o /dev/null http://127.0.0.1:$port/metrics; do
+        sleep 1
+    done
+done
+
+echo "comparing replies..."
+./wasm-ql-bench --corpus "$corpus" --url 127.0.0.1:$native_port --compare 127.0.0.1:$wasm_port
+
+for mode in native wasm; do
+    port=${mode}_port
+    echo
+    echo "$mode:"
+    ./wasm-ql-bench --corpus "$corpus" --url 127.0.0.1:${!port} --connections "$connections" --duration "$duration"
+done
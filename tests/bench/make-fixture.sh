@@ -0,0 +1,151 @@
+#!/bin/bash
+# copyright defined in LICENSE.txt
+
+# Builds a small PostgreSQL database and a matching request corpus for wasm-ql-bench on one
+# machine. It runs a single-producer nodeos with state history, creates token accounts and
+# transfers between them, fills the database with fill-pg, then runs init.sql.
+#
+# Needs nodeos, cleos, keosd, fill-pg and psql on PATH, a PostgreSQL server reachable through
+# the usual PG* environment variables, and a built eosio.contracts (EOSIO_CONTRACTS_DIR).
+#
+#   EOSIO_CONTRACTS_DIR=~/eosio.contracts/build/contracts tests/bench/make-fixture.sh
+#   wasm-ql-pg &
+#   wasm-ql-bench --corpus corpus.txt --connections 32
+
+set -euo pipefail
+
+num_accounts=${NUM_ACCOUNTS:-20}
+num_transfers=${NUM_TRANSFERS:-2000}
+corpus=${CORPUS:-corpus.txt}
+contracts=${EOSIO_CONTRACTS_DIR:?set EOSIO_CONTRACTS_DIR to the eosio.contracts build/contracts directory}
+source_dir=$(cd "$(dirname "$0")/../.." && pwd)
+
+# nodeos' default development key
+pub_key=EOS6MRyAjQq8ud7hVNYcfnVPJqcVpscN5So8BhtHuGYqET5GDW5CV
+priv_key=5KQwrPbwdL6PhXujxW37FSSQZ1JiwsST4cqQzDeyXtP79zkvFD3
+
+work=$(mktemp -d)
+pids=()
+cleanup() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+cleos() { command cleos --wallet-url http://127.0.0.1:8899 --url http://127.0.0.1:8888 "$@"; }
+
+# Account names are limited to a-z and 1-5, so the index is spelled with letters
+account() { echo "benchuser$(printf '%03d' "$1" | tr 0-9 a-j)"; }
+
+# Hex encoders for /wasmql/v1/query bodies. Integers are little-endian.
+hex_u64() {
+    local h out=""
+    h=$(printf '%016x' "$1")
+    for ((k = 14; k >= 0; k -= 2)); do out+=${h:k:2}; done
+    echo -n "$out"
+}
+hex_u32() { hex_u64 "$1" | cut -c1-8 | tr -d '\n'; }
+hex_varuint32() {
+    local v=$1 out=""
+    while ((v >= 0x80)); do
+        out+=$(printf '%02x' $(((v & 0x7f) | 0x80)))
+        v=$((v >> 7))
+    done
+    echo -n "$out$(printf '%02x' "$v")"
+}
+hex_name() {
+    local s=$1 v=0 c sym
+    for ((k = 0; k < ${#s} && k < 13; k++)); do
+        c=$(printf '%d' "'${s:k:1}")
+        if ((c >= 97 && c <= 122)); then
+            sym=$((c - 97 + 6))
+        elif ((c >= 49 && c <= 53)); then
+            sym=$((c - 49 + 1))
+        else
+            sym=0
+        fi
+        if ((k < 12)); then
+            v=$((v | ((sym & 0x1f) << (64 - 5 * (k + 1)))))
+        else
+            v=$((v | (sym & 0x0f)))
+        fi
+    done
+    hex_u64 "$v"
+}
+# A batch: varuint32 count, then each request with a varuint32 length
+hex_batch() {
+    local out
+    out=$(hex_varuint32 $#)
+    for item; do out+=$(hex_varuint32 $((${#item} / 2)))$item; done
+    echo -n "$out"
+}
+# token-server.wasm requests, at the head block
+token_query() { echo -n "$(hex_name local)$(hex_name token)$(hex_name "$1")$(hex_varuint32 1)$(hex_u32 0)"; }
+max_u64=ffffffffffffffff
+sys=$(hex_u64 $((0x535953)))
+
+nodeos -e -p eosio --data-dir "$work/data" --config-dir "$work/config" \
+    --plugin eosio::producer_plugin --plugin eosio::chain_api_plugin --plugin eosio::http_plugin \
+    --plugin eosio::state_history_plugin --state-history-endpoint 127.0.0.1:8080 \
+    --trace-history --chain-state-history --disable-replay-opts \
+    --http-server-address 127.0.0.1:8888 >"$work/nodeos.log" 2>&1 &
+pids+=($!)
+keosd --wallet-dir "$work/wallet" --http-server-address 127.0.0.1:8899 --unlock-timeout 999999 >"$work/keosd.log" 2>&1 &
+pids+=($!)
+
+echo "waiting for nodeos..."
+until cleos get info >/dev/null 2>&1; do
+    sleep 1
+done
+
+cleos wallet create --to-console >/dev/null
+cleos wallet import --private-key "$priv_key" >/dev/null
+
+cleos create account eosio eosio.token "$pub_key" >/dev/null
+cleos set contract eosio.token "$contracts/eosio.token" >/dev/null
+cleos push action eosio.token create '["eosio", "1000000000.0000 SYS"]' -p eosio.token >/dev/null
+cleos push action eosio.token issue '["eosio", "1000000000.0000 SYS", ""]' -p eosio >/dev/null
+
+echo "creating $num_accounts accounts..."
+for ((i = 0; i < num_accounts; i++)); do
+    cleos create account eosio "$(account $i)" "$pub_key" >/dev/null
+    cleos transfer eosio "$(account $i)" "100000.0000 SYS" "" >/dev/null
+done
+
+echo "pushing $num_transfers transfers..."
+for ((i = 0; i < num_transfers; i++)); do
+    from=$(account $((RANDOM % num_accounts)))
+    to=$(account $((RANDOM % num_accounts)))
+    [[ $from == "$to" ]] && continue
+    cleos transfer "$from" "$to" "0.0001 SYS" "$i" -p "$from" >/dev/null
+done
+
+sleep 2
+head=$(cleos get info | grep '"head_block_num"' | tr -dc 0-9)
+
+echo "filling postgresql through block $head..."
+fill-pg --fpg-drop --fpg-create --fill-connect-to 127.0.0.1:8080 --fill-stop $((head + 1)) >"$work/fill-pg.log" 2>&1
+psql -q -v ON_ERROR_STOP=1 -f "$source_dir/src/init.sql"
+
+echo "writing $corpus..."
+{
+    echo "# generated by tests/bench/make-fixture.sh"
+    for ((i = 0; i < num_accounts; i++)); do
+        a=$(account $i)
+        echo "/v1/chain/get_account {\"account_name\":\"$a\"}"
+        echo "/v1/chain/get_currency_balance {\"code\":\"eosio.token\",\"account\":\"$a\",\"symbol\":\"SYS\"}"
+        echo "/v1/chain/get_table_rows {\"code\":\"eosio.token\",\"scope\":\"$a\",\"table\":\"accounts\",\"json\":true}"
+        echo "/v1/history/get_actions {\"account_name\":\"$a\",\"pos\":-1,\"offset\":-20}"
+        balances=$(token_query bal.mult.tok)$(hex_name "$a")$(hex_u64 0)$(hex_u64 0)$max_u64$max_u64$(hex_u32 100)
+        echo "/wasmql/v1/query $(hex_batch "$balances")"
+    done
+    holders=$(token_query bal.mult.acc)$(hex_name eosio.token)$sys$(hex_u64 0)$max_u64$(hex_u32 100)
+    echo "/wasmql/v1/query $(hex_batch "$holders")"
+    echo "/wasmql/v1/query $(hex_batch "$holders" \
+        "$(token_query bal.mult.tok)$(hex_name "$(account 0)")$(hex_u64 0)$(hex_u64 0)$max_u64$max_u64$(hex_u32 100)")"
+    echo "/v1/chain/get_abi {\"account_name\":\"eosio.token\"}"
+    echo "/v1/chain/get_block {\"block_num_or_id\":\"$((head / 2))\"}"
+} >"$corpus"
@@ -304,4 +304,145 @@ BOOST_FIXTURE_TEST_CASE(to_sql_values_test, test_fixture_t) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(binary_to_bin_test) {
+    using namespace state_history::pg;
+    using namespace std::literals;
+
+    auto decode = [](auto* type, std::string_view data) {
+        std::vector<char> bin;
+        binary_to_bin<std::remove_pointer_t<decltype(type)>>(bin, data);
+        return bin;
+    };
+    auto le = [](auto v) {
+        std::vector<char> bin;
+        push_le(bin, v);
+        return bin;
+    };
+
+    BOOST_TEST(decode((uint32_t*)nullptr, "\0\0\0\0\0\0\0\x07"sv) == le(uint32_t(7)));
+    BOOST_TEST(decode((int16_t*)nullptr, "\xff\xfe"sv) == le(int16_t(-2)));
+    BOOST_TEST(decode((uint32_t*)nullptr, ""sv) == le(uint32_t(0)));
+    BOOST_TEST(decode((bool*)nullptr, "\x01"sv) == std::vector<char>{1});
+
+    // 123456789 is sent as base-10000 digits 1, 2345, 6789
+    BOOST_TEST(decode((uint64_t*)nullptr, "\0\x03\0\x02\0\0\0\0\0\x01\x09\x29\x1a\x85"sv) == le(uint64_t(123456789)));
+    // trailing zero digits are omitted; weight restores them
+    BOOST_TEST(decode((uint64_t*)nullptr, "\0\x01\0\x01\0\0\0\0\0\x01"sv) == le(uint64_t(10000)));
+    BOOST_TEST(decode((__int128*)nullptr, "\0\x01\0\0\x40\0\0\0\0\x05"sv) == le(__int128(-5)));
+
+    BOOST_TEST(decode((eosio::name*)nullptr, "eosio"sv) == le(eosio::name("eosio").value));
+    BOOST_TEST(decode((std::string*)nullptr, "abc"sv) == (std::vector<char>{3, 'a', 'b', 'c'}));
+    BOOST_TEST(decode((eosio::varuint32*)nullptr, "\0\0\0\0\0\0\x01\x00"sv) == (std::vector<char>{char(0x80), 0x02}));
+    BOOST_TEST(decode((eosio::symbol*)nullptr, "4,EOS"sv) == le(uint64_t(4 | ('E' << 8) | ('O' << 16) | ('S' << 24))));
+
+    // timestamps count from 2000-01-01
+    BOOST_TEST(decode((eosio::time_point*)nullptr, "\0\0\0\0\0\0\0\0"sv) == le(int64_t(946'684'800'000'000)));
+    BOOST_TEST(decode((eosio::block_timestamp*)nullptr, "\0\0\0\0\0\x07\xa1\x20"sv) == le(uint32_t(1)));
+}
+
+BOOST_AUTO_TEST_CASE(bin_to_param_test) {
+    using namespace state_history::pg;
+
+    auto param = [](const char* type, const auto& v) {
+        auto                bin = eosio::convert_to_bin(v);
+        eosio::input_stream stream{bin};
+        return abi_type_to_sql_type.at(type).bin_to_param(stream);
+    };
+
+    BOOST_TEST(param("uint32", uint32_t(7)) == "7");
+    BOOST_TEST(param("name", eosio::name("eosio")) == "eosio");
+    // PQexecParams takes bytea hex input with a single backslash; COPY needs it escaped
+    BOOST_TEST(param("bytes", eosio::bytes{{1, 2, char(0xab)}}) == "\\x0102AB");
+    BOOST_TEST(sql_str(eosio::float128{}) == "\\\\x00000000000000000000000000000000");
+    BOOST_TEST(param("float128", eosio::float128{}) == "\\x00000000000000000000000000000000");
+    // zero timestamps are valid timestamp input, not empty strings
+    BOOST_TEST(param("time_point", eosio::time_point{}) == "1970-01-01T00:00:00.000");
+    BOOST_TEST(param("time_point_sec", eosio::time_point_sec{}) == "1970-01-01T00:00:00.000");
+    BOOST_TEST(param("block_timestamp_type", eosio::block_timestamp{}) == "2000-01-01T00:00:00.000");
+}
+
+BOOST_AUTO_TEST_CASE(query_database_test) {
+    using namespace state_history::pg;
+    using namespace std::literals;
+    using namespace eosio::literals;
+
+    auto make_field = [](const char* name, const char* type, bool begin_optional = false, bool end_optional = false) {
+        field f;
+        f.name           = name;
+        f.type           = type;
+        f.begin_optional = begin_optional;
+        f.end_optional   = end_optional;
+        return f;
+    };
+    auto make_key = [](const char* name) {
+        key k;
+        k.name = name;
+        return k;
+    };
+
+    config cfg;
+
+    auto& t      = cfg.tables.emplace_back();
+    t.name       = "t";
+    t.short_name = "t"_n;
+    t.fields     = {make_field("block_num", "uint32"), make_field("account", "name"), make_field("present", "bool", true),
+                    make_field("data", "bytes", false, true)};
+
+    auto& i      = cfg.indexes.emplace_back();
+    i.short_name = "t.acct"_n;
+    i.index      = "t_acct";
+    i.table      = "t";
+    i.sort_keys  = {make_key("account"), make_key("block_num")};
+
+    auto& qc              = cfg.queries.emplace_back();
+    qc.short_name         = "q.acct"_n;
+    qc.index              = "t_acct";
+    qc.function           = "query_acct";
+    qc.table              = "t";
+    qc.has_block_snapshot = true;
+    qc.max_results        = 2;
+
+    cfg.prepare(abi_type_to_sql_type);
+    auto& q = *cfg.query_map.at("q.acct"_n);
+
+    auto le = [](auto... v) {
+        std::vector<char> bin;
+        (push_le(bin, v), ...);
+        return bin;
+    };
+
+    // snapshot block, first key, last key, max_results
+    auto request = le(uint32_t(100), "alice"_n.value, uint32_t(0), "bob"_n.value, ~uint32_t(0), uint32_t(5));
+    eosio::input_stream bin{request};
+    auto                call = make_query_call("s", q, bin, 50);
+    BOOST_TEST(call.sql == R"(select * from "s".query_acct($1,$2,$3,$4,$5,$6))");
+    BOOST_TEST(call.params == (std::vector<std::string>{"50", "alice", "0", "bob", "4294967295", "2"}));
+    BOOST_TEST(call.snapshot_block == 50u);
+    BOOST_TEST(call.max_results == 2u);
+    BOOST_TEST((bin.pos == bin.end));
+
+    // binary-format result rows; the second one is absent, so its data column is skipped
+    std::vector<std::vector<std::string_view>> rows = {
+        {"\0\0\0\0\0\0\0\x07"sv, "alice"sv, "\x01"sv, "\x01\x02"sv},
+        {"\0\0\0\0\0\0\0\x08"sv, "bob"sv, "\0"sv, "garbage"sv},
+    };
+    auto expected_row = [&](uint32_t block_num, eosio::name account, std::vector<char> rest) {
+        auto bin = le(block_num, account.value);
+        bin.insert(bin.end(), rest.begin(), rest.end());
+        return bin;
+    };
+    for (size_t r = 0; r < rows.size(); ++r) {
+        std::vector<char> row_bin;
+        row_to_bin(row_bin, q, [&](int column) { return rows[r][column]; });
+        if (r == 0)
+            BOOST_TEST(row_bin == expected_row(7, "alice"_n, {1, 2, 1, 2}));
+        else
+            BOOST_TEST(row_bin == expected_row(8, "bob"_n, {0}));
+    }
+
+    auto key = row_sort_key(q, [&](int column) { return rows[1][column]; });
+    BOOST_REQUIRE(key.has_value());
+    BOOST_TEST(*key == le("bob"_n.value, uint32_t(8)));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
\ No newline at end of file
@@ -328,13 +328,41 @@ eosio::name get_table_index_name(const get_table_rows_params& p, bool& primary)
     return eosio::name{index};
 } // get_table_index_name
 
+// Writes one get_table_rows row: the value decoded with the table's ABI type, or its hex if
+// there's no type or it doesn't decode. json_row is scratch space reused across rows.
+void write_table_row(
+    eosio::json_writer& w, const get_table_rows_params& params, abieos::abi_type* table_type, const char* begin, const char* end,
+    eosio::name payer, std::string& json_row) {
+    if (params.show_payer)
+        w.write("{\"data\":");
+    bool decoded = false;
+    if (table_type) {
+        // abieos only produces a std::string; the rest of the reply goes straight to w
+        abieos::input_buffer bin{begin, end};
+        std::string          error;
+        json_row.clear();
+        if (bin_to_json(bin, error, table_type, json_row)) {
+            w.write(json_row);
+            decoded = true;
+        }
+    }
+    if (!decoded)
+        w.commit(eosio::write_hex(w.prepare((end - begin) * 2 + 2), (const unsigned char*)begin, (const unsigned char*)end));
+    if (params.show_payer) {
+        w.write(",\"payer\":");
+        write_json(w, payer);
+        w.write('}');
+    }
+}
+
 void get_table_rows_primary(
     const get_table_rows_params& params, const eosio::database_status& status, uint64_t scope, abieos::abi_type* table_type) {
 
     auto lower_bound = convert_key(*params.key_type, *params.lower_bound, (uint64_t)0);
     auto upper_bound = convert_key(*params.key_type, *params.upper_bound, (uint64_t)0xffff'ffff'ffff'ffff);
 
-    auto s = query_database(eosio::query_contract_row_range_code_table_scope_pk{
+    uint32_t limit = std::min((uint32_t)100, params.limit);
+    auto     query = eosio::query_contract_row_range_code_table_scope_pk{
         .snapshot_block = status.head,
         .first =
             {
@@ -350,41 +378,25 @@ void get_table_rows_primary(
                 .scope       = eosio::name{scope},
                 .primary_key = upper_bound,
             },
-        .max_results = std::min((uint32_t)100, params.limit),
-    });
+        .max_results = limit,
+    };
 
-    // todo: rope
-    std::string result = "{\"rows\":[";
-    bool        found  = false;
-    eosio::for_each_query_result<eosio::contract_row>(s, [&](eosio::contract_row& r) {
+    eosio::json_writer w;
+    std::string        json_row;
+    uint32_t           num_found = 0;
+    w.write("{\"rows\":[");
+    eosio::for_each_query_result_paged<eosio::contract_row>(query, [&](eosio::contract_row& r) {
+        if (num_found >= limit)
+            return false;
         if (!r.present)
             return true;
-        if (found)
-            result += ',';
-        found = true;
-        if (params.show_payer)
-            result += "{\"data\":";
-        bool decoded = false;
-        if (table_type) {
-            abieos::input_buffer bin{r.value->pos(), r.value->pos() + r.value->remaining()};
-            std::string          error;
-            std::string          json_row;
-            if (bin_to_json(bin, error, table_type, json_row)) {
-                result += json_row;
-                decoded = true;
-            }
-        }
-        if (!decoded) {
-            result += '"';
-            abieos::hex(r.value->pos(), r.value->pos() + r.value->remaining(), std::back_inserter(result));
-            result += '"';
-        }
-        if (params.show_payer)
-            result += ",\"payer\":\"" + r.payer.to_string() + "\"}";
-        return true;
+        if (num_found)
+            w.write(',');
+        write_table_row(w, params, table_type, r.value->pos(), r.value->pos() + r.value->remaining(), r.payer, json_row);
+        return ++num_found < limit;
     });
-    result += "]}";
-    eosio::set_output_data(result);
+    w.write("]}");
+    eosio::set_output_data(w.sv());
 } // get_table_rows_primary
 
 template <typename T>
@@ -394,7 +406,8 @@ void get_table_rows_secondary(
     auto lower_bound = convert_key(*params.key_type, *params.lower_bound, (T)0);
     auto upper_bound = convert_key(*params.key_type, *params.upper_bound, (T)0xffff'ffff'ffff'ffff);
 
-    auto s = query_database(eosio::query_contract_index64_range_code_table_scope_sk_pk{
+    uint32_t limit = std::min((uint32_t)100, params.limit);
+    auto     query = eosio::query_contract_index64_range_code_table_scope_sk_pk{
         .snapshot_block = status.head,
         .first =
             {
@@ -412,41 +425,27 @@ void get_table_rows_secondary(
                 .secondary_key = upper_bound,
                 .primary_key   = 0xffff'ffff'ffff'ffff,
             },
-        .max_results = std::min((uint32_t)100, params.limit),
-    });
+        .max_results = limit,
+    };
 
-    // todo: rope
-    std::string result = "{\"rows\":[";
-    bool        found  = false;
-    eosio::for_each_query_result<eosio::contract_secondary_index_with_row<T>>(s, [&](eosio::contract_secondary_index_with_row<T>& r) {
+    using row_type = eosio::contract_secondary_index_with_row<T>;
+    eosio::json_writer w;
+    std::string        json_row;
+    uint32_t           num_found = 0;
+    w.write("{\"rows\":[");
+    eosio::for_each_query_result_paged<row_type>(query, [&](row_type& r) {
+        if (num_found >= limit)
+            return false;
         if (!r.present || !r.row_present)
             return true;
-        if (found)
-            result += ',';
-        found = true;
-        if (params.show_payer)
-            result += "{\"data\":";
-        bool decoded = false;
-        if (table_type) {
-            abieos::input_buffer bin{r.row_value->pos(), r.row_value->pos() + r.row_value->remaining()};
-            std::string          error;
-            std::string          json_row;
-            if (bin_to_json(bin, error, table_type, json_row)) {
-                result += json_row;
-                decoded = true;
-            }
-        }
-        if (!decoded) {
-            result += '"';
-            abieos::hex(r.row_value->pos(), r.row_value->pos() + r.row_value->remaining(), std::back_inserter(result));
-            result += '"';
-        }
-        if (params.show_payer)
-            result += ",\"payer\":\"" + r.payer.to_string() + "\"}";
-        return true;
+        if (num_found)
+            w.write(',');
+        write_table_row(
+            w, params, table_type, r.row_value->pos(), r.row_value->pos() + r.row_value->remaining(), r.payer, json_row);
+        return ++num_found < limit;
     });
-    result += "]}";
-    eosio::set_output_data(result);
+    w.write("]}");
+    eosio::set_output_data(w.sv());
 } // get_table_rows_secondary
 
 void get_table_rows(std::string_view request, const eosio::database_status& status) {
@@ -496,7 +495,6 @@ void get_producer_schedule(std::string_view /*request*/, const eosio::database_s
     });
 
     get_producer_schedule_result producers;
-    std::string                  result;
     eosio::for_each_contract_row<producer_info>(s, [&](eosio::contract_row& r, producer_info* p) {
         producers.rows.push_back(*p);
         producers.total_producer_weight += p->total_votes;
@@ -506,8 +504,9 @@ void get_producer_schedule(std::string_view /*request*/, const eosio::database_s
         return lhs.total_votes > rhs.total_votes;
     });
     producers.rows.resize(producers.rows.size() > 21 ? 21 : producers.rows.size());
-    result += eosio::to_json(producers).sv();
-    eosio::set_output_data(result);
+    eosio::json_writer w;
+    write_json(w, producers);
+    eosio::set_output_data(w.sv());
 }
 
 void get_currency_balance(std::string_view request, const eosio::database_status& status) {
@@ -550,13 +549,13 @@ void get_currency_balance(std::string_view request, const eosio::database_status
     });
 
     std::vector<eosio::asset> balances;
-    std::string               result;
     eosio::for_each_contract_row<account>(s, [&](eosio::contract_row& /*r*/, account* a) {
         balances.emplace_back(a->balance);
         return true;
     });
-    result += eosio::to_json(balances).sv();
-    eosio::set_output_data(result);
+    eosio::json_writer w;
+    write_json(w, balances);
+    eosio::set_output_data(w.sv());
 }
 
 void get_transaction(std::string_view request, const eosio::database_status& /*status*/) {
@@ -579,12 +578,12 @@ void get_transaction(std::string_view request, const eosio::database_status& /*s
         .max_results = 1,
     });
 
-    std::string result;
+    eosio::json_writer w;
     eosio::for_each_query_result<eosio::action_trace>(s, [&](eosio::action_trace& r) {
-        result += to_json(r).sv();
+        write_json(w, r);
         return true;
     });
-    eosio::set_output_data(result);
+    eosio::set_output_data(w.sv());
 }
 
 void get_actions(std::string_view request, const eosio::database_status& /*status*/) {
@@ -608,14 +607,20 @@ void get_actions(std::string_view request, const eosio::database_status& /*statu
         .max_results = uint32_t(std::abs(params.offset)),
     });
 
-    std::vector<eosio::action_trace> actions;
-    std::string                      result;
+    // Results can be large; stream them instead of building the whole array
+    eosio::json_writer w;
+    bool               first = true;
+    eosio::append_output_data(std::string_view{"["});
     eosio::for_each_query_result<eosio::action_trace>(s, [&](eosio::action_trace& r) {
-        actions.emplace_back(r);
+        if (!first)
+            eosio::append_output_data(std::string_view{","});
+        first = false;
+        w.clear();
+        write_json(w, r);
+        eosio::append_output_data(w.sv());
         return true;
     });
-    result += eosio::to_json(actions).sv();
-    eosio::set_output_data(result);
+    eosio::append_output_data(std::string_view{"]"});
 }
 
 void get_block(std::string_view request, const eosio::database_status& /*status*/) {
@@ -632,12 +637,12 @@ void get_block(std::string_view request, const eosio::database_status& /*status*
         .max_results = 1,
     });
 
-    std::string result;
+    eosio::json_writer w;
     eosio::for_each_query_result<eosio::block_info>(s, [&](eosio::block_info& r) {
-        result += to_json(r).sv();
+        write_json(w, r);
         return true;
     });
-    eosio::set_output_data(result);
+    eosio::set_output_data(w.sv());
 }
 
 void get_account(std::string_view request, const eosio::database_status& /*status*/) {
@@ -650,12 +655,12 @@ void get_account(std::string_view request, const eosio::database_status& /*statu
         .max_results    = 1,
     });
 
-    std::string result;
+    eosio::json_writer w;
     eosio::for_each_query_result<eosio::account>(s, [&](eosio::account& r) {
-        result += to_json(r).sv();
+        write_json(w, r);
         return true;
     });
-    eosio::set_output_data(result);
+    eosio::set_output_data(w.sv());
 }
 
 void get_code(std::string_view request, const eosio::database_status& /*status*/) {
@@ -668,13 +673,13 @@ void get_code(std::string_view request, const eosio::database_status& /*status*/
         .max_results    = 1,
     });
 
-    std::string result;
+    eosio::json_writer w;
     eosio::for_each_query_result<eosio::account>(s, [&](eosio::account& r) {
         get_code_result gcr(r);
-        result += eosio::to_json(gcr).sv();
+        write_json(w, gcr);
         return true;
     });
-    eosio::set_output_data(result);
+    eosio::set_output_data(w.sv());
 }
 
 void get_abi(std::string_view request, const eosio::database_status& /*status*/) {
@@ -687,13 +692,13 @@ void get_abi(std::string_view request, const eosio::database_status& /*status*/)
         .max_results    = 1,
     });
 
-    std::string result;
+    eosio::json_writer w;
     eosio::for_each_query_result<eosio::account>(s, [&](eosio::account& r) {
         get_abi_result gar(r);
-        result += eosio::to_json(gar).sv();
+        write_json(w, gar);
         return true;
     });
-    eosio::set_output_data(result);
+    eosio::set_output_data(w.sv());
 }
 struct request_data {
     eosio::shared_memory<std::string_view> target  = {};